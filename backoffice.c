@@ -0,0 +1,440 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "backoffice.h"
+
+static char *progname;
+
+/* Command names, as given on the command line and in job files. */
+static const struct command {
+	const char *name;
+	uint16_t cmd;
+	const char *args;
+} commands[] = {
+	{ "ukey",	BO_UPDATE_UKEY,		"<key> <index> <perms>" },
+	{ "mkey",	BO_UPDATE_MKEY,		"<key> <index> <perms>" },
+	{ "erase",	BO_ERASE_KEY,		"<index>" },
+	{ "nothing",	BO_NOTHING,		"" },
+	{ "state",	BO_MODULE_STATE,	"<state>" },
+	{ "erase-all",	BO_ERASE_ALL,		"" },
+	{ "keys",	BO_UPDATE_KEYS,		"<key> <index> <perms>..." },
+	{ "read",	BO_READ_KEYS,		"<word> [<hexdata>]" },
+	{ "raw",	0,			"<cmd> [<hexdata>]" },
+};
+#define NCOMMANDS	(sizeof(commands) / sizeof(commands[0]))
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s -k <mkey> [-m <mid>] [-n <nonce>] [-o <offset>] <command> [<arg>...]\n", progname);
+	fprintf(stderr, "       %s -k <mkey> -d [<frame>...]\n", progname);
+	fprintf(stderr, "       %s -b <jobs>\n", progname);
+	fprintf(stderr, "commands:\n");
+	for (size_t i = 0; i < NCOMMANDS; i++)
+		fprintf(stderr, "  %-10s%s\n", commands[i].name, commands[i].args);
+	exit(1);
+}
+
+/* AES-128/192/256 key from hex; returns the cipher, or NULL if malformed. */
+static const EVP_CIPHER *
+parse_key(const char *hex, uint8_t *key)
+{
+	size_t len = strlen(hex), i;
+
+	if (len != 32 && len != 48 && len != 64)
+		return NULL;
+	for (i = 0; i < len; i += 2) {
+		if (!isxdigit((unsigned char)hex[i]) || !isxdigit((unsigned char)hex[i + 1]))
+			return NULL;
+		sscanf(hex + i, "%2hhx", &key[i / 2]);
+	}
+
+	return len == 32 ? EVP_aes_128_ecb() : len == 48 ? EVP_aes_192_ecb() : EVP_aes_256_ecb();
+}
+
+/* Hex string to bytes; returns the length, or -1 if malformed or too long. */
+static int
+parse_hex(const char *hex, uint8_t *out, size_t max)
+{
+	size_t len = strlen(hex), i;
+
+	if (len % 2 || len / 2 > max)
+		return -1;
+	for (i = 0; i < len; i += 2) {
+		if (!isxdigit((unsigned char)hex[i]) || !isxdigit((unsigned char)hex[i + 1]))
+			return -1;
+		sscanf(hex + i, "%2hhx", &out[i / 2]);
+	}
+	return len / 2;
+}
+
+static int
+parse_number(const char *s, unsigned long max, unsigned long *value)
+{
+	char *end;
+
+	errno = 0;
+	*value = strtoul(s, &end, 0);
+	return errno == 0 && end != s && *end == '\0' && *value <= max && s[0] != '-';
+}
+
+static void
+print_hex(FILE *f, const uint8_t *data, size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	for (size_t i = 0; i < len; i++) {
+		putc(digits[data[i] >> 4], f);
+		putc(digits[data[i] & 15], f);
+	}
+}
+
+/*
+ * Fill in the command and data of a message from `<command> [<arg>...]`;
+ * returns NULL, or what is wrong with the arguments.
+ */
+static const char *
+build(bo_message_t *m, int argc, char **argv)
+{
+	const struct command *c = NULL;
+	uint8_t key[BO_KEY_SIZE];
+	unsigned long index, perms, value;
+	int n;
+
+	for (size_t i = 0; i < NCOMMANDS; i++)
+		if (strcmp(argv[0], commands[i].name) == 0)
+			c = &commands[i];
+	if (c == NULL)
+		return "unknown command";
+	m->cmd = c->cmd;
+	m->len = 0;
+	argc--;
+	argv++;
+
+	switch (c->cmd) {
+		case BO_UPDATE_UKEY:
+		case BO_UPDATE_MKEY:
+		case BO_UPDATE_KEYS:
+			if (argc == 0 || argc % 3 || (c->cmd != BO_UPDATE_KEYS && argc != 3))
+				return c->cmd == BO_UPDATE_KEYS ? "expected <key> <index> <perms>..." :
+								  "expected <key> <index> <perms>";
+			if (argc / 3 * BO_KEY_ENTRY > BO_MAX_DATA)
+				return "too many keys, at most 10 fit in a message";
+			for (; argc; argc -= 3, argv += 3) {
+				if (parse_hex(argv[0], key, sizeof(key)) != BO_KEY_SIZE)
+					return "key must be 32 hex digits";
+				if (!parse_number(argv[1], UINT32_MAX, &index) ||
+				    !parse_number(argv[2], UINT32_MAX, &perms))
+					return "bad index or perms";
+				bo_put_key(m, key, index, perms);
+			}
+			return NULL;
+		case BO_ERASE_KEY:
+			if (argc != 1 || !parse_number(argv[0], UINT32_MAX, &index))
+				return "expected <index>";
+			m->data[0] = index >> 24;
+			m->data[1] = index >> 16;
+			m->data[2] = index >> 8;
+			m->data[3] = index;
+			m->len = 4;
+			return NULL;
+		case BO_NOTHING:
+		case BO_ERASE_ALL:
+			return argc ? "takes no arguments" : NULL;
+		case BO_MODULE_STATE:
+			if (argc != 1 || !parse_number(argv[0], 0xff, &value))
+				return "expected <state>";
+			m->data[0] = value;
+			m->len = 1;
+			return NULL;
+		case BO_READ_KEYS:
+			if (argc < 1 || argc > 2 || !parse_number(argv[0], 0xffff, &value))
+				return "expected <word> [<hexdata>]";
+			m->data[0] = value >> 8;
+			m->data[1] = value;
+			n = argc == 2 ? parse_hex(argv[1], m->data + 2, BO_MAX_DATA - 2) : 0;
+			if (n < 0)
+				return "bad hex data";
+			m->len = 2 + n;
+			return NULL;
+		default:
+			if (argc < 1 || argc > 2 || !parse_number(argv[0], 0xffff, &value))
+				return "expected <cmd> [<hexdata>]";
+			m->cmd = value;
+			n = argc == 2 ? parse_hex(argv[1], m->data, BO_MAX_DATA) : 0;
+			if (n < 0)
+				return "bad hex data";
+			m->len = n;
+			return NULL;
+	}
+}
+
+/* Print the fields of a message on one line. */
+static void
+describe(FILE *f, const bo_message_t *m)
+{
+	const char *name = NULL;
+	const uint8_t *p;
+
+	for (size_t i = 0; i < NCOMMANDS - 1; i++)
+		if (commands[i].cmd == m->cmd)
+			name = commands[i].name;
+	fprintf(f, "mid %u cmd %04x", m->mid, m->cmd);
+	if (name)
+		fprintf(f, " %s", name);
+
+	switch (m->cmd) {
+		case BO_UPDATE_UKEY:
+		case BO_UPDATE_MKEY:
+		case BO_UPDATE_KEYS:
+			if (m->len == 0 || m->len % BO_KEY_ENTRY)
+				break;
+			for (p = m->data; p < m->data + m->len; p += BO_KEY_ENTRY) {
+				fprintf(f, " key ");
+				print_hex(f, p, BO_KEY_SIZE);
+				fprintf(f, " index %u perms 0x%x", bo_get32(p + 16), bo_get32(p + 20));
+			}
+			return;
+		case BO_ERASE_KEY:
+			if (m->len != 4)
+				break;
+			fprintf(f, " index %u", bo_get32(m->data));
+			return;
+		case BO_MODULE_STATE:
+			if (m->len != 1)
+				break;
+			fprintf(f, " %u", m->data[0]);
+			return;
+		case BO_NOTHING:
+		case BO_ERASE_ALL:
+			if (m->len)
+				break;
+			return;
+	}
+	if (m->len) {
+		fprintf(f, " data ");
+		print_hex(f, m->data, m->len);
+	}
+}
+
+/* Decode one hex frame; returns nonzero if it is not a valid message. */
+static int
+decode(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *cipher, const uint8_t *mkey, const char *hex)
+{
+	uint8_t frame[BO_MAX_FRAME];
+	bo_message_t m;
+	int len, ret;
+
+	len = parse_hex(hex, frame, sizeof(frame));
+	if (len < BO_HEADER + 16) {
+		printf("%s: not a frame\n", hex);
+		return 1;
+	}
+	ret = bo_open(ctx, cipher, mkey, frame, len, &m);
+	printf("nonce %02x%02x offset %u ", frame[0], frame[1], frame[3]);
+	if (ret == BO_SHORT || ret == BO_BAD_CRC) {
+		printf("%s\n", ret == BO_SHORT ? "bad length (wrong key?)" : "bad CRC (wrong key?)");
+		return 1;
+	}
+	describe(stdout, &m);
+	printf("%s\n", ret == BO_BAD_PADDING ? " (padding is not PKCS#7)" : "");
+	return 0;
+}
+
+/*
+ * Batch mode: one frame per line of the job file,
+ *
+ *   <bike> <mkey> <mid> <command> [<arg>...]
+ *
+ * printed as `<bike> <hexframe>`, each with a fresh random nonce. One
+ * cipher context serves the whole job, so the cost per frame is a key
+ * schedule and a few AES blocks.
+ */
+static void
+batch(const char *jobs)
+{
+	char line[4096], *args[64], *s;
+	const EVP_CIPHER *cipher;
+	uint8_t mkey[32], frame[BO_MAX_FRAME], nonce[2];
+	unsigned long mid;
+	const char *err;
+	bo_message_t m;
+	EVP_CIPHER_CTX *ctx;
+	int lineno = 0, count = 0, argc;
+	size_t len;
+	FILE *f;
+
+	f = fopen(jobs, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, jobs, strerror(errno));
+		exit(1);
+	}
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL) {
+		fprintf(stderr, "%s: EVP_CIPHER_CTX_new failed\n", progname);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		argc = 0;
+		for (s = strtok(line, " \t\r\n"); s && argc < 64; s = strtok(NULL, " \t\r\n"))
+			args[argc++] = s;
+		if (argc == 0 || args[0][0] == '#')
+			continue;
+		if (argc < 4) {
+			fprintf(stderr, "%s: %s:%d: expected <bike> <mkey> <mid> <command> [<arg>...]\n",
+				progname, jobs, lineno);
+			exit(1);
+		}
+		cipher = parse_key(args[1], mkey);
+		if (cipher == NULL || !parse_number(args[2], UINT32_MAX, &mid)) {
+			fprintf(stderr, "%s: %s:%d: bad %s\n", progname, jobs, lineno,
+				cipher == NULL ? "key" : "mid");
+			exit(1);
+		}
+		m.mid = mid;
+		err = build(&m, argc - 3, args + 3);
+		if (err) {
+			fprintf(stderr, "%s: %s:%d: %s: %s\n", progname, jobs, lineno, args[3], err);
+			exit(1);
+		}
+
+		if (RAND_bytes(nonce, sizeof(nonce)) != 1 ||
+		    (len = bo_seal(ctx, cipher, mkey, nonce[0] << 8 | nonce[1], 0, &m, frame)) == 0) {
+			fprintf(stderr, "%s: %s:%d: encryption failed\n", progname, jobs, lineno);
+			exit(1);
+		}
+		fputs(args[0], stdout);
+		putchar(' ');
+		print_hex(stdout, frame, len);
+		putchar('\n');
+		count++;
+	}
+	fclose(f);
+	EVP_CIPHER_CTX_free(ctx);
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		fprintf(stderr, "%s: write(stdout): %s\n", progname, strerror(errno));
+		exit(1);
+	}
+	fprintf(stderr, "%s: %d frames\n", progname, count);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *hexkey = NULL, *jobs = NULL, *err;
+	const EVP_CIPHER *cipher;
+	uint8_t mkey[32], frame[BO_MAX_FRAME], nonce[2];
+	unsigned long mid = 0, value;
+	int decoding = 0, have_nonce = 0, offset = 0, opt, ret = 0;
+	char line[4096], *s;
+	EVP_CIPHER_CTX *ctx;
+	bo_message_t m;
+	size_t len;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	modbus_crc_init();
+
+	while ((opt = getopt(argc, argv, "k:m:n:o:db:")) != -1) {
+		switch (opt) {
+			case 'k':
+				hexkey = optarg;
+				break;
+			case 'm':
+				if (!parse_number(optarg, UINT32_MAX, &mid))
+					usage();
+				break;
+			case 'n':
+				if (!parse_number(optarg, 0xffff, &value))
+					usage();
+				nonce[0] = value >> 8;
+				nonce[1] = value;
+				have_nonce = 1;
+				break;
+			case 'o':
+				if (!parse_number(optarg, 0xff, &value))
+					usage();
+				offset = value;
+				break;
+			case 'd':
+				decoding = 1;
+				break;
+			case 'b':
+				jobs = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if ((hexkey == NULL) == (jobs == NULL) || (jobs && (decoding || optind != argc)) ||
+	    (hexkey && !decoding && optind == argc))
+		usage();
+
+	if (jobs) {
+		setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+		batch(jobs);
+		return 0;
+	}
+
+	cipher = parse_key(hexkey, mkey);
+	if (cipher == NULL) {
+		fprintf(stderr, "%s: key must be 32, 48 or 64 hex digits\n", progname);
+		exit(1);
+	}
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL) {
+		fprintf(stderr, "%s: EVP_CIPHER_CTX_new failed\n", progname);
+		exit(1);
+	}
+
+	if (decoding) {
+		/* Frames from the arguments, or the last field of each line of stdin. */
+		for (int i = optind; i < argc; i++)
+			ret |= decode(ctx, cipher, mkey, argv[i]);
+		while (optind == argc && fgets(line, sizeof(line), stdin)) {
+			line[strcspn(line, "\r\n")] = '\0';
+			s = strrchr(line, ' ');
+			if (s) {
+				*s = '\0';
+				printf("%s ", line);
+			}
+			ret |= decode(ctx, cipher, mkey, s ? s + 1 : line);
+		}
+		EVP_CIPHER_CTX_free(ctx);
+		return ret;
+	}
+
+	m.mid = mid;
+	err = build(&m, argc - optind, argv + optind);
+	if (err) {
+		fprintf(stderr, "%s: %s: %s\n", progname, argv[optind], err);
+		exit(1);
+	}
+	if (!have_nonce && RAND_bytes(nonce, sizeof(nonce)) != 1) {
+		fprintf(stderr, "%s: RAND_bytes failed\n", progname);
+		exit(1);
+	}
+	len = bo_seal(ctx, cipher, mkey, nonce[0] << 8 | nonce[1], offset, &m, frame);
+	if (len == 0) {
+		fprintf(stderr, "%s: encryption failed\n", progname);
+		exit(1);
+	}
+	print_hex(stdout, frame, len);
+	putchar('\n');
+
+	EVP_CIPHER_CTX_free(ctx);
+	return 0;
+}
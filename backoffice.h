@@ -0,0 +1,179 @@
+#ifndef _BACKOFFICE_H
+#define _BACKOFFICE_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "modbus.h"
+
+/*
+ * Backoffice messages of the BLE service @5505, written to configure the
+ * keys and the module state of a bike. A frame is
+ *
+ *   nonce (2)  0x01  offset  message, AES-ECB encrypted with the MKEY
+ *
+ * and the message, all fields big endian,
+ *
+ *   M-ID (4)  Cmd (2)  Len (1)  Len bytes of data  CRC (2)  padding
+ *
+ * with the Modbus CRC over everything before it, and PKCS#7 padding to
+ * the AES block size. The data of each command:
+ *
+ *   0001 update UKEY, 0002 update MKEY    key (16) index (4) perms (4)
+ *   0003 erase key                        index (4)
+ *   0004 nothing (always succeeds)        -
+ *   0005 set module state (@5562)         state (1)
+ *   0006 erase all keys                   -
+ *   0007 update multiple keys             key index perms, repeated
+ *   0008 unknown (read keys?)             2 bytes, then any
+ *   0009, 000a unknown (FMNA)
+ */
+#define BO_CONST		0x01
+#define BO_HEADER		4		/* nonce, const, offset */
+
+#define BO_UPDATE_UKEY		0x0001
+#define BO_UPDATE_MKEY		0x0002
+#define BO_ERASE_KEY		0x0003
+#define BO_NOTHING		0x0004
+#define BO_MODULE_STATE		0x0005
+#define BO_ERASE_ALL		0x0006
+#define BO_UPDATE_KEYS		0x0007
+#define BO_READ_KEYS		0x0008
+
+#define BO_KEY_SIZE		16
+#define BO_KEY_ENTRY		(BO_KEY_SIZE + 4 + 4)
+
+#define BO_MAX_DATA		255
+#define BO_MAX_MESSAGE		((4 + 2 + 1 + BO_MAX_DATA + 2 + 16) & ~15)
+#define BO_MAX_FRAME		(BO_HEADER + BO_MAX_MESSAGE)
+
+typedef struct {
+	uint32_t mid;
+	uint16_t cmd;
+	uint8_t len;
+	uint8_t data[BO_MAX_DATA];
+} bo_message_t;
+
+/* Results of bo_unpack(). */
+#define BO_OK			0
+#define BO_SHORT		-1		/* Len runs past the message */
+#define BO_BAD_CRC		-2
+#define BO_BAD_PADDING		1		/* decoded, but not PKCS#7 */
+
+/* The plain message, padded; returns its length, a multiple of 16. */
+static size_t
+bo_pack(const bo_message_t *m, uint8_t *out)
+{
+	size_t n = 0, pad;
+	uint16_t crc;
+
+	out[n++] = m->mid >> 24;
+	out[n++] = m->mid >> 16;
+	out[n++] = m->mid >> 8;
+	out[n++] = m->mid;
+	out[n++] = m->cmd >> 8;
+	out[n++] = m->cmd;
+	out[n++] = m->len;
+	memcpy(out + n, m->data, m->len);
+	n += m->len;
+	crc = modbus_crc(out, n);
+	out[n++] = crc >> 8;
+	out[n++] = crc;
+
+	pad = 16 - n % 16;
+	memset(out + n, pad, pad);
+	return n + pad;
+}
+
+static int
+bo_unpack(const uint8_t *in, size_t len, bo_message_t *m)
+{
+	size_t n, pad;
+
+	if (len < 9 || in[6] + 9u > len)
+		return BO_SHORT;
+	m->mid = (uint32_t)in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+	m->cmd = in[4] << 8 | in[5];
+	m->len = in[6];
+	memcpy(m->data, in + 7, m->len);
+	n = 7 + m->len;
+	if (modbus_crc(in, n) != (in[n] << 8 | in[n + 1]))
+		return BO_BAD_CRC;
+
+	n += 2;
+	pad = len - n;
+	if (pad == 0 || pad > 16)
+		return BO_BAD_PADDING;
+	for (size_t i = n; i < len; i++)
+		if (in[i] != pad)
+			return BO_BAD_PADDING;
+	return BO_OK;
+}
+
+static void
+bo_put_key(bo_message_t *m, const uint8_t *key, uint32_t index, uint32_t perms)
+{
+	uint8_t *p = m->data + m->len;
+
+	memcpy(p, key, BO_KEY_SIZE);
+	p += BO_KEY_SIZE;
+	*p++ = index >> 24;
+	*p++ = index >> 16;
+	*p++ = index >> 8;
+	*p++ = index;
+	*p++ = perms >> 24;
+	*p++ = perms >> 16;
+	*p++ = perms >> 8;
+	*p++ = perms;
+	m->len += BO_KEY_ENTRY;
+}
+
+static uint32_t
+bo_get32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Encrypt a message into a frame; `ctx` is reused between calls, so a
+ * batch only sets a new key per bike. Returns the frame length, 0 if
+ * OpenSSL fails.
+ */
+static size_t
+bo_seal(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *cipher, const uint8_t *mkey, uint16_t nonce,
+	uint8_t offset, const bo_message_t *m, uint8_t *frame)
+{
+	uint8_t plain[BO_MAX_MESSAGE];
+	size_t len = bo_pack(m, plain);
+	int outl;
+
+	frame[0] = nonce >> 8;
+	frame[1] = nonce;
+	frame[2] = BO_CONST;
+	frame[3] = offset;
+	if (!EVP_EncryptInit_ex(ctx, cipher, NULL, mkey, NULL) || !EVP_CIPHER_CTX_set_padding(ctx, 0) ||
+	    !EVP_EncryptUpdate(ctx, frame + BO_HEADER, &outl, plain, len) || (size_t)outl != len)
+		return 0;
+	return BO_HEADER + len;
+}
+
+/* Decrypt a frame; returns a BO_ result, or BO_SHORT if it is not one. */
+static int
+bo_open(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *cipher, const uint8_t *mkey, const uint8_t *frame,
+	size_t len, bo_message_t *m)
+{
+	uint8_t plain[BO_MAX_MESSAGE];
+	int outl;
+
+	len -= BO_HEADER;
+	if (len % 16 || len == 0 || len > sizeof(plain) || frame[2] != BO_CONST)
+		return BO_SHORT;
+	if (!EVP_DecryptInit_ex(ctx, cipher, NULL, mkey, NULL) || !EVP_CIPHER_CTX_set_padding(ctx, 0) ||
+	    !EVP_DecryptUpdate(ctx, plain, &outl, frame + BO_HEADER, len) || (size_t)outl != len)
+		return BO_SHORT;
+	return bo_unpack(plain, len, m);
+}
+
+#endif
@@ -0,0 +1,484 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-b <baud>] [-p <password> | -m <mac>] [-o <capture>] [-t] [-q <ms>] [-w <ms>] [-f <script>] <tty> [<command>...]\n", progname);
+	exit(1);
+}
+
+/*
+ * Drives the debug console (UART7, or UART8 through `bledebug`): logs in,
+ * runs commands and captures everything the bike sends. The main shell
+ * has no prompt, so a command there is done when the line has been quiet
+ * for -q ms; the BLE shell prints "> " and the GSM modem answers OK or
+ * ERROR. `exit` leaves the BLE shell, and is sent as <ESC>[14~ to leave
+ * the GSM one.
+ *
+ * The capture goes through a ring buffer: the tty is read straight into
+ * it and written out from it with writev(), interleaved with a time stamp
+ * per line when -t is given. Into a pipe or onto a terminal it is written
+ * out as soon as a line is complete, so whatever follows sees the lines
+ * live; into a file only when the ring is half full or a command is done.
+ * SIGINT and SIGTERM write out what is left before exiting.
+ */
+#define RING_SIZE	(1 << 20)
+#define RING_MASK	(RING_SIZE - 1)
+#define LINES		(1 << 16)
+#define LINES_MASK	(LINES - 1)
+#define IOV_BATCH	256
+
+static uint8_t ring[RING_SIZE];
+static size_t head, tail;		/* bytes read, bytes written out */
+
+/* Where lines start in the ring, and when their first byte came in. */
+static struct {
+	size_t pos;
+	double time;
+} lines[LINES];
+static size_t line_head, line_tail;
+static int at_line_start = 1;
+
+static int out = STDOUT_FILENO;
+static const char *outname = "stdout";
+static int stamps, streaming;
+static double started;
+static volatile sig_atomic_t stopped;
+
+/* The end of what came in since the last command, for prompts. */
+static char window[128];
+static size_t window_len;
+
+enum { SHELL_MAIN, SHELL_BLE, SHELL_GSM };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Write out everything in the ring; `line_tail` lines get a stamp. */
+static void
+flush_ring(void)
+{
+	struct iovec iov[IOV_BATCH];
+	char stamp[IOV_BATCH / 2][24];
+	size_t pos, end, n;
+	ssize_t w;
+	int i, s;
+
+	while (tail < head) {
+		i = s = 0;
+		pos = tail;
+		while (pos < head && i < IOV_BATCH - 2) {
+			if (stamps && line_tail < line_head && lines[line_tail & LINES_MASK].pos == pos) {
+				snprintf(stamp[s], sizeof(stamp[s]), "[%10.3f] ",
+					 lines[line_tail & LINES_MASK].time - started);
+				iov[i].iov_base = stamp[s];
+				iov[i++].iov_len = strlen(stamp[s++]);
+				line_tail++;
+			}
+
+			/* Up to the next line start, or the end of the ring. */
+			end = head;
+			if (stamps && line_tail < line_head && lines[line_tail & LINES_MASK].pos < end)
+				end = lines[line_tail & LINES_MASK].pos;
+			if (end - pos > RING_SIZE - (pos & RING_MASK))
+				end = pos + RING_SIZE - (pos & RING_MASK);
+			iov[i].iov_base = ring + (pos & RING_MASK);
+			iov[i++].iov_len = end - pos;
+			pos = end;
+		}
+
+		for (n = 0; n < (size_t)i; ) {
+			w = writev(out, iov + n, i - n);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "%s: write(%s): %s\n", progname, outname, strerror(errno));
+				exit(1);
+			}
+			while (n < (size_t)i && (size_t)w >= iov[n].iov_len)
+				w -= iov[n++].iov_len;
+			if (n < (size_t)i) {
+				iov[n].iov_base = (char *)iov[n].iov_base + w;
+				iov[n].iov_len -= w;
+			}
+		}
+		tail = pos;
+	}
+	if (!stamps)
+		line_tail = line_head;
+}
+
+/*
+ * Read what is there into the ring, waiting up to `ms`. Returns the
+ * number of bytes, 0 on time out.
+ */
+static void finish(int status);
+
+static size_t
+fill(int fd, int ms)
+{
+	struct pollfd p = { .fd = fd, .events = POLLIN };
+	size_t room;
+	ssize_t n;
+	double t;
+	int lines_done = 0;
+
+	n = poll(&p, 1, ms);
+	if (stopped)
+		finish(1);
+	if (n <= 0)
+		return 0;
+
+	if (head - tail > RING_SIZE / 2 || line_head - line_tail > LINES / 2)
+		flush_ring();
+	room = RING_SIZE - (head - tail);
+	if (room > RING_SIZE - (head & RING_MASK))
+		room = RING_SIZE - (head & RING_MASK);
+
+	n = read(fd, ring + (head & RING_MASK), room);
+	if (n <= 0) {
+		fprintf(stderr, "%s: read: %s\n", progname, n < 0 ? strerror(errno) : "end of file");
+		flush_ring();
+		exit(1);
+	}
+
+	t = now();
+	for (ssize_t i = 0; i < n; i++) {
+		uint8_t c = ring[(head + i) & RING_MASK];
+
+		if (at_line_start) {
+			lines[line_head & LINES_MASK].pos = head + i;
+			lines[line_head & LINES_MASK].time = t;
+			line_head++;
+			at_line_start = 0;
+		}
+		if (c == '\n')
+			at_line_start = lines_done = 1;
+	}
+
+	if ((size_t)n >= sizeof(window)) {
+		for (size_t i = 0; i < sizeof(window); i++)
+			window[i] = ring[(head + n - sizeof(window) + i) & RING_MASK];
+		window_len = sizeof(window);
+	} else {
+		size_t keep = window_len + n > sizeof(window) ? sizeof(window) - n : window_len;
+
+		memmove(window, window + window_len - keep, keep);
+		for (ssize_t i = 0; i < n; i++)
+			window[keep + i] = ring[(head + i) & RING_MASK];
+		window_len = keep + n;
+	}
+	head += n;
+	if (streaming && lines_done)
+		flush_ring();
+	return n;
+}
+
+static int
+window_has(const char *text)
+{
+	size_t len = strlen(text);
+
+	for (size_t i = 0; i + len <= window_len; i++)
+		if (memcmp(window + i, text, len) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Read until one of `texts` (NULL terminated) comes in, at most `ms` ms;
+ * returns the index of the text, or -1. Without texts, read until the
+ * line has been quiet for `ms` ms.
+ */
+static int
+wait_for(int fd, const char **texts, int ms)
+{
+	double deadline = now() + ms / 1000.0;
+	int left = ms;
+
+	for (;;) {
+		for (int i = 0; texts && texts[i]; i++)
+			if (window_has(texts[i]))
+				return i;
+		if (texts) {
+			left = (deadline - now()) * 1000;
+			if (left <= 0)
+				return -1;
+		}
+		if (fill(fd, left) == 0)
+			return -1;
+	}
+}
+
+static void
+send_line(int fd, const char *text, const char *end)
+{
+	size_t len = strlen(text), n;
+	ssize_t w;
+
+	window_len = 0;
+	for (n = 0; n < len; n += w) {
+		w = write(fd, text + n, len - n);
+		if (w < 0 && errno == EINTR) {
+			if (stopped)
+				finish(1);
+			w = 0;
+		} else if (w < 0) {
+			fprintf(stderr, "%s: write: %s\n", progname, strerror(errno));
+			exit(1);
+		}
+	}
+	if (end)
+		send_line(fd, end, NULL);
+}
+
+static void
+login(int fd, const char *password, int quiet)
+{
+	static const char *prompt[] = { "Login:", NULL };
+	static const char *result[] = { "Welcome", "Login:", NULL };
+	int tries;
+
+	for (tries = 0; tries < 5; tries++) {
+		send_line(fd, "", "\r");
+		if (wait_for(fd, prompt, 1000) == 0)
+			break;
+	}
+	if (tries == 5) {
+		fprintf(stderr, "%s: no login prompt\n", progname);
+		flush_ring();
+		exit(1);
+	}
+
+	send_line(fd, password, "\r");
+	if (wait_for(fd, result, 5000) != 0) {
+		fprintf(stderr, "%s: login failed\n", progname);
+		flush_ring();
+		exit(1);
+	}
+	wait_for(fd, NULL, quiet);
+}
+
+/* Run one command; returns the shell the console is in afterwards. */
+static int
+run(int fd, const char *command, int shell, int quiet, int timeout)
+{
+	static const char *ble_prompt[] = { "\n> ", NULL };
+	static const char *gsm_result[] = { "OK\r\n", "ERROR\r\n", NULL };
+
+	if (shell == SHELL_GSM && strcmp(command, "exit") == 0) {
+		send_line(fd, "\x1b[14~", NULL);
+		wait_for(fd, NULL, quiet);
+		return SHELL_MAIN;
+	}
+
+	send_line(fd, command, "\r");
+
+	switch (shell) {
+		case SHELL_MAIN:
+			if (strcmp(command, "bledebug") == 0) {
+				wait_for(fd, NULL, quiet);
+				send_line(fd, "", "\r");
+				if (wait_for(fd, ble_prompt, timeout) < 0)
+					fprintf(stderr, "%s: no prompt from the BLE shell\n", progname);
+				return SHELL_BLE;
+			}
+			wait_for(fd, NULL, quiet);
+			return strcmp(command, "gsmdebug") == 0 ? SHELL_GSM : SHELL_MAIN;
+		case SHELL_BLE:
+			if (strcmp(command, "exit") == 0) {
+				wait_for(fd, NULL, quiet);
+				return SHELL_MAIN;
+			}
+			if (wait_for(fd, ble_prompt, timeout) < 0)
+				fprintf(stderr, "%s: %s: no prompt after %d ms\n", progname, command, timeout);
+			return SHELL_BLE;
+		default:
+			if (wait_for(fd, gsm_result, timeout) < 0)
+				fprintf(stderr, "%s: %s: no answer after %d ms\n", progname, command, timeout);
+			return SHELL_GSM;
+	}
+}
+
+static void
+stop(int sig)
+{
+	(void)sig;
+	stopped = 1;
+}
+
+/* Write out the rest of the capture and exit. */
+static void
+finish(int status)
+{
+	flush_ring();
+	fprintf(stderr, "%s: %zu bytes in %.2fs\n", progname, head, now() - started);
+	if (out != STDOUT_FILENO && close(out) < 0) {
+		fprintf(stderr, "%s: close(%s): %s\n", progname, outname, strerror(errno));
+		exit(1);
+	}
+	exit(status);
+}
+
+static speed_t
+baud_rate(long baud)
+{
+	static const struct { long baud; speed_t speed; } rates[] = {
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+		{ 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 }, { 921600, B921600 },
+	};
+
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+		if (rates[i].baud == baud)
+			return rates[i].speed;
+	fprintf(stderr, "%s: unsupported baud rate %ld\n", progname, baud);
+	exit(1);
+}
+
+static int
+open_tty(const char *path, long baud)
+{
+	struct termios tio;
+	int fd;
+
+	fd = open(path, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (tcgetattr(fd, &tio) < 0) {
+		fprintf(stderr, "%s: tcgetattr(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, baud_rate(baud));
+	cfsetospeed(&tio, baud_rate(baud));
+	if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+		fprintf(stderr, "%s: tcsetattr(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *password = NULL, *script = NULL;
+	char mac_password[16], line[1024];
+	unsigned int mac[6];
+	int fd, opt, shell = SHELL_MAIN, quiet = 300, timeout = 10000;
+	long baud = 115200;
+	struct sigaction sa = { .sa_handler = stop };
+	struct stat st;
+	FILE *f;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "b:p:m:o:tq:w:f:")) != -1) {
+		switch (opt) {
+			case 'b':
+				baud = strtol(optarg, NULL, 0);
+				break;
+			case 'p':
+				password = optarg;
+				break;
+			case 'm':
+				/* The per-bike password: last three bytes of the MAC, then "DeBug". */
+				if (sscanf(optarg, "%x:%x:%x:%x:%x:%x", &mac[0], &mac[1], &mac[2],
+					   &mac[3], &mac[4], &mac[5]) != 6) {
+					fprintf(stderr, "%s: %s: not a MAC address\n", progname, optarg);
+					exit(1);
+				}
+				snprintf(mac_password, sizeof(mac_password), "%02X%02X%02XDeBug",
+					 mac[3] & 0xff, mac[4] & 0xff, mac[5] & 0xff);
+				password = mac_password;
+				break;
+			case 'o':
+				outname = optarg;
+				out = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+				if (out < 0) {
+					fprintf(stderr, "%s: open(%s): %s\n", progname, optarg, strerror(errno));
+					exit(1);
+				}
+				break;
+			case 't':
+				stamps = 1;
+				break;
+			case 'q':
+				quiet = strtol(optarg, NULL, 0);
+				break;
+			case 'w':
+				timeout = strtol(optarg, NULL, 0);
+				break;
+			case 'f':
+				script = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind >= argc)
+		usage();
+
+	/* No SA_RESTART: the signal has to get poll() out. */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	streaming = fstat(out, &st) < 0 || !S_ISREG(st.st_mode);
+
+	started = now();
+	fd = open_tty(argv[optind++], baud);
+
+	if (password)
+		login(fd, password, quiet);
+
+	for (; optind < argc; optind++)
+		shell = run(fd, argv[optind], shell, quiet, timeout);
+
+	if (script) {
+		f = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+		if (f == NULL) {
+			fprintf(stderr, "%s: open(%s): %s\n", progname, script, strerror(errno));
+			exit(1);
+		}
+		while (fgets(line, sizeof(line), f)) {
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0] == '\0' || line[0] == '#')
+				continue;
+			shell = run(fd, line, shell, quiet, timeout);
+			flush_ring();
+		}
+		if (f != stdin)
+			fclose(f);
+	}
+
+	close(fd);
+	finish(0);
+}
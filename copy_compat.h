@@ -0,0 +1,104 @@
+#ifndef VM_COPY_COMPAT_H
+#define VM_COPY_COMPAT_H 1
+
+/*
+ * Portable file-to-file range copy for the VanMoof host tools.
+ *
+ * On Linux copy_file_range(2) lets the kernel move the bytes (or share the
+ * extents, on filesystems with reflink support) without bouncing them
+ * through user space. It refuses some fd combinations (EXDEV on older
+ * kernels, EINVAL when the output is a pipe), where sendfile(2) still works
+ * as long as the input is a regular file. Neither exists on macOS and the
+ * BSDs in this form, so every caller needs the same pread()/write()
+ * fallback; that lives here. The Makefile defines _GNU_SOURCE on Linux for
+ * the prototypes.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#if defined(__linux__)
+#  include <fcntl.h>
+#  include <sys/ioctl.h>
+#  include <sys/sendfile.h>
+#  include <linux/fs.h>
+#endif
+
+/*
+ * Copy `length` bytes starting at `offset` in `in` to the current position
+ * of `out`. `in` is not moved. Returns 0, or -1 with errno set on a read or
+ * write error (a short read counts as EIO).
+ */
+static inline int copy_range(int in, off_t offset, int out, size_t length)
+{
+	char buffer[8196];
+	size_t total = 0;
+	ssize_t n;
+
+#if defined(__linux__)
+	while (total < length) {
+		off_t off = offset + total;
+		n = copy_file_range(in, &off, out, NULL, length - total, 0);
+		if (n <= 0)
+			break;
+		total += n;
+	}
+	while (total < length) {
+		off_t off = offset + total;
+		n = sendfile(out, in, &off, length - total);
+		if (n <= 0)
+			break;
+		total += n;
+	}
+#endif
+
+	while (total < length) {
+		size_t m = length - total;
+		if (m > sizeof(buffer))
+			m = sizeof(buffer);
+		n = pread(in, buffer, m, offset + total);
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		if (write(out, buffer, n) != n)
+			return -1;
+		total += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Reserve `length` bytes for a file about to be written front to back, so
+ * the filesystem can allocate it in one go. Only a hint: failures (and
+ * platforms without fallocate(2)) are ignored.
+ */
+static inline void preallocate(int fd, off_t length)
+{
+#if defined(__linux__)
+	(void)fallocate(fd, 0, 0, length);
+#else
+	(void)fd;
+	(void)length;
+#endif
+}
+
+/*
+ * Make `out` share all of `in`'s extents (a reflink), on filesystems that
+ * support it (btrfs, XFS). Returns 0, or -1 when the data has to be copied.
+ */
+static inline int clone_file(int in, int out)
+{
+#if defined(__linux__) && defined(FICLONE)
+	return ioctl(out, FICLONE, in);
+#else
+	(void)in;
+	(void)out;
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+#endif /* VM_COPY_COMPAT_H */
@@ -18,6 +18,7 @@
 #include <openssl/asn1.h>
 
 #include "ware.h"
+#include "ware_check.h"
 #include "pack.h"
 
 static char *progname;
@@ -29,26 +30,7 @@ usage(void)
         exit(1);
 }
 
-static const uint32_t crc_poly = 0x4c11db7;
-static const uint32_t initial_crc = 0xffffffff;
-
-static uint32_t crc32_calculate(uint32_t crc, const void *data, size_t length)
-{
-	const uint32_t *p = data;
-	size_t i, b;
-
-	for (i = 0; i < length; i += sizeof(uint32_t)) {
-		crc ^= *p++;
-		for (b = 0; b < 32; b++) {
-			if (crc & (1 << 31))
-				crc = (crc << 1) ^ crc_poly;
-			else
-				crc <<= 1;
-		}
-	}
-
-	return crc;
-}
+static const uint32_t initial_crc = STM32_CRC_INIT;
 
 /*
  * VanMoof bootloaders are pure ARM images with an 8-byte trailer: a
@@ -80,74 +62,28 @@ static const uint8_t *find_bytes(const uint8_t *data, size_t size, const char *t
 	return NULL;
 }
 
-static uint32_t ware_crc(uint32_t crc, const vanmoof_ware_t *ware, const void *data, size_t length)
-{
-	vanmoof_ware_t tmp;
-
-	memcpy(&tmp, ware, sizeof(tmp));
-	tmp.crc = 0xffffffff;
-	tmp.length = 0xffffffff;
-
-	crc = crc32_calculate(crc, &tmp, sizeof(tmp));
-
-	crc = crc32_calculate(crc, data + sizeof(tmp), length - sizeof(tmp));
-
-	return crc;
-}
-
 /*
  * Finalise an application ware in place (the `-w` path): set the length field
  * to the file size, then write ware_crc over the whole image (crc+length
- * blanked) into the crc field. Reuses ware_crc/crc32_calculate above - the same
+ * blanked) into the crc field. ware_stamp() in ware_check.c uses the same
  * MPEG-2 CRC the STM32 hardware unit and the OEM build compute - so a freshly
- * built image (e.g. backupcode.bin) is accepted by the boot loader. Returns 0.
+ * built image (e.g. backupcode.bin) is accepted by the boot loader; pack
+ * --stamp shares it. Returns 0.
  */
 static int stamp_ware(uint8_t *img, size_t size)
 {
-	vanmoof_ware_t ware;
+	uint32_t crc;
 
-	if (size < sizeof(ware) || size % sizeof(uint32_t) != 0) {
+	if (size < sizeof(vanmoof_ware_t) || size % sizeof(uint32_t) != 0) {
 		fprintf(stderr, "%s: image size 0x%zx is not a word-aligned ware\n",
 			progname, size);
 		return 1;
 	}
 
-	memcpy(&ware, img, sizeof(ware));
-	ware.length = htole32((uint32_t)size);
-	ware.crc = htole32(ware_crc(initial_crc, &ware, img, size));
-	memcpy(img, &ware, sizeof(ware));
+	crc = ware_stamp(img, size);
 
 	printf("%s: stamped ware crc 0x%08x length 0x%08zx\n",
-	       progname, le32toh(ware.crc), size);
-	return 0;
-}
-
-static int test_arm(uint8_t *data, size_t len)
-{
-	if (data[3] != 0x20) // stack pointer must be inside RAM
-		return 0;
-
-	uint32_t *p = (uint32_t *)(data + 4);
-	uint32_t match = 0;
-	int vcount = 0;
-	int mcount = 0;
-
-	// Test for similar vectors
-	for (int i = 0; i < 15; i++) {
-		uint32_t offset = le32toh(p[i]);
-		if (offset) {
-			vcount++;
-			if (match && !((match ^ offset) & 0xffff0000)) {
-				mcount++;
-			} else {
-				match = offset;
-				mcount = 1;
-			}
-		}
-	}
-	if (vcount > 5 && (vcount - mcount) < 3)
-		return 1;
-
+	       progname, crc, size);
 	return 0;
 }
 
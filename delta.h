@@ -0,0 +1,42 @@
+#ifndef _DELTA_H
+#define _DELTA_H 1
+
+#include <stdint.h>
+
+/*
+ * Delta from one image (a PACK, or a single ware) to the next, as written
+ * by packdiff and applied by packpatch. The header is followed by three
+ * zlib streams, in this order:
+ *
+ *   ctrl:  delta_ctrl_t records
+ *   diff:  bytes to add to the old image, one per byte of each diff run
+ *   extra: new bytes that have no counterpart in the old image
+ *
+ * Each ctrl record adds `diff` bytes of old image + diff stream, then
+ * copies `extra` bytes from the extra stream, then moves the old image
+ * position by `seek` (which may be negative). All fields little endian;
+ * the CRCs are zlib crc32 over the whole image.
+ */
+#define DELTA_MAGIC	"VMDELTA1"
+
+typedef struct {
+	char magic[8];
+	uint32_t old_length;
+	uint32_t old_crc;
+	uint32_t new_length;
+	uint32_t new_crc;
+	uint32_t ctrl_length;		/* uncompressed */
+	uint32_t ctrl_zlength;		/* compressed */
+	uint32_t diff_length;
+	uint32_t diff_zlength;
+	uint32_t extra_length;
+	uint32_t extra_zlength;
+} delta_header_t;
+
+typedef struct {
+	int32_t diff;
+	int32_t extra;
+	int32_t seek;
+} delta_ctrl_t;
+
+#endif
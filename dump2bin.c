@@ -0,0 +1,523 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "endian_compat.h"
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-a <addr>] [-n <size>] [-f <fill>] [-c <command>] <capture>... <binary>\n", progname);
+	exit(1);
+}
+
+/*
+ * Turns console captures back into a binary. Two kinds of lines are
+ * recognised anywhere in the capture, the rest is skipped:
+ *
+ *   [prefix ]AAAAAAAA<TAB>xx xx xx xx xx xx xx xx   xx xx .. xx<TAB>text
+ *
+ * from dump_dataline() (keys.c logs it with a "[keys.c:174] dump_dataline: "
+ * prefix, dump.c prints it bare, in upper case), and the S1/S2/S3 records
+ * of srec.c. Every line is placed at its own address, so a line lost or
+ * repeated on the serial link leaves a hole or a duplicate instead of
+ * shifting the rest of the image. A dataline whose text column does not
+ * match its hex bytes, or an S-record with a bad checksum, is dropped and
+ * shows up as a hole.
+ *
+ * Holes are listed at the end as dump commands (`help` for patch-dump by
+ * default, -c for another one) on stdout; capture their output and pass
+ * both captures to fill them in. Where captures overlap the last one wins.
+ */
+#define PAGE_SIZE	4096
+#define PAGE_MASK	(PAGE_SIZE - 1)
+
+typedef struct {
+	uint32_t base;
+	uint8_t data[PAGE_SIZE];
+	uint64_t have[PAGE_SIZE / 64];		/* bytes seen */
+} page_t;
+
+static page_t **pages;				/* sorted by base */
+static size_t npages, pages_size;
+static size_t last_page;
+
+static struct {
+	size_t lines, datalines, records, bad, bytes, duplicates, conflicts;
+} stats;
+
+static void *
+xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, size);
+		exit(1);
+	}
+	return p;
+}
+
+/* The page holding `addr`; NULL if there is none and not `create`. */
+static page_t *
+page_of(uint32_t addr, int create)
+{
+	uint32_t base = addr & ~PAGE_MASK;
+	size_t lo = 0, hi = npages, mid;
+	page_t *p;
+
+	/* Dumps run upwards, so it is nearly always the last page or the next. */
+	if (last_page < npages && pages[last_page]->base == base)
+		return pages[last_page];
+	if (last_page + 1 < npages && pages[last_page + 1]->base == base)
+		return pages[++last_page];
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pages[mid]->base < base)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < npages && pages[lo]->base == base)
+		return pages[last_page = lo];
+	if (!create)
+		return NULL;
+
+	if (npages == pages_size) {
+		pages_size = pages_size ? pages_size * 2 : 64;
+		pages = xrealloc(pages, pages_size * sizeof(*pages));
+	}
+	p = xrealloc(NULL, sizeof(*p));
+	p->base = base;
+	memset(p->data, 0, sizeof(p->data));
+	memset(p->have, 0, sizeof(p->have));
+	memmove(pages + lo + 1, pages + lo, (npages - lo) * sizeof(*pages));
+	pages[lo] = p;
+	npages++;
+	return pages[last_page = lo];
+}
+
+/* Put `len` bytes at `addr`, counting a repeat of bytes already seen. */
+static void
+place(uint32_t addr, const uint8_t *data, size_t len)
+{
+	uint32_t start = addr;
+	int seen = 0, differs = 0;
+	size_t off, n;
+	page_t *p;
+
+	while (len) {
+		p = page_of(addr, 1);
+		off = addr & PAGE_MASK;
+		n = PAGE_SIZE - off < len ? PAGE_SIZE - off : len;
+		for (size_t i = 0; i < n; i++) {
+			if (p->have[(off + i) / 64] & (1ULL << ((off + i) % 64))) {
+				seen = 1;
+				differs |= p->data[off + i] != data[i];
+			}
+			p->have[(off + i) / 64] |= 1ULL << ((off + i) % 64);
+		}
+		memcpy(p->data + off, data, n);
+		addr += n;
+		data += n;
+		len -= n;
+		stats.bytes += n;
+	}
+	if (differs) {
+		fprintf(stderr, "%s: %08x: differs from the earlier dump, keeping the last\n", progname, start);
+		stats.conflicts++;
+	}
+	else if (seen)
+		stats.duplicates++;
+}
+
+/*
+ * Hex to binary, eight characters at a time in a 64-bit word: a byte
+ * is a hex digit when it is in '0'..'9' or, with the case bit set, in
+ * 'a'..'f'; its value is the low nibble, plus 9 for a letter. Returns
+ * 0 if any of the 2 * len characters is not a hex digit. len is a
+ * multiple of 4.
+ */
+#define ONES		0x0101010101010101ULL
+#define HIGHS		0x8080808080808080ULL
+#define BETWEEN(x, m, n) \
+	((((ONES * (127 + (n))) - ((x) & (ONES * 127))) & ~(x) & \
+	  (((x) & (ONES * 127)) + ONES * (127 - (m)))) & HIGHS)
+
+static int
+unhex(uint8_t *out, const char *hex, size_t len)
+{
+	uint64_t w, v;
+
+	for (; len >= 4; len -= 4, hex += 8, out += 4) {
+		memcpy(&w, hex, 8);
+		w = le64toh(w);
+		if ((BETWEEN(w, '0' - 1, '9' + 1) | BETWEEN(w | (ONES * 0x20), 'a' - 1, 'f' + 1)) != HIGHS)
+			return 0;
+
+		v = (w & (ONES * 0x0f)) + ((w >> 6) & ONES) * 9;
+		/* First character of a pair is the high nibble. */
+		v = ((v & 0x000f000f000f000fULL) << 4) | ((v >> 8) & 0x000f000f000f000fULL);
+		v = (v | (v >> 8)) & 0x0000ffff0000ffffULL;
+		v = (v | (v >> 16)) & 0xffffffffULL;
+		out[0] = v;
+		out[1] = v >> 8;
+		out[2] = v >> 16;
+		out[3] = v >> 24;
+	}
+	return len == 0;
+}
+
+static int
+hex_digit(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * "AAAAAAAA\txx xx .. xx   xx .. xx\ttext"; `tab` is the first tab in
+ * the line. Returns 0 if it is not a dataline, -1 if it is a bad one.
+ */
+#define HEX_COLUMN	(16 * 3 - 1 + 2)
+
+static int
+dataline(const char *line, const char *tab, const char *end)
+{
+	char addr_hex[8], hex[32];
+	uint8_t addr[4], data[16];
+	const char *h, *t;
+	int c;
+
+	if (tab - line < 8 || (tab - line > 8 && hex_digit(tab[-9]) >= 0))
+		return 0;
+	memcpy(addr_hex, tab - 8, 8);
+	if (!unhex(addr, addr_hex, 4))
+		return 0;
+
+	h = tab + 1;
+	if (end - h < HEX_COLUMN + 1 || h[HEX_COLUMN] != '\t')
+		return 0;
+	for (int i = 0; i < 16; i++) {
+		const char *b = h + 3 * i + (i >= 8 ? 2 : 0);
+
+		if (i > 0 && b[-1] != ' ')
+			return 0;
+		hex[2 * i] = b[0];
+		hex[2 * i + 1] = b[1];
+	}
+	stats.datalines++;
+	if (!unhex(data, hex, 16))
+		return -1;
+
+	/* The text column repeats the bytes: a cheap check on the hex. */
+	t = h + HEX_COLUMN + 1;
+	if (end - t < 17)
+		return -1;
+	for (int i = 0, j = 0; i < 16; i++, j++) {
+		if (i == 8 && t[j++] != ' ')
+			return -1;
+		c = 0x1f < data[i] && data[i] < 0x7f ? data[i] : '.';
+		if (t[j] != c)
+			return -1;
+	}
+
+	place((uint32_t)addr[0] << 24 | addr[1] << 16 | addr[2] << 8 | addr[3], data, 16);
+	return 1;
+}
+
+/* "Stcc[aaaa..]dd..ss". Returns 0 if it is not an S-record, -1 if bad. */
+static int
+srecord(const char *s, const char *end)
+{
+	static const int addr_len[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+	static size_t counted;
+	uint8_t rec[256 + 4], sum = 0;
+	int type, count, hi, lo;
+	uint32_t addr = 0;
+	size_t i;
+
+	if (end - s < 4 || s[0] != 'S' || s[1] < '0' || s[1] > '9' || s[1] == '4')
+		return 0;
+	type = s[1] - '0';
+	hi = hex_digit(s[2]);
+	lo = hex_digit(s[3]);
+	if (hi < 0 || lo < 0)
+		return 0;
+	count = hi << 4 | lo;
+	if (count < addr_len[type] + 1 || end - s < 4 + 2 * count)
+		return 0;
+
+	stats.records++;
+	rec[0] = count;
+	if (!unhex(rec + 1, s + 4, count & ~3))
+		return -1;
+	for (i = count & ~3; i < (size_t)count; i++) {
+		hi = hex_digit(s[4 + 2 * i]);
+		lo = hex_digit(s[5 + 2 * i]);
+		if (hi < 0 || lo < 0)
+			return -1;
+		rec[1 + i] = hi << 4 | lo;
+	}
+	for (i = 0; i <= (size_t)count; i++)
+		sum += rec[i];
+	if (sum != 0xff)
+		return -1;
+
+	for (i = 0; i < (size_t)addr_len[type]; i++)
+		addr = addr << 8 | rec[1 + i];
+	switch (type) {
+		case 1: case 2: case 3:
+			place(addr, rec + 1 + addr_len[type], count - addr_len[type] - 1);
+			counted++;
+			break;
+		case 5: case 6:
+			if (addr != (counted & (type == 5 ? 0xffff : 0xffffff)))
+				fprintf(stderr, "%s: S%d says %u records, %zu came in\n", progname, type,
+					addr, counted);
+			break;
+		case 0:
+			counted = 0;
+			break;
+	}
+	return 1;
+}
+
+static void
+line(const char *s, const char *end)
+{
+	const char *tab, *p;
+	int r = 0;
+
+	stats.lines++;
+	while (end > s && (end[-1] == '\r' || end[-1] == '\n'))
+		end--;
+
+	tab = memchr(s, '\t', end - s);
+	if (tab) {
+		r = dataline(s, tab, end);
+	} else {
+		/* srec.c starts a line with the record, but skip terminal noise. */
+		for (p = s; r == 0 && (p = memchr(p, 'S', end - p)) != NULL; p++)
+			r = srecord(p, end);
+	}
+	if (r < 0)
+		stats.bad++;
+}
+
+static void
+parse(const char *path)
+{
+	static char buf[1 << 20];
+	size_t fill = 0, start;
+	char *nl;
+	ssize_t n;
+	int fd;
+
+	fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+
+	for (;;) {
+		n = read(fd, buf + fill, sizeof(buf) - fill);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: read(%s): %s\n", progname, path, strerror(errno));
+			exit(1);
+		}
+		fill += n;
+
+		start = 0;
+		while ((nl = memchr(buf + start, '\n', fill - start)) != NULL) {
+			line(buf + start, nl);
+			start = nl + 1 - buf;
+		}
+		/* No room left for the line: not a dump line, drop it. */
+		if (start == 0 && fill == sizeof(buf))
+			start = fill;
+		memmove(buf, buf + start, fill - start);
+		fill -= start;
+
+		if (n == 0)
+			break;
+	}
+	if (fill)
+		line(buf, buf + fill);
+	if (fd != STDIN_FILENO)
+		close(fd);
+}
+
+static int
+covered(uint32_t addr)
+{
+	page_t *p = page_of(addr, 0);
+
+	return p && (p->have[(addr & PAGE_MASK) / 64] & (1ULL << (addr % 64)));
+}
+
+/* Next address from `addr` (below `end`) that is, or is not, covered. */
+static uint64_t
+next(uint64_t addr, uint64_t end, int want)
+{
+	page_t *p;
+	uint64_t w;
+
+	while (addr < end) {
+		p = page_of(addr, 0);
+		if (p == NULL) {
+			if (want)
+				addr = (addr | PAGE_MASK) + 1;
+			else
+				return addr;
+			continue;
+		}
+		w = p->have[(addr & PAGE_MASK) / 64];
+		w = (want ? w : ~w) >> (addr % 64);
+		if (w == 0) {
+			addr = (addr | 63) + 1;
+			continue;
+		}
+		addr += __builtin_ctzll(w);
+		break;
+	}
+	return addr < end ? addr : end;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *command = "help", *output;
+	uint64_t first = 0, last = 0, from, to, a, b, dump_from = 0, dump_to = 0;
+	int opt, have_first = 0, have_size = 0, fill = 0xff, fd;
+	unsigned long holes = 0, missing = 0;
+	uint8_t chunk[PAGE_SIZE];
+	double started;
+	struct timespec ts;
+	size_t n;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "a:n:f:c:")) != -1) {
+		switch (opt) {
+			case 'a':
+				first = strtoul(optarg, NULL, 16);
+				have_first = 1;
+				break;
+			case 'n':
+				last = strtoul(optarg, NULL, 16);
+				have_size = 1;
+				break;
+			case 'f':
+				fill = strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				command = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind < 2)
+		usage();
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	started = ts.tv_sec + ts.tv_nsec / 1e9;
+	for (int i = optind; i < argc - 1; i++)
+		parse(argv[i]);
+	output = argv[argc - 1];
+
+	if (npages == 0) {
+		fprintf(stderr, "%s: no dump lines in %zu lines\n", progname, stats.lines);
+		exit(1);
+	}
+	if (!have_first)
+		first = next(pages[0]->base, (uint64_t)pages[0]->base + PAGE_SIZE, 1);
+	if (have_size) {
+		last += first;
+	} else {
+		page_t *p = pages[npages - 1];
+
+		/* One past the last byte seen. */
+		for (last = p->base + PAGE_SIZE; last > p->base && !covered(last - 1); last--)
+			;
+	}
+	if (last > 1ULL << 32 || last <= first) {
+		fprintf(stderr, "%s: empty range %llx..%llx\n", progname, (unsigned long long)first,
+			(unsigned long long)last);
+		exit(1);
+	}
+
+	fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, output, strerror(errno));
+		exit(1);
+	}
+	for (a = first; a < last; a += n) {
+		page_t *p = page_of(a, 0);
+
+		n = PAGE_SIZE - (a & PAGE_MASK);
+		if (n > last - a)
+			n = last - a;
+		for (size_t i = 0; i < n; i++)
+			chunk[i] = p && (p->have[((a + i) & PAGE_MASK) / 64] & (1ULL << ((a + i) % 64))) ?
+				p->data[(a + i) & PAGE_MASK] : fill;
+		if (write(fd, chunk, n) != (ssize_t)n) {
+			fprintf(stderr, "%s: write(%s): %s\n", progname, output, strerror(errno));
+			exit(1);
+		}
+	}
+	if (close(fd) < 0) {
+		fprintf(stderr, "%s: close(%s): %s\n", progname, output, strerror(errno));
+		exit(1);
+	}
+
+	/* Holes, as the 16-byte aligned dumps that fill them. */
+	for (from = next(first, last, 0); from < last; from = next(to, last, 0)) {
+		to = next(from, last, 1);
+		fprintf(stderr, "%s: hole at %08llx, %llu bytes\n", progname, (unsigned long long)from,
+			(unsigned long long)(to - from));
+		holes++;
+		missing += to - from;
+
+		a = from & ~0xfULL;
+		b = (to + 0xf) & ~0xfULL;
+		if (holes > 1 && a <= dump_to) {
+			dump_to = b;
+			continue;
+		}
+		if (holes > 1)
+			printf("%s %llx %llx\n", command, (unsigned long long)dump_from,
+			       (unsigned long long)(dump_to - dump_from));
+		dump_from = a;
+		dump_to = b;
+	}
+	if (holes)
+		printf("%s %llx %llx\n", command, (unsigned long long)dump_from,
+		       (unsigned long long)(dump_to - dump_from));
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	fprintf(stderr, "%s: %zu lines, %zu datalines, %zu S-records, %zu bad, %zu duplicates, %zu conflicting\n",
+		progname, stats.lines, stats.datalines, stats.records, stats.bad, stats.duplicates, stats.conflicts);
+	fprintf(stderr, "%s: %08llx..%08llx, %llu bytes, %lu holes (%lu bytes) in %.3fs\n", progname,
+		(unsigned long long)first, (unsigned long long)last, (unsigned long long)(last - first),
+		holes, missing, ts.tv_sec + ts.tv_nsec / 1e9 - started);
+	return holes ? 2 : 0;
+}
@@ -0,0 +1,147 @@
+typedef unsigned char uint8_t;
+typedef unsigned int uint32_t;
+typedef uint32_t size_t;
+
+#include "slipdump.h"
+
+#define UART7_START 0x40007800
+#define WWDG_START  0x40002c00
+
+#define RECV_IDLE   0x100
+
+typedef struct {
+	volatile uint32_t CR;
+} WWDG_t;
+
+typedef struct {
+	volatile uint32_t SR;
+	volatile uint32_t DR;
+	volatile uint32_t BRR;
+	volatile uint32_t CR1;
+} UART_t;
+
+typedef uint32_t (*strtoul_t) (const char *, char **, uint32_t base);
+typedef void (*help_t) (void);
+
+static void send_frame(uint32_t seq, const uint8_t *data, uint32_t n);
+static uint32_t uart_recv(void);
+
+/*
+ * `help <addr> <n>` like dump.c, but as binary SLIP frames for slipdump
+ * (see slipdump.h): about a byte on the line per byte of memory, where
+ * the hexdump takes almost five. Has to fit in the same 416 bytes.
+ */
+void
+dump(const char *args)
+{
+	UART_t *uart = (void *)UART7_START;
+	strtoul_t strtoul = (strtoul_t)(0x3f8c8 + 1);
+	help_t help = (help_t)(0x35e04 + 1);
+	char *end;
+	uint32_t addr;
+	uint32_t n;
+	uint32_t seq;
+	uint32_t c;
+
+	addr = strtoul(args, &end, 16);
+	if (*end != ' ') {
+		help();
+		return;
+	}
+
+	n = strtoul(end + 1, &end, 16);
+
+	uint32_t cr1 = uart->CR1;
+	uart->CR1 = cr1 & ~(0x1f0);
+
+	for (seq = 0; seq * SLIP_BLOCK < n; seq++)
+		send_frame(seq, (const uint8_t *)addr, n);
+
+	/* The end frame, then whatever the host asks for until it is done. */
+	seq = SLIP_LAST;
+	for (;;) {
+		send_frame(seq, (const uint8_t *)addr, n);
+		c = uart_recv();
+		if (c == SLIP_QUIT || c == RECV_IDLE)
+			break;
+		seq = SLIP_LAST;
+		if (c == SLIP_RESEND) {
+			seq = uart_recv();
+			seq |= uart_recv() << 8;
+		}
+	}
+
+	while (!(uart->SR & 0x40))
+		/* wait */;
+	uart->CR1 = cr1;
+}
+
+static void wdg(void)
+{
+	WWDG_t *WWDG = (void *)WWDG_START;
+	WWDG->CR = 0x7f;
+}
+
+static void uart_put(uint8_t c)
+{
+	UART_t *UART7 = (void *)UART7_START;
+
+	while (!(UART7->SR & 0x80))
+		/* wait */;
+	UART7->DR = c;
+}
+
+/* Send one byte escaped, and add it to the CRC. */
+static uint32_t slip_put(uint32_t crc, uint8_t c)
+{
+	uint32_t bit;
+
+	crc ^= c;
+	for (bit = 0; bit < 8; bit++)
+		crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+
+	if (c == SLIP_END || c == SLIP_ESC) {
+		uart_put(SLIP_ESC);
+		c = c == SLIP_END ? SLIP_ESC_END : SLIP_ESC_ESC;
+	}
+	uart_put(c);
+	return crc;
+}
+
+static void
+send_frame(uint32_t seq, const uint8_t *data, uint32_t n)
+{
+	uint32_t off = seq * SLIP_BLOCK;
+	uint32_t len = 0;
+	uint32_t crc = 0xffff;
+	uint32_t i;
+
+	if (off < n)
+		len = n - off < SLIP_BLOCK ? n - off : SLIP_BLOCK;
+
+	uart_put(SLIP_END);
+	crc = slip_put(crc, seq & 0xff);
+	crc = slip_put(crc, seq >> 8);
+	for (i = 0; i < len; i++)
+		crc = slip_put(crc, data[off + i]);
+	i = crc;
+	slip_put(0, i & 0xff);
+	slip_put(0, i >> 8);
+	uart_put(SLIP_END);
+
+	wdg();
+}
+
+static uint32_t uart_recv(void)
+{
+	UART_t *UART7 = (void *)UART7_START;
+	uint32_t i;
+
+	for (i = 0; i < SLIP_IDLE; i++) {
+		if (UART7->SR & 0x20)
+			return UART7->DR & 0xff;
+		if (!(i & 0xffff))
+			wdg();
+	}
+	return RECV_IDLE;
+}
@@ -0,0 +1,330 @@
+import sys
+import os
+import argparse
+import random
+import select
+import struct
+import time
+import tty
+
+
+# A stand-in for the bike's debug console on a pseudo terminal, to run
+# the console driver (or a terminal program) against without a bike. It
+# prints the name of the pty, asks for a login, and answers a handful of
+# commands in the main shell, the BLE shell (`bledebug`, prompt "> ") and
+# the GSM modem (`gsmdebug`, left with <ESC>[14~). Memory dumps come from
+# --image, or random bytes, in the format of keys.c's dump_dataline.
+# `rtos-statistics` (`dump stats` on patched bleware) prints a memory
+# report every --stats-interval seconds until the next command, with the
+# heap leaking --leak bytes per report. `help <addr> <n>` in the main
+# shell answers as patch-dump does, as a hexdump or, with --payload slip,
+# in the SLIP frames of dumpslip.c (see slipdump.h), garbling --noise of
+# them. The output is paced to --baud.
+
+BLE_HELP = '''The following commands are available:
+
+    log-dump <start-index> <n>        - print <n> blocks starting at address <start-index>
+    dump                              - dump keys/memory/extflash
+    info/ver                          - show basic firmware info
+    rtos-statistics                   - dump memory stats every 500ms
+    exit                              - exit from shell
+    help                              - show all monitor commands
+'''
+
+MAIN_HELP = '''Available commands:
+help              This tekst
+ver               Software version
+bledebug          redirect uart8
+gsmdebug          redirect uart2
+logprn            Print log
+'''
+
+TASKS = [('idle', 512, 212), ('ble', 2048, 1236), ('main', 1536, 804), ('log', 1024, 560)]
+
+SLIP_END, SLIP_ESC, SLIP_ESC_END, SLIP_ESC_ESC = 0xc0, 0xdb, 0xdc, 0xdd
+SLIP_BLOCK = 128
+SLIP_LAST = 0xffff
+SLIP_IDLE = 1.0
+
+
+def modbus_crc(data):
+    crc = 0xffff
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xa001 if crc & 1 else crc >> 1
+    return crc
+
+
+VERSION = '''ES3.0 Main  1.09.03 (10:30:52 Apr 30 2025)
+BLEWare     1.4.01
+CMD_BLE_MAC F8:8A:5E:12:34:56
+'''
+
+
+class Console:
+    def __init__(self, fd, args):
+        self.fd = fd
+        self.baud = args.baud
+        self.password = args.password
+        self.memory = args.memory
+        self.shell = 'login'
+        self.line = bytearray()
+        self.line_free = time.monotonic()
+        self.stats_interval = args.stats_interval
+        self.leak = args.leak
+        self.stats_next = None
+        self.reports = 0
+        self.peaks = [peak for name, size, peak in TASKS]
+        self.rng = random.Random(2)
+        self.payload = args.payload
+        self.noise = args.noise
+        self.slip = None
+        self.slip_request = bytearray()
+        self.slip_deadline = None
+
+    def send(self, text):
+        # Write at line rate: 10 bits per byte.
+        data = text.replace('\n', '\r\n').encode('latin-1') if isinstance(text, str) else text
+        for i in range(0, len(data), 256):
+            chunk = data[i:i + 256]
+            self.line_free = max(self.line_free, time.monotonic()) + len(chunk) * 10 / self.baud
+            os.write(self.fd, chunk)
+            delay = self.line_free - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+
+    def dataline(self, addr, data):
+        hexes = ' '.join(f'{b:02x}' for b in data[:8]) + '   ' + ' '.join(f'{b:02x}' for b in data[8:])
+        text = ''.join(chr(b) if 0x1f < b < 0x7f else '.' for b in data)
+        return f'[keys.c:174] dump_dataline: {addr:08x}\t{hexes}\t{text[:8]} {text[8:]}\n'
+
+    def dump(self, addr, n):
+        addr &= ~0xf
+        n = (n + 0xf) & ~0xf
+        lines = []
+        for a in range(addr, addr + n, 16):
+            lines.append(self.dataline(a, self.memory[a % len(self.memory):][:16].ljust(16, b'\xff')))
+            if len(lines) == 64:
+                self.send(''.join(lines))
+                lines = []
+        self.send(''.join(lines))
+
+    def hexdump(self, addr, n):
+        # dump.c: no prefix, upper case, 16 bytes a line.
+        addr &= ~0xf
+        n = (n + 0xf) & ~0xf
+        lines = []
+        for a in range(addr, addr + n, 16):
+            data = self.memory[a % len(self.memory):][:16].ljust(16, b'\xff')
+            hexes = ' '.join(f'{b:02X}' for b in data[:8]) + '   ' + ' '.join(f'{b:02X}' for b in data[8:])
+            text = ''.join(chr(b) if 0x1f < b < 0x7f else '.' for b in data)
+            lines.append(f'{a:08X}\t{hexes}\t{text[:8]} {text[8:]}\n')
+            if len(lines) == 64:
+                self.send(''.join(lines))
+                lines = []
+        self.send(''.join(lines))
+
+    def slip_frame(self, seq):
+        addr, n = self.slip
+        off = seq * SLIP_BLOCK
+        data = b''
+        if off < n:
+            start = (addr + off) % len(self.memory)
+            data = self.memory[start:start + min(SLIP_BLOCK, n - off)].ljust(min(SLIP_BLOCK, n - off), b'\xff')
+        body = struct.pack('<H', seq & 0xffff) + data
+        body += struct.pack('<H', modbus_crc(body))
+        if self.rng.random() < self.noise:
+            body = bytearray(body)
+            body[self.rng.randrange(len(body))] ^= 1 << self.rng.randrange(8)
+        frame = bytearray([SLIP_END])
+        for b in body:
+            if b == SLIP_END:
+                frame += bytes([SLIP_ESC, SLIP_ESC_END])
+            elif b == SLIP_ESC:
+                frame += bytes([SLIP_ESC, SLIP_ESC_ESC])
+            else:
+                frame.append(b)
+        frame.append(SLIP_END)
+        return bytes(frame)
+
+    def slip_dump(self, addr, n):
+        # dumpslip.c: the blocks, the end frame, then requests until 'Q'.
+        self.slip = (addr, n)
+        frames = []
+        for seq in range((n + SLIP_BLOCK - 1) // SLIP_BLOCK):
+            frames.append(self.slip_frame(seq))
+            if len(frames) == 64:
+                self.send(b''.join(frames))
+                frames = []
+        self.send(b''.join(frames) + self.slip_frame(SLIP_LAST))
+        self.shell = 'slip'
+        self.slip_deadline = time.monotonic() + SLIP_IDLE
+
+    def slip_feed(self, c):
+        self.slip_deadline = time.monotonic() + SLIP_IDLE
+        if self.slip_request:
+            self.slip_request.append(c)
+            if len(self.slip_request) == 3:
+                self.send(self.slip_frame(self.slip_request[1] | self.slip_request[2] << 8))
+                self.slip_request.clear()
+        elif c == ord('R'):
+            self.slip_request.append(c)
+        elif c == ord('Q'):
+            self.slip_done()
+        else:
+            self.send(self.slip_frame(SLIP_LAST))
+
+    def slip_done(self):
+        self.shell = 'main'
+        self.slip_deadline = None
+        self.slip_request.clear()
+
+    def timer(self):
+        deadlines = [t for t in (self.stats_next, self.slip_deadline) if t is not None]
+        return min(deadlines) if deadlines else None
+
+    def expire(self):
+        if self.slip_deadline is not None and time.monotonic() >= self.slip_deadline:
+            self.slip_done()
+        if self.stats_next is not None and time.monotonic() >= self.stats_next:
+            self.stats()
+
+    def stats(self):
+        # Allocations come and go; a leak only moves the bottom up. Stack
+        # peaks grow while the tasks warm up.
+        total = 20480
+        used = min(total, 12288 + self.rng.randrange(0, 2048, 8) + self.leak * self.reports)
+        free = total - used
+        report = [f'Heap: total {total}, used {used}, free {free}, largest {max(0, free - self.rng.randrange(0, 1024, 8))}\n']
+        for i, (name, size, peak) in enumerate(TASKS):
+            if self.reports < 200 and self.rng.random() < 0.02:
+                self.peaks[i] = min(size, self.peaks[i] + self.rng.randrange(4, 36, 4))
+            report.append(f'Task {name}: stack {size}, peak {self.peaks[i]}\n')
+        self.reports += 1
+        self.send(''.join(report))
+        self.stats_next += self.stats_interval
+
+    def command(self, text):
+        if self.shell == 'login':
+            if text == self.password:
+                self.shell = 'main'
+                self.send('\nWelcome to ES3\n')
+            else:
+                self.send('\nLogin: ')
+            return
+
+        if self.shell == 'main':
+            self.send(text + '\n')
+            if text == 'help':
+                self.send(MAIN_HELP)
+            elif text == 'ver':
+                self.send(VERSION)
+            elif text == 'bledebug':
+                self.shell = 'ble'
+                self.send('Connect to UART8\n')
+            elif text == 'gsmdebug':
+                self.shell = 'gsm'
+                self.send('Modem powering on..\n')
+            elif len(text.split()) == 3 and text.split()[0] == 'help':
+                addr, n = int(text.split()[1], 16), int(text.split()[2], 16)
+                if self.payload == 'slip':
+                    self.slip_dump(addr, n)
+                else:
+                    self.hexdump(addr, n)
+            elif text == 'logprn':
+                for i in range(200):
+                    self.send(f'{i * 1.5:10.3f} [main] state {i % 7} speed {i % 25} km/h\n')
+            elif text:
+                self.send(f'unknown command {text}\n')
+            return
+
+        if self.shell == 'gsm':
+            self.send(text + '\n')
+            if text.startswith('AT'):
+                self.send('\nOK\n')
+            else:
+                self.send('\nERROR\n')
+            return
+
+        self.send(text + '\n')
+        words = text.split()
+        self.stats_next = None
+        if text == 'exit':
+            self.shell = 'main'
+            return
+        if text == 'help':
+            self.send(BLE_HELP)
+        elif text in ('info', 'ver'):
+            self.send('Firmware version ........... : 1.04.01\n')
+        elif len(words) == 4 and words[0] == 'dump' and words[1] in ('mem', 'extflash'):
+            self.dump(int(words[2], 16), int(words[3], 16))
+        elif text in ('rtos-statistics', 'dump stats'):
+            self.stats_next = time.monotonic()
+            return
+        elif text:
+            self.send(f'unknown command {words[0]}\n')
+        self.send('\n> ')
+
+    def feed(self, data):
+        for c in data:
+            if self.shell == 'slip':
+                self.slip_feed(c)
+                continue
+            if self.shell == 'gsm' and self.line.endswith(b'\x1b[14') and c == ord('~'):
+                self.line.clear()
+                self.shell = 'main'
+                continue
+            if c in (ord('\r'), ord('\n')):
+                if self.shell == 'login' and not self.line:
+                    self.send('Login: ')
+                else:
+                    self.command(self.line.decode('latin-1'))
+                self.line.clear()
+            else:
+                self.line.append(c)
+
+
+def parse_args(argv=None):
+    parser = argparse.ArgumentParser(description='Fake bike debug console on a pty.')
+    parser.add_argument('--baud', type=int, default=115200, help='line rate to pace the output to (default 115200)')
+    parser.add_argument('--password', default='123456DeBug', help='login password (default 123456DeBug)')
+    parser.add_argument('--stats-interval', type=float, default=0.5,
+                        help='seconds between rtos-statistics reports (default 0.5)')
+    parser.add_argument('--leak', type=int, default=0, help='heap bytes leaked per rtos-statistics report (default 0)')
+    parser.add_argument('--payload', choices=('hex', 'slip'), default='hex',
+                        help='what `help <addr> <n>` dumps with: dump.c or dumpslip.c (default hex)')
+    parser.add_argument('--noise', type=float, default=0, help='fraction of SLIP frames to garble (default 0)')
+    parser.add_argument('--image', help='file to serve as memory for dump mem/extflash (default: random bytes)')
+    args = parser.parse_args(argv)
+
+    if args.image:
+        with open(args.image, 'rb') as f:
+            args.memory = f.read()
+    else:
+        args.memory = random.Random(1).randbytes(1 << 20)
+    return args
+
+
+def main():
+    args = parse_args()
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    print(os.ttyname(slave), flush=True)
+
+    console = Console(master, args)
+    while True:
+        timer = console.timer()
+        timeout = None if timer is None else max(0, timer - time.monotonic())
+        if not select.select([master], [], [], timeout)[0]:
+            console.expire()
+            continue
+        try:
+            data = os.read(master, 4096)
+        except OSError:
+            break
+        console.feed(data)
+
+
+if __name__ == '__main__':
+    main()
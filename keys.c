@@ -8,6 +8,7 @@ typedef uint32_t size_t;
 #define READ_EXTFLASH (0x1c5a4 + 1)
 #define GET_KEY (0x20bb8 + 1)
 #define SHOW_HELP (0x21244 + 1)
+#define RTOS_STATISTICS (0xf6a0 + 1)
 #define SSCANF (0x23838 + 1)
 #define SYSTEM_PUTCHAR (0x260f8 + 1)
 #endif
@@ -17,6 +18,7 @@ typedef uint32_t size_t;
 #define READ_EXTFLASH (0x21640 + 1)
 #define GET_KEY (0x26ea2 + 1)
 #define SHOW_HELP (0x27744 + 1)
+#define RTOS_STATISTICS (0x10fa4 + 1)
 #define SSCANF (0x2a670 + 1)
 #define SYSTEM_PUTCHAR (0x2dbc8 + 1)
 #endif
@@ -44,6 +46,7 @@ typedef int (*read_extflash_t) (uint32_t addr, size_t len, uint8_t *data);
 typedef void (*show_help_t) (const char*, const char*);
 typedef int (*sscanf_t) (const char *str, const char *fmt, ...);
 typedef void (*system_putchar_t) (char c);
+typedef int (*command_t) (int what, char *cmdline);
 
 static void strcpy(char *, const char *);
 static int strcmp(const char *, const char *);
@@ -60,7 +63,7 @@ static int patch_ble_boot(const char *args);
 int
 dump(int what, char *cmdline)
 {
-	static const char text[] = "dump keys/memory/extflash";
+	static const char text[] = "dump keys/memory/extflash/stats";
 	static const char file[] = __FILE__;
 	show_help_t show_help = (show_help_t)SHOW_HELP;
 	logger_t logger = (logger_t)LOGGER;
@@ -92,9 +95,15 @@ dump(int what, char *cmdline)
 
 			if (strncmp(args, "ccfg", 4) == 0)
 				return patch_ble_boot(args);
+
+			/* The command this one replaced, for soak runs on patched builds. */
+			if (strcmp(args, "stats") == 0) {
+				strcpy(cmdline, "rtos-statistics");
+				return ((command_t)RTOS_STATISTICS)(2, cmdline);
+			}
 		}
 
-		return usage("dump", "<keys|mem|extflash>");
+		return usage("dump", "<keys|mem|extflash|stats>");
 
 	default:
 		return 1;
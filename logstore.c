@@ -0,0 +1,1092 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "endian_compat.h"
+
+#include "logstore.h"
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s ingest [-b <bike>] [-t <time>] <store> <logfile>...\n", progname);
+	fprintf(stderr, "       %s query [-b <bike>] [-s <source>] [-a <since>] [-z <until>] [-c | -l] [-n <max>] <store> [<pattern>]\n", progname);
+	exit(1);
+}
+
+static void *
+xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, size);
+		exit(1);
+	}
+	return p;
+}
+
+static const char *
+path_of(const char *dir, const char *name)
+{
+	static char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return path;
+}
+
+/* Whole file, NUL terminated; a missing file is empty if `missing_ok`. */
+static char *
+slurp(const char *path, size_t *lenp, int missing_ok)
+{
+	struct stat st;
+	size_t total = 0;
+	ssize_t n;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (missing_ok && errno == ENOENT) {
+			*lenp = 0;
+			return xrealloc(NULL, 1);
+		}
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+
+	buf = xrealloc(NULL, st.st_size + 1);
+	while (total < (size_t)st.st_size) {
+		n = read(fd, buf + total, st.st_size - total);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read(%s): %s\n", progname, path,
+				n < 0 ? strerror(errno) : "short read");
+			exit(1);
+		}
+		total += n;
+	}
+	close(fd);
+
+	buf[total] = '\0';
+	*lenp = total;
+	return buf;
+}
+
+/*
+ * The dictionary: bikes, sources and templates, by id. While ingesting,
+ * a hash table over all three finds existing entries and new ones are
+ * appended to the dict file.
+ */
+#define KINDS	3
+
+typedef struct {
+	char **strs;
+	uint32_t count, alloc;
+} dict_list_t;
+
+static dict_list_t dict[KINDS];
+static const char dict_types[KINDS] = { DICT_BIKE, DICT_SOURCE, DICT_TEMPLATE };
+static const uint32_t dict_limit[KINDS] = { 0xffff, 0xffff, 0xffffffff };
+
+static uint64_t *hash;		/* (kind << 32 | id) + 1, 0 = free */
+static size_t hash_size;
+static FILE *dictf;
+
+static int
+dict_kind(char type)
+{
+	for (int i = 0; i < KINDS; i++)
+		if (dict_types[i] == type)
+			return i;
+	return -1;
+}
+
+static uint32_t
+hash_str(int kind, const char *s)
+{
+	uint32_t h = 2166136261u ^ kind;
+
+	while (*s)
+		h = (h ^ (uint8_t)*s++) * 16777619u;
+	return h;
+}
+
+static void
+hash_insert(int kind, uint32_t id)
+{
+	size_t i = hash_str(kind, dict[kind].strs[id]) & (hash_size - 1);
+
+	while (hash[i])
+		i = (i + 1) & (hash_size - 1);
+	hash[i] = ((uint64_t)kind << 32 | id) + 1;
+}
+
+static void
+hash_grow(void)
+{
+	hash_size = hash_size ? hash_size * 2 : 4096;
+	free(hash);
+	hash = xrealloc(NULL, hash_size * sizeof(*hash));
+	memset(hash, 0, hash_size * sizeof(*hash));
+	for (int k = 0; k < KINDS; k++)
+		for (uint32_t id = 0; id < dict[k].count; id++)
+			hash_insert(k, id);
+}
+
+static uint32_t
+dict_add(int kind, const char *s)
+{
+	dict_list_t *d = &dict[kind];
+
+	if (d->count == dict_limit[kind]) {
+		fprintf(stderr, "%s: too many %s entries\n", progname,
+			kind == 0 ? "bike" : kind == 1 ? "source" : "template");
+		exit(1);
+	}
+	if (d->count == d->alloc) {
+		d->alloc = d->alloc ? d->alloc * 2 : 256;
+		d->strs = xrealloc(d->strs, d->alloc * sizeof(*d->strs));
+	}
+	d->strs[d->count] = strdup(s);
+	return d->count++;
+}
+
+static void
+load_dict(const char *dir)
+{
+	size_t len, i = 0, n;
+	char *buf;
+	int kind;
+
+	buf = slurp(path_of(dir, "dict"), &len, 1);
+	while (i < len) {
+		kind = dict_kind(buf[i]);
+		n = strnlen(buf + i + 1, len - i - 1);
+		if (kind < 0 || i + 1 + n >= len) {
+			fprintf(stderr, "%s: %s: corrupt dictionary at %zu\n", progname, path_of(dir, "dict"), i);
+			exit(1);
+		}
+		dict_add(kind, buf + i + 1);
+		i += n + 2;
+	}
+	free(buf);
+}
+
+/* Id of `s`, added to the dictionary (and the dict file) if it is new. */
+static uint32_t
+dict_id(int kind, const char *s)
+{
+	size_t i;
+	uint64_t e;
+	uint32_t id;
+
+	i = hash_str(kind, s) & (hash_size - 1);
+	while ((e = hash[i])) {
+		e--;
+		if ((int)(e >> 32) == kind && strcmp(dict[kind].strs[(uint32_t)e], s) == 0)
+			return (uint32_t)e;
+		i = (i + 1) & (hash_size - 1);
+	}
+
+	id = dict_add(kind, s);
+	fputc(dict_types[kind], dictf);
+	fwrite(s, 1, strlen(s) + 1, dictf);
+
+	if ((dict[0].count + dict[1].count + dict[2].count) * 2 > hash_size)
+		hash_grow();
+	else
+		hash[i] = ((uint64_t)kind << 32 | id) + 1;
+	return id;
+}
+
+/*
+ * Columns: one file per field, fixed width per record.
+ */
+enum { COL_TIME, COL_BIKE, COL_SOURCE, COL_TEMPLATE, COL_ARGS, COLUMNS };
+
+static const char *col_names[COLUMNS] = { "time.col", "bike.col", "source.col", "template.col", "args.col" };
+static const size_t col_widths[COLUMNS] = { 4, 2, 2, 4, 4 };
+
+static size_t
+file_size(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "%s: stat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	return st.st_size;
+}
+
+/* Records in the store: what every column has. */
+static size_t
+store_records(const char *dir)
+{
+	size_t n = SIZE_MAX, c;
+
+	for (int i = 0; i < COLUMNS; i++) {
+		c = file_size(path_of(dir, col_names[i])) / col_widths[i];
+		if (c < n)
+			n = c;
+	}
+	return n;
+}
+
+static void *
+map_file(const char *dir, const char *name, size_t *lenp)
+{
+	const char *path = path_of(dir, name);
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	*lenp = st.st_size;
+	if (st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+	return p;
+}
+
+/*
+ * Lines. A line may start with a time stamp, either a date and time
+ * (taken as UTC) or seconds since boot, and then a [source]. Numbers are
+ * arguments: a word starting with a digit, or a word of at least four
+ * hex digits and colons with a digit in it (MAC addresses, hashes).
+ */
+typedef struct {
+	double uptime;			/* -1 if none */
+	int64_t time;			/* -1 if none */
+	uint32_t tmpl;
+	uint32_t source;
+	uint32_t args;
+} line_t;
+
+static int
+is_word(int c)
+{
+	return isalnum(c) || c == '_';
+}
+
+static int
+in_number(int c)
+{
+	return c && (isxdigit(c) || strchr("xX.:-", c));
+}
+
+/* Length of the argument at `s` (a word start), or 0 if it is text. */
+static size_t
+arg_length(const char *s)
+{
+	size_t j = 0, digits = 0;
+
+	while (in_number(s[j])) {
+		digits += isdigit((unsigned char)s[j]) != 0;
+		j++;
+	}
+	while (j > 1 && strchr(".:-", s[j - 1]))
+		j--;
+
+	if (!is_word((unsigned char)s[j]) && (isdigit((unsigned char)s[0]) || (digits && j >= 4)))
+		return j;
+	if (!isdigit((unsigned char)s[0]))
+		return 0;
+
+	/* 100ms: only the number */
+	for (j = 0; isdigit((unsigned char)s[j]) || (s[j] == '.' && isdigit((unsigned char)s[j + 1])); j++)
+		;
+	return j;
+}
+
+static const char *
+parse_stamp(const char *s, double *uptime, int64_t *when)
+{
+	struct tm tm;
+	const char *p = s;
+	int n = 0;
+
+	*uptime = -1;
+	*when = -1;
+	while (*p == ' ')
+		p++;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(p, "%4d-%2d-%2d%*1[ T]%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+		   &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 && n) {
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		*when = timegm(&tm);
+		p += n;
+		while (*p == '.' || isdigit((unsigned char)*p))
+			p++;
+		return p;
+	}
+
+	if (isdigit((unsigned char)*p)) {
+		const char *q = p;
+
+		while (isdigit((unsigned char)*q))
+			q++;
+		if (*q == '.')
+			for (q++; isdigit((unsigned char)*q); q++)
+				;
+		if (*q == ' ' || *q == '\0') {
+			*uptime = strtod(p, NULL);
+			return q;
+		}
+	}
+	return s;
+}
+
+static uint32_t
+parse_source(const char *p)
+{
+	char name[33];
+	const char *end;
+
+	while (*p == ' ')
+		p++;
+	if (*p == '[' && (end = memchr(p, ']', strnlen(p, sizeof(name) + 1))) && end > p + 1) {
+		memcpy(name, p + 1, end - p - 1);
+		name[end - p - 1] = '\0';
+		return dict_id(1, name);
+	}
+	return dict_id(1, "-");
+}
+
+/*
+ * Arguments in args.dat: those made of digits, ".:- x" only (most of
+ * them) packed two characters per byte after an ARG_PACKED byte, up to a
+ * 0xf nibble; anything else as a NUL-terminated string.
+ */
+#define ARG_PACKED	0x01
+
+static const char arg_chars[] = "0123456789.:-x ";
+
+static void
+put_arg(FILE *f, const char *s, size_t n, uint32_t *argsp)
+{
+	size_t i, len;
+	int packed = 1;
+
+	for (i = 0; i < n; i++)
+		if (s[i] == '\0' || strchr(arg_chars, s[i]) == NULL)
+			packed = 0;
+
+	if (packed) {
+		fputc(ARG_PACKED, f);
+		for (i = 0; i <= n; i += 2) {
+			int hi = i < n ? strchr(arg_chars, s[i]) - arg_chars : 0xf;
+			int lo = i + 1 < n ? strchr(arg_chars, s[i + 1]) - arg_chars : 0xf;
+
+			fputc(hi << 4 | lo, f);
+		}
+		len = 1 + n / 2 + 1;
+	} else {
+		fwrite(s, 1, n, f);
+		fputc('\0', f);
+		len = n + 1;
+	}
+
+	if (*argsp + len < *argsp) {
+		fprintf(stderr, "%s: args.dat larger than 4 GiB\n", progname);
+		exit(1);
+	}
+	*argsp += len;
+}
+
+/* Unpack the argument at `a` into `out`; returns where the next one starts. */
+static size_t
+get_arg(const char *args, size_t len, size_t a, char *out, size_t size, size_t *n)
+{
+	*n = 0;
+	if (a < len && args[a] == ARG_PACKED) {
+		for (a++; a < len; a++) {
+			int nib[2] = { (uint8_t)args[a] >> 4, args[a] & 0xf };
+
+			for (int k = 0; k < 2; k++) {
+				if (nib[k] >= (int)strlen(arg_chars))
+					return a + 1;
+				if (*n + 1 < size)
+					out[(*n)++] = arg_chars[nib[k]];
+			}
+		}
+		return a;
+	}
+	for (; a < len && args[a]; a++)
+		if (*n + 1 < size)
+			out[(*n)++] = args[a];
+	return a + 1;
+}
+
+/*
+ * Add one line: its template to the dictionary, its arguments to args.dat
+ * at *argsp. A time stamp, with the blanks before it, is one argument.
+ * The time is filled in once the whole batch is known.
+ */
+static void
+parse_line(const char *s, line_t *l, FILE *argsf, uint32_t *argsp, char *tmpl)
+{
+	const char *p = parse_stamp(s, &l->uptime, &l->time);
+	size_t i = p - s, t = 0, n;
+
+	l->source = parse_source(p);
+	l->args = *argsp;
+	if (i) {
+		tmpl[t++] = ARG_MARK;
+		put_arg(argsf, s, i, argsp);
+	}
+
+	while (s[i]) {
+		if ((i == 0 || !is_word((unsigned char)s[i - 1])) && (n = arg_length(s + i))) {
+			tmpl[t++] = ARG_MARK;
+			put_arg(argsf, s + i, n, argsp);
+			i += n;
+			continue;
+		}
+		tmpl[t++] = s[i] == ARG_MARK ? '?' : s[i];
+		i++;
+	}
+	tmpl[t] = '\0';
+	l->tmpl = dict_id(2, tmpl);
+}
+
+/*
+ * Time of each line. Date stamps are used as they are. Uptime stamps are
+ * relative to the time of the last line, `anchor` (normally when the log
+ * was fetched); going back, an uptime larger than the one after it is a
+ * reboot, and that boot is taken to have ended when the next one began.
+ * Lines without a stamp get the time of the line after them.
+ */
+static void
+assign_times(line_t *lines, size_t n, int64_t anchor)
+{
+	int64_t next = anchor, base = anchor;
+	double next_up = -1, base_up = 0;
+
+	for (size_t i = n; i-- > 0; ) {
+		line_t *l = &lines[i];
+
+		if (l->time < 0 && l->uptime >= 0) {
+			if (next_up < 0 || l->uptime > next_up) {
+				base = next;
+				base_up = l->uptime;
+			}
+			l->time = base - (int64_t)(base_up - l->uptime);
+		} else if (l->time < 0) {
+			l->time = next;
+		}
+		next = l->time;
+		if (l->uptime >= 0)
+			next_up = l->uptime;
+	}
+}
+
+/* The `ingested` file: how far each bike's log has been read. */
+typedef struct {
+	char bike[64];
+	size_t bytes;
+	uint32_t crc;
+} ingested_t;
+
+static ingested_t *ingested;
+static size_t ningested;
+
+static ingested_t *
+ingested_for(const char *bike)
+{
+	for (size_t i = 0; i < ningested; i++)
+		if (strcmp(ingested[i].bike, bike) == 0)
+			return &ingested[i];
+
+	ingested = xrealloc(ingested, (ningested + 1) * sizeof(*ingested));
+	memset(&ingested[ningested], 0, sizeof(*ingested));
+	snprintf(ingested[ningested].bike, sizeof(ingested[ningested].bike), "%s", bike);
+	return &ingested[ningested++];
+}
+
+static void
+load_ingested(const char *dir)
+{
+	char *buf, *line, *save;
+	ingested_t e;
+	size_t len;
+
+	buf = slurp(path_of(dir, "ingested"), &len, 1);
+	for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (sscanf(line, "%63s %zu %x", e.bike, &e.bytes, &e.crc) == 3)
+			*ingested_for(e.bike) = e;
+	}
+	free(buf);
+}
+
+static void
+write_file(const char *dir, const char *name, const void *data, size_t len)
+{
+	char tmp[4096], path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s", path_of(dir, name));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, tmp, strerror(errno));
+		exit(1);
+	}
+	if (write(fd, data, len) != (ssize_t)len || close(fd) < 0) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, tmp, strerror(errno));
+		exit(1);
+	}
+	if (rename(tmp, path) < 0) {
+		fprintf(stderr, "%s: rename(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+}
+
+static void
+save_ingested(const char *dir)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	f = open_memstream(&buf, &len);
+	for (size_t i = 0; i < ningested; i++)
+		fprintf(f, "%s %zu %08x\n", ingested[i].bike, ingested[i].bytes, ingested[i].crc);
+	fclose(f);
+	write_file(dir, "ingested", buf, len);
+	free(buf);
+}
+
+/*
+ * The index: a counting sort of the template column, so the records of
+ * each template are one contiguous, ordered run of postings.
+ */
+static void
+build_index(const char *dir, size_t records)
+{
+	uint32_t templates = dict[2].count;
+	logstore_index_t *header;
+	uint32_t *start, *postings, *fill;
+	const uint32_t *col;
+	size_t len, size;
+	char *buf;
+
+	col = map_file(dir, "template.col", &len);
+
+	size = sizeof(*header) + (templates + 1 + records) * sizeof(uint32_t);
+	buf = xrealloc(NULL, size);
+	header = (logstore_index_t *)buf;
+	start = (uint32_t *)(header + 1);
+	postings = start + templates + 1;
+	fill = xrealloc(NULL, (templates + 1) * sizeof(*fill));
+	memset(fill, 0, (templates + 1) * sizeof(*fill));
+
+	for (size_t r = 0; r < records; r++)
+		fill[le32toh(col[r]) + 1]++;
+	for (uint32_t t = 0; t < templates; t++)
+		fill[t + 1] += fill[t];
+	for (uint32_t t = 0; t <= templates; t++)
+		start[t] = htole32(fill[t]);
+	for (size_t r = 0; r < records; r++)
+		postings[fill[le32toh(col[r])]++] = htole32(r);
+
+	memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+	header->templates = htole32(templates);
+	header->records = htole32(records);
+	write_file(dir, "index", buf, size);
+
+	if (col)
+		munmap((void *)col, len);
+	free(fill);
+	free(buf);
+}
+
+static FILE *
+open_append(const char *dir, const char *name)
+{
+	FILE *f = fopen(path_of(dir, name), "ab");
+
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path_of(dir, name), strerror(errno));
+		exit(1);
+	}
+	return f;
+}
+
+static void
+close_file(FILE *f, const char *dir, const char *name)
+{
+	if (fclose(f) != 0) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, path_of(dir, name), strerror(errno));
+		exit(1);
+	}
+}
+
+/* Bike name from a log file name: F88A5EXXXXXX.log -> F88A5EXXXXXX. */
+static void
+bike_of(const char *path, char *bike, size_t size)
+{
+	const char *base = strrchr(path, '/');
+
+	base = base ? base + 1 : path;
+	snprintf(bike, size, "%.*s", (int)strcspn(base, "."), base);
+}
+
+static int
+ingest(int argc, char **argv)
+{
+	const char *dir, *bike_opt = NULL;
+	char bike[64], *data, *tmpl = NULL, *line, *next;
+	int64_t anchor = -1, when;
+	size_t records, len, end, start, nlines, total = 0, lines_alloc = 0, before, after;
+	uint32_t args, templates, crc;
+	FILE *cols[COLUMNS], *argsf;
+	line_t *lines = NULL;
+	ingested_t *state;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:t:")) != -1) {
+		switch (opt) {
+			case 'b':
+				bike_opt = optarg;
+				break;
+			case 't':
+				anchor = strtoll(optarg, NULL, 0);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind < 2)
+		usage();
+	dir = argv[optind++];
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "%s: mkdir(%s): %s\n", progname, dir, strerror(errno));
+		exit(1);
+	}
+
+	load_dict(dir);
+	hash_grow();
+	templates = dict[2].count;
+	dictf = open_append(dir, "dict");
+	load_ingested(dir);
+
+	/* Drop what an interrupted ingest left in some columns only. */
+	records = store_records(dir);
+	for (int i = 0; i < COLUMNS; i++) {
+		if (truncate(path_of(dir, col_names[i]), records * col_widths[i]) < 0 && errno != ENOENT) {
+			fprintf(stderr, "%s: truncate(%s): %s\n", progname, path_of(dir, col_names[i]), strerror(errno));
+			exit(1);
+		}
+		cols[i] = open_append(dir, col_names[i]);
+	}
+	argsf = open_append(dir, "args.dat");
+	args = file_size(path_of(dir, "args.dat"));
+	before = records;
+
+	for (; optind < argc; optind++) {
+		struct stat st;
+
+		if (bike_opt)
+			snprintf(bike, sizeof(bike), "%s", bike_opt);
+		else
+			bike_of(argv[optind], bike, sizeof(bike));
+		state = ingested_for(bike);
+
+		/* Whole lines only; read_logs.py pads the last block with zeros. */
+		data = slurp(argv[optind], &len, 0);
+		end = strnlen(data, len);
+		while (end && data[end - 1] != '\n')
+			end--;
+
+		start = state->bytes;
+		if (start > end || (start && crc32(0, (uint8_t *)data, start) != state->crc)) {
+			printf("%s: %s: log does not continue what was ingested, starting over\n", progname, argv[optind]);
+			start = 0;
+		}
+
+		when = anchor;
+		if (when < 0)
+			when = stat(argv[optind], &st) == 0 ? st.st_mtime : time(NULL);
+
+		crc = start ? state->crc : 0;
+		state->crc = crc32(crc, (uint8_t *)data + start, end - start);
+		state->bytes = end;
+
+		tmpl = xrealloc(tmpl, end - start + 1);
+		nlines = 0;
+		for (line = data + start; line < data + end; line = next) {
+			next = memchr(line, '\n', data + end - line) + 1;
+			next[-1] = '\0';
+			if (next - line > 1 && next[-2] == '\r')
+				next[-2] = '\0';
+			if (*line == '\0')
+				continue;
+
+			if (nlines == lines_alloc) {
+				lines_alloc = lines_alloc ? lines_alloc * 2 : 4096;
+				lines = xrealloc(lines, lines_alloc * sizeof(*lines));
+			}
+			parse_line(line, &lines[nlines++], argsf, &args, tmpl);
+		}
+		assign_times(lines, nlines, when);
+
+		for (size_t i = 0; i < nlines; i++) {
+			uint32_t t32 = htole32(lines[i].time > 0 ? (uint32_t)lines[i].time : 0);
+			uint16_t b16 = htole16(dict_id(0, bike));
+			uint16_t s16 = htole16(lines[i].source);
+			uint32_t tmpl32 = htole32(lines[i].tmpl);
+			uint32_t args32 = htole32(lines[i].args);
+
+			fwrite(&t32, 4, 1, cols[COL_TIME]);
+			fwrite(&b16, 2, 1, cols[COL_BIKE]);
+			fwrite(&s16, 2, 1, cols[COL_SOURCE]);
+			fwrite(&tmpl32, 4, 1, cols[COL_TEMPLATE]);
+			fwrite(&args32, 4, 1, cols[COL_ARGS]);
+		}
+		records += nlines;
+		total += end - start;
+
+		printf("%s: %s: %zu lines from byte %zu\n", progname, bike, nlines, start);
+		free(data);
+	}
+
+	/* Data first, then what says it is there. */
+	close_file(argsf, dir, "args.dat");
+	for (int i = 0; i < COLUMNS; i++)
+		close_file(cols[i], dir, col_names[i]);
+	close_file(dictf, dir, "dict");
+	save_ingested(dir);
+	build_index(dir, records);
+
+	after = file_size(path_of(dir, "dict")) + file_size(path_of(dir, "args.dat")) +
+		file_size(path_of(dir, "index"));
+	for (int i = 0; i < COLUMNS; i++)
+		after += file_size(path_of(dir, col_names[i]));
+	printf("%s: %zu new lines (%zu bytes), %u new templates; %zu lines, %u templates, %zu bytes in store\n",
+	       dir, records - before, total, dict[2].count - templates, records, dict[2].count, after);
+
+	free(lines);
+	free(tmpl);
+	return 0;
+}
+
+/* now - N[smhdw], YYYY-MM-DD[ HH:MM[:SS]] (UTC) or unix time. */
+static int64_t
+parse_when(const char *s)
+{
+	static const struct { char unit; int64_t seconds; } units[] = {
+		{ 's', 1 }, { 'm', 60 }, { 'h', 3600 }, { 'd', 86400 }, { 'w', 7 * 86400 },
+	};
+	struct tm tm;
+	char *end;
+	long long v;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(s, "%4d-%2d-%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) == 3) {
+		sscanf(s + 10, "%*1[ T]%2d:%2d:%2d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		return timegm(&tm);
+	}
+
+	v = strtoll(s, &end, 10);
+	if (end != s && *end == '\0')
+		return v;
+	for (size_t i = 0; end != s && i < sizeof(units) / sizeof(units[0]); i++)
+		if (end[0] == units[i].unit && end[1] == '\0')
+			return time(NULL) - v * units[i].seconds;
+
+	fprintf(stderr, "%s: %s: not a time (use N[smhdw], YYYY-MM-DD[ HH:MM[:SS]] or unix time)\n", progname, s);
+	exit(1);
+}
+
+/* The store, mapped. */
+static const uint32_t *col_time, *col_template, *col_args;
+static const uint16_t *col_bike, *col_source;
+static const char *argsdat;
+static size_t argslen;
+
+/* Line `r` as it was logged. */
+static const char *
+render(uint32_t r, char *buf, size_t size)
+{
+	const char *t = dict[2].strs[le32toh(col_template[r])];
+	size_t a = le32toh(col_args[r]), n = 0, l;
+
+	for (; *t && n + 1 < size; t++) {
+		if (*t != ARG_MARK) {
+			buf[n++] = *t;
+			continue;
+		}
+		a = get_arg(argsdat, argslen, a, buf + n, size - n, &l);
+		n += l;
+	}
+	buf[n] = '\0';
+	return buf;
+}
+
+static const char *
+format_time(uint32_t t)
+{
+	static char buf[32];
+	time_t tt = t;
+
+	if (t == 0)
+		return "-";
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", gmtime(&tt));
+	return buf;
+}
+
+/*
+ * The pattern is matched (fnmatch, anywhere in the line) against templates
+ * first, with the words in it that ingest takes for arguments standing for
+ * any argument, and then against the lines of the matching templates.
+ */
+static char *
+template_pattern(const char *pattern)
+{
+	char *p = xrealloc(NULL, strlen(pattern) + 1);
+	size_t i = 0, t = 0, n;
+
+	while (pattern[i]) {
+		if ((i == 0 || !is_word((unsigned char)pattern[i - 1])) && (n = arg_length(pattern + i))) {
+			p[t++] = '*';
+			i += n;
+			continue;
+		}
+		p[t++] = pattern[i++];
+	}
+	p[t] = '\0';
+	return p;
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+typedef struct {
+	uint32_t id;
+	size_t count;
+	uint32_t last;
+} tally_t;
+
+static int
+cmp_tally(const void *a, const void *b)
+{
+	const tally_t *x = a, *y = b;
+
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : (x->id > y->id) - (x->id < y->id);
+}
+
+static int
+query(int argc, char **argv)
+{
+	const char *dir, *bike_name = NULL, *source_name = NULL;
+	char *pattern = NULL, *tpattern = NULL, *display, line[4096];
+	int64_t since = -1, until = -1;
+	long bike = -1, source = -1;
+	size_t records, len, max = SIZE_MAX, shown = 0, ncand = 0;
+	const logstore_index_t *index;
+	const uint32_t *start, *postings;
+	uint32_t *cand;
+	tally_t *tally = NULL;
+	int opt, counts = 0, list = 0;
+
+	while ((opt = getopt(argc, argv, "b:s:a:z:cln:")) != -1) {
+		switch (opt) {
+			case 'b':
+				bike_name = optarg;
+				break;
+			case 's':
+				source_name = optarg;
+				break;
+			case 'a':
+				since = parse_when(optarg);
+				break;
+			case 'z':
+				until = parse_when(optarg);
+				break;
+			case 'c':
+				counts = 1;
+				break;
+			case 'l':
+				list = 1;
+				break;
+			case 'n':
+				max = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind < 1 || argc - optind > 2 || (counts && list))
+		usage();
+	dir = argv[optind];
+	if (argc - optind == 2) {
+		pattern = xrealloc(NULL, strlen(argv[optind + 1]) + 3);
+		sprintf(pattern, "*%s*", argv[optind + 1]);
+		tpattern = template_pattern(pattern);
+	}
+
+	load_dict(dir);
+	records = store_records(dir);
+
+	index = map_file(dir, "index", &len);
+	if (index == NULL || len < sizeof(*index) || memcmp(index->magic, INDEX_MAGIC, 4) != 0 ||
+	    le32toh(index->records) != records || le32toh(index->templates) != dict[2].count ||
+	    len != sizeof(*index) + (dict[2].count + 1 + records) * sizeof(uint32_t)) {
+		fprintf(stderr, "%s: %s: index does not match the store, run ingest\n", progname, dir);
+		exit(1);
+	}
+	start = (const uint32_t *)(index + 1);
+	postings = start + dict[2].count + 1;
+
+	col_time = map_file(dir, col_names[COL_TIME], &len);
+	col_bike = map_file(dir, col_names[COL_BIKE], &len);
+	col_source = map_file(dir, col_names[COL_SOURCE], &len);
+	col_template = map_file(dir, col_names[COL_TEMPLATE], &len);
+	col_args = map_file(dir, col_names[COL_ARGS], &len);
+	argsdat = map_file(dir, "args.dat", &argslen);
+
+	for (uint32_t i = 0; bike_name && i < dict[0].count; i++)
+		if (strcmp(dict[0].strs[i], bike_name) == 0)
+			bike = i;
+	for (uint32_t i = 0; source_name && i < dict[1].count; i++)
+		if (strcmp(dict[1].strs[i], source_name) == 0)
+			source = i;
+	if ((bike_name && bike < 0) || (source_name && source < 0))
+		return 0;
+
+	/* Templates first: only their records are looked at. */
+	cand = xrealloc(NULL, records * sizeof(*cand));
+	if (list) {
+		tally = xrealloc(NULL, dict[2].count * sizeof(*tally));
+		memset(tally, 0, dict[2].count * sizeof(*tally));
+	}
+	display = xrealloc(NULL, 1);
+	for (uint32_t t = 0; t < dict[2].count; t++) {
+		const char *s = dict[2].strs[t];
+		size_t i;
+
+		display = xrealloc(display, strlen(s) + 1);
+		for (i = 0; s[i]; i++)
+			display[i] = s[i] == ARG_MARK ? '*' : s[i];
+		display[i] = '\0';
+		if (tpattern && fnmatch(tpattern, display, 0) != 0)
+			continue;
+		for (i = le32toh(start[t]); i < le32toh(start[t + 1]); i++)
+			cand[ncand++] = le32toh(postings[i]);
+	}
+	qsort(cand, ncand, sizeof(*cand), cmp_u32);
+
+	if (counts) {
+		tally = xrealloc(NULL, dict[0].count * sizeof(*tally));
+		memset(tally, 0, dict[0].count * sizeof(*tally));
+	}
+
+	for (size_t c = 0; c < ncand && shown < max; c++) {
+		uint32_t r = cand[c], t = le32toh(col_time[r]);
+
+		if ((bike >= 0 && le16toh(col_bike[r]) != bike) ||
+		    (source >= 0 && le16toh(col_source[r]) != source) ||
+		    (since >= 0 && t < since) || (until >= 0 && t >= until))
+			continue;
+		if (pattern && fnmatch(pattern, render(r, line, sizeof(line)), 0) != 0)
+			continue;
+
+		if (counts || list) {
+			tally_t *e = &tally[counts ? le16toh(col_bike[r]) : le32toh(col_template[r])];
+
+			e->id = counts ? le16toh(col_bike[r]) : le32toh(col_template[r]);
+			e->count++;
+			if (t > e->last)
+				e->last = t;
+			continue;
+		}
+		printf("%s %s %s\n", format_time(t), dict[0].strs[le16toh(col_bike[r])], render(r, line, sizeof(line)));
+		shown++;
+	}
+
+	if (counts || list) {
+		size_t n = counts ? dict[0].count : dict[2].count;
+
+		qsort(tally, n, sizeof(*tally), cmp_tally);
+		for (size_t i = 0; i < n && i < max && tally[i].count; i++) {
+			if (counts) {
+				printf("%-20s %8zu  last %s\n", dict[0].strs[tally[i].id], tally[i].count, format_time(tally[i].last));
+			} else {
+				const char *s = dict[2].strs[tally[i].id];
+
+				printf("%8zu  ", tally[i].count);
+				for (; *s; s++)
+					putchar(*s == ARG_MARK ? '*' : *s);
+				putchar('\n');
+			}
+		}
+	}
+
+	free(cand);
+	free(tally);
+	free(display);
+	free(pattern);
+	free(tpattern);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	if (argc < 2)
+		usage();
+	if (strcmp(argv[1], "ingest") == 0)
+		return ingest(argc - 1, argv + 1);
+	if (strcmp(argv[1], "query") == 0)
+		return query(argc - 1, argv + 1);
+	usage();
+	return 1;
+}
@@ -0,0 +1,49 @@
+#ifndef _LOGSTORE_H
+#define _LOGSTORE_H 1
+
+#include <stdint.h>
+
+/*
+ * Debug log store, as written by `logstore ingest`. A store is a directory
+ * holding one record per log line, split into columns, plus a dictionary
+ * and an index:
+ *
+ *   dict          entries: a type byte, then a NUL-terminated string; the
+ *                 ids of each type count up from 0 in file order
+ *   time.col      uint32 per record: unix time of the line (0 if unknown)
+ *   bike.col      uint16 per record: DICT_BIKE id
+ *   source.col    uint16 per record: DICT_SOURCE id ("[main]" -> "main")
+ *   template.col  uint32 per record: DICT_TEMPLATE id
+ *   args.col      uint32 per record: offset of the line's arguments in
+ *                 args.dat, one per ARG_MARK in the template: 0x01 and
+ *                 then the characters "0123456789.:-x " as nibbles up
+ *                 to a 0xf nibble, or else a NUL-terminated string
+ *   index         the records of each template (logstore_index_t)
+ *   ingested      text, `<bike> <bytes>` per line: how much of each
+ *                 bike's log has been ingested
+ *
+ * A template is the line with the time stamp and every number replaced
+ * by ARG_MARK, so the line is the template with the arguments filled
+ * back in. All fields are little endian. The columns and the index are
+ * meant to be mmap'ed.
+ */
+#define DICT_BIKE	'b'
+#define DICT_SOURCE	's'
+#define DICT_TEMPLATE	't'
+
+#define ARG_MARK	'\x1f'
+
+#define INDEX_MAGIC	"VMLX"
+
+/*
+ * Followed by uint32 start[templates + 1]: the records of template t are
+ * postings[start[t]] .. postings[start[t + 1] - 1], in record order, and
+ * the postings (uint32 record numbers) themselves.
+ */
+typedef struct {
+	char magic[4];
+	uint32_t templates;
+	uint32_t records;
+} logstore_index_t;
+
+#endif
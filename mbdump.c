@@ -0,0 +1,825 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "endian_compat.h"
+
+#include "modbus.h"
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s decode [-b <baud>] [-n <names>] [-o <store>] [-s] <capture>...\n", progname);
+	fprintf(stderr, "       %s series [-l] <store> [<register>...]\n", progname);
+	exit(1);
+}
+
+/*
+ * Decodes captures of the Modbus RTU buses to the shifter and the battery
+ * and keeps track of their registers. A capture is a raw byte dump of a
+ * line, or the CSV export of a logic analyser's async serial decoder (the
+ * first number in a row is the time in seconds, the first 0x.. field the
+ * byte), one file per line; requests and responses are merged by time.
+ *
+ * In a CSV capture a frame ends at 3.5 characters of silence. A raw dump
+ * has no timing, so there frames are found by their length, which follows
+ * from the function code, and their CRC: where no frame fits, a byte is
+ * skipped until one does. The same resynchronises a CSV capture where a
+ * silence does not end in a good frame.
+ *
+ * Reads are paired with the request that asked for them, writes are taken
+ * from the request, and every register value that changes is recorded in
+ * the store (see modbus.h).
+ */
+#define WINDOW		(2 * MODBUS_MAX_FRAME)
+
+typedef struct {
+	double time;
+	size_t order;
+	size_t data;
+	size_t len;
+} frame_t;
+
+static frame_t *frames;
+static size_t nframes, frames_size;
+static uint8_t *arena;
+static size_t arena_len, arena_size;
+
+static size_t skipped, requests, responses, exceptions, writes;
+
+static void *
+xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, size);
+		exit(1);
+	}
+	return p;
+}
+
+static const char *
+path_of(const char *dir, const char *name)
+{
+	static char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return path;
+}
+
+static void
+add_frame(double time, const uint8_t *frame, size_t len)
+{
+	if (nframes == frames_size) {
+		frames_size = frames_size ? frames_size * 2 : 4096;
+		frames = xrealloc(frames, frames_size * sizeof(*frames));
+	}
+	while (arena_len + len > arena_size) {
+		arena_size = arena_size ? arena_size * 2 : 1 << 20;
+		arena = xrealloc(arena, arena_size);
+	}
+	memcpy(arena + arena_len, frame, len);
+	frames[nframes].time = time;
+	frames[nframes].order = nframes;
+	frames[nframes].data = arena_len;
+	frames[nframes].len = len;
+	nframes++;
+	arena_len += len;
+}
+
+/*
+ * The lengths a frame starting with these `avail` bytes could have:
+ * request and response differ for reads and multiple writes, and then
+ * len[0] is the request. Returns how many, 0 if the function code is
+ * unknown, -1 if more bytes are needed to tell.
+ */
+static int
+lengths(const uint8_t *b, size_t avail, size_t *len)
+{
+	if (avail < 2)
+		return -1;
+	if (b[1] & MODBUS_EXCEPTION) {
+		len[0] = 5;
+		return 1;
+	}
+	switch (b[1]) {
+		case MODBUS_READ_COILS:
+		case MODBUS_READ_INPUTS:
+		case MODBUS_READ_HOLDING:
+		case MODBUS_READ_INPUT_REGS:
+			if (avail < 3)
+				return -1;
+			len[0] = 8;
+			len[1] = 5 + b[2];
+			return 2;
+		case MODBUS_WRITE_COIL:
+		case MODBUS_WRITE_REGISTER:
+			len[0] = 8;
+			return 1;
+		case MODBUS_WRITE_COILS:
+		case MODBUS_WRITE_REGISTERS:
+			if (avail < 7)
+				return -1;
+			len[0] = 9 + b[6];
+			len[1] = 8;
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+static int
+crc_ok(const uint8_t *b, size_t len)
+{
+	return len >= 4 && modbus_crc(b, len - 2) == (b[len - 2] | b[len - 1] << 8);
+}
+
+/* Bytes of one line, framed as they come in. */
+typedef struct {
+	uint8_t b[WINDOW];
+	double t[WINDOW];
+	size_t len;
+	int timed;			/* ends at silence, see frame_window() */
+	uint8_t asked[256];		/* function of a slave's open request */
+} framer_t;
+
+static void
+drop(framer_t *f, size_t n)
+{
+	memmove(f->b, f->b + n, f->len - n);
+	memmove(f->t, f->t + n, (f->len - n) * sizeof(f->t[0]));
+	f->len -= n;
+}
+
+/*
+ * Take the frames off the front of the window. With `ended` the line has
+ * gone silent after the window, so a frame has to end there.
+ */
+static void
+frame_window(framer_t *f, int ended)
+{
+	size_t len[2];
+	int n, ok[2], pick;
+
+	/*
+	 * With timing, what came in before a silence is one frame, if it has
+	 * a length its function code allows; length and CRC only split frames
+	 * that were sent back to back.
+	 */
+	if (f->timed) {
+		if (!ended)
+			return;
+		n = lengths(f->b, f->len, len);
+		for (int i = 0; i < n; i++) {
+			if (len[i] == f->len && crc_ok(f->b, f->len)) {
+				add_frame(f->t[0], f->b, f->len);
+				f->len = 0;
+				return;
+			}
+		}
+	}
+
+	while (f->len) {
+		n = lengths(f->b, f->len, len);
+		if (n < 0 && !ended)
+			return;
+
+		/* Wait until every length it could have is in. */
+		for (int i = 0; i < n; i++)
+			if (len[i] > f->len && !ended)
+				return;
+		for (int i = 0; i < n; i++)
+			ok[i] = len[i] <= f->len && crc_ok(f->b, len[i]);
+
+		/*
+		 * Both a request and a response check out: a response if the
+		 * slave was asked, else the longer one, as a CRC over a prefix
+		 * of a frame is more likely to match by chance.
+		 */
+		pick = -1;
+		if (n == 2 && ok[0] && ok[1])
+			pick = f->asked[f->b[0]] == f->b[1] ? 1 : len[1] > len[0];
+		else
+			for (int i = 0; i < n; i++)
+				if (ok[i])
+					pick = i;
+
+		if (pick >= 0) {
+			if (n == 2)
+				f->asked[f->b[0]] = pick == 0 ? f->b[1] : 0;
+			add_frame(f->t[0], f->b, len[pick]);
+			drop(f, len[pick]);
+			continue;
+		}
+		skipped++;
+		drop(f, 1);
+	}
+}
+
+static void
+frame_byte(framer_t *f, double time, uint8_t c, double silence)
+{
+	if (f->len && time - f->t[f->len - 1] > silence)
+		frame_window(f, 1);
+	if (f->len == WINDOW) {
+		frame_window(f, 1);
+		if (f->len == WINDOW) {
+			skipped++;
+			drop(f, 1);
+		}
+	}
+	f->b[f->len] = c;
+	f->t[f->len++] = time;
+	frame_window(f, 0);
+}
+
+/* A text line with a comma in it: the header or first row of a CSV. */
+static int
+is_csv(const char *p, const char *end)
+{
+	int comma = 0;
+
+	for (; p < end && *p != '\n'; p++) {
+		if (*p == ',')
+			comma = 1;
+		else if ((*p < 0x20 || *p > 0x7e) && *p != '\t' && *p != '\r')
+			return 0;
+	}
+	return comma && p < end;
+}
+
+/* A CSV row: the time and the byte, -1 if it has no byte. */
+static int
+csv_row(const char *line, const char *nl, double *time)
+{
+	const char *field, *next;
+	int have_time = 0, c = -1;
+	char buf[64], *e;
+	size_t n;
+
+	for (field = line; field < nl; field = next + 1) {
+		next = memchr(field, ',', nl - field);
+		if (next == NULL)
+			next = nl;
+		while (field < next && (*field == ' ' || *field == '"'))
+			field++;
+		n = next - field < (ptrdiff_t)sizeof(buf) - 1 ? (size_t)(next - field) : sizeof(buf) - 1;
+		memcpy(buf, field, n);
+		buf[n] = '\0';
+
+		if (c < 0 && buf[0] == '0' && (buf[1] == 'x' || buf[1] == 'X')) {
+			c = strtol(buf, &e, 16);
+			if (e == buf + 2 || c > 0xff)
+				c = -1;
+		} else if (!have_time) {
+			*time = strtod(buf, &e);
+			have_time = e != buf;
+		}
+	}
+	return have_time ? c : -1;
+}
+
+static void
+read_capture(const char *path, long baud)
+{
+	static framer_t framer;
+	double silence = 3.5 * 10 / baud, time;
+	const char *p, *end, *nl;
+	struct stat st;
+	int fd, c;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+	end = p + st.st_size;
+	memset(&framer, 0, sizeof(framer));
+	framer.timed = is_csv(p, end);
+
+	if (!framer.timed) {
+		/* Raw bytes, back to back: never silent. */
+		for (size_t i = 0; i < (size_t)st.st_size; i++)
+			frame_byte(&framer, i * 10.0 / baud, p[i], 1e9);
+	} else {
+		for (const char *line = p; line < end; line = nl + 1) {
+			nl = memchr(line, '\n', end - line);
+			if (nl == NULL)
+				nl = end;
+			c = csv_row(line, nl, &time);
+			if (c >= 0)
+				frame_byte(&framer, time, c, silence);
+		}
+	}
+	frame_window(&framer, 1);
+	munmap((void *)p, st.st_size);
+}
+
+static int
+cmp_frame(const void *a, const void *b)
+{
+	const frame_t *x = a, *y = b;
+
+	if (x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* Registers, by slave and number (plus MODBUS_INPUT_REG for inputs). */
+typedef struct {
+	uint32_t key;			/* slave << 24 | register */
+	char *name;
+	int have;
+	uint16_t value;
+	uint16_t series;
+	int used;
+} reg_t;
+
+#define REGS		(1 << 16)	/* hash slots, a power of two */
+
+static reg_t regs[REGS];
+static size_t nregs;
+static uint16_t *order_of;		/* series -> slot */
+
+static uint32_t *rec_time;
+static uint16_t *rec_series, *rec_value;
+static size_t nrecs, recs_size;
+
+static reg_t *
+reg_of(uint8_t slave, uint32_t reg)
+{
+	uint32_t key = (uint32_t)slave << 24 | reg;
+	size_t i = (key * 2654435761u) & (REGS - 1);
+
+	while (regs[i].used && regs[i].key != key)
+		i = (i + 1) & (REGS - 1);
+	if (!regs[i].used) {
+		if (nregs == REGS / 2) {
+			fprintf(stderr, "%s: more than %d registers\n", progname, REGS / 2);
+			exit(1);
+		}
+		regs[i].used = 1;
+		regs[i].key = key;
+		regs[i].series = nregs;
+		order_of = xrealloc(order_of, (nregs + 1) * sizeof(*order_of));
+		order_of[nregs++] = i;
+	}
+	return &regs[i];
+}
+
+static void
+record(double time, uint8_t slave, uint32_t reg, uint16_t value)
+{
+	reg_t *r = reg_of(slave, reg);
+
+	if (r->have && r->value == value)
+		return;
+	r->have = 1;
+	r->value = value;
+
+	if (nrecs == recs_size) {
+		recs_size = recs_size ? recs_size * 2 : 65536;
+		rec_time = xrealloc(rec_time, recs_size * sizeof(*rec_time));
+		rec_series = xrealloc(rec_series, recs_size * sizeof(*rec_series));
+		rec_value = xrealloc(rec_value, recs_size * sizeof(*rec_value));
+	}
+	rec_time[nrecs] = time > 0 ? (uint32_t)(time * 1000 + 0.5) : 0;
+	rec_series[nrecs] = r->series;
+	rec_value[nrecs] = value;
+	nrecs++;
+}
+
+/* `<slave> <register> <name>` per line; # starts a comment. */
+static void
+read_names(const char *path)
+{
+	char line[256], name[128];
+	unsigned long slave, reg;
+	char *p, *e;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "#\r\n")] = '\0';
+		slave = strtoul(line, &p, 0);
+		if (p == line)
+			continue;
+		reg = strtoul(p, &e, 0);
+		if (e == p || sscanf(e, " %127s", name) != 1 || slave > 0xff || reg > 0x1ffff) {
+			fprintf(stderr, "%s: %s: bad line: %s\n", progname, path, line);
+			exit(1);
+		}
+		reg_of(slave, reg)->name = strdup(name);
+	}
+	fclose(f);
+}
+
+static void
+print_words(const uint8_t *data, size_t words)
+{
+	for (size_t i = 0; i < words; i++)
+		printf(" %04x", data[2 * i] << 8 | data[2 * i + 1]);
+}
+
+/* The read a slave's response answers. */
+static struct {
+	double time;
+	uint8_t function;
+	uint16_t start, count;
+	int valid;
+} asked[256];
+
+static void
+decode(const frame_t *fr, int quiet)
+{
+	const uint8_t *b = arena + fr->data;
+	uint8_t slave = b[0], function = b[1];
+	uint16_t start, count;
+	size_t len = fr->len;
+	uint32_t base;
+
+	if (!quiet)
+		printf("%12.6f  %02x ", fr->time, slave);
+
+	if (function & MODBUS_EXCEPTION) {
+		exceptions++;
+		asked[slave].valid = 0;
+		if (!quiet)
+			printf("exception %02x on %02x\n", b[2], function & ~MODBUS_EXCEPTION);
+		return;
+	}
+
+	switch (function) {
+		case MODBUS_READ_COILS:
+		case MODBUS_READ_INPUTS:
+		case MODBUS_READ_HOLDING:
+		case MODBUS_READ_INPUT_REGS:
+			if (len == 8 && !(len == 5u + b[2] && asked[slave].valid)) {
+				requests++;
+				start = b[2] << 8 | b[3];
+				count = b[4] << 8 | b[5];
+				asked[slave].time = fr->time;
+				asked[slave].function = function;
+				asked[slave].start = start;
+				asked[slave].count = count;
+				asked[slave].valid = 1;
+				if (!quiet)
+					printf("read  %02x %04x x%u\n", function, start, count);
+				break;
+			}
+			responses++;
+			if (!quiet)
+				printf("data  %02x", function);
+			if (asked[slave].valid && asked[slave].function == function &&
+			    (function == MODBUS_READ_HOLDING || function == MODBUS_READ_INPUT_REGS) &&
+			    b[2] == 2 * asked[slave].count) {
+				base = function == MODBUS_READ_INPUT_REGS ? MODBUS_INPUT_REG : 0;
+				for (size_t i = 0; i < asked[slave].count; i++)
+					record(fr->time, slave, base + asked[slave].start + i,
+					       b[3 + 2 * i] << 8 | b[4 + 2 * i]);
+				if (!quiet) {
+					printf(" %04x:", asked[slave].start);
+					print_words(b + 3, b[2] / 2);
+				}
+			} else if (!quiet) {
+				for (size_t i = 0; i < b[2]; i++)
+					printf(" %02x", b[3 + i]);
+			}
+			asked[slave].valid = 0;
+			if (!quiet)
+				printf("\n");
+			break;
+
+		case MODBUS_WRITE_COIL:
+		case MODBUS_WRITE_REGISTER:
+			/* The response echoes the request; record it once. */
+			start = b[2] << 8 | b[3];
+			writes++;
+			if (function == MODBUS_WRITE_REGISTER)
+				record(fr->time, slave, start, b[4] << 8 | b[5]);
+			if (!quiet)
+				printf("write %02x %04x: %04x\n", function, start, b[4] << 8 | b[5]);
+			break;
+
+		case MODBUS_WRITE_COILS:
+		case MODBUS_WRITE_REGISTERS:
+			start = b[2] << 8 | b[3];
+			count = b[4] << 8 | b[5];
+			if (len == 8) {
+				if (!quiet)
+					printf("wrote %02x %04x x%u\n", function, start, count);
+				break;
+			}
+			writes++;
+			if (function == MODBUS_WRITE_REGISTERS && b[6] == 2 * count)
+				for (size_t i = 0; i < count; i++)
+					record(fr->time, slave, start + i, b[7 + 2 * i] << 8 | b[8 + 2 * i]);
+			if (!quiet) {
+				printf("write %02x %04x:", function, start);
+				print_words(b + 7, b[6] / 2);
+				printf("\n");
+			}
+			break;
+
+		default:
+			if (!quiet) {
+				printf("function %02x:", function);
+				for (size_t i = 2; i < len - 2; i++)
+					printf(" %02x", b[i]);
+				printf("\n");
+			}
+	}
+}
+
+static void
+write_column(const char *dir, const char *name, const void *data, size_t size)
+{
+	const char *path = path_of(dir, name);
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if ((size && fwrite(data, size, 1, f) != 1) || fclose(f) != 0) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+}
+
+static void
+write_store(const char *dir)
+{
+	const char *path;
+	FILE *f;
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "%s: mkdir(%s): %s\n", progname, dir, strerror(errno));
+		exit(1);
+	}
+
+	path = path_of(dir, "registers");
+	f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	for (size_t s = 0; s < nregs; s++) {
+		reg_t *r = &regs[order_of[s]];
+
+		fprintf(f, "%zu %u 0x%04x%s%s\n", s, r->key >> 24, r->key & 0xffffff,
+			r->name ? " " : "", r->name ? r->name : "");
+	}
+	if (fclose(f) != 0) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+
+	for (size_t i = 0; i < nrecs; i++) {
+		rec_time[i] = htole32(rec_time[i]);
+		rec_series[i] = htole16(rec_series[i]);
+		rec_value[i] = htole16(rec_value[i]);
+	}
+	write_column(dir, "time.col", rec_time, nrecs * sizeof(*rec_time));
+	write_column(dir, "series.col", rec_series, nrecs * sizeof(*rec_series));
+	write_column(dir, "value.col", rec_value, nrecs * sizeof(*rec_value));
+}
+
+static int
+decode_main(int argc, char **argv)
+{
+	const char *names = NULL, *store = NULL;
+	int opt, quiet = 0;
+	long baud = 9600;
+
+	while ((opt = getopt(argc, argv, "b:n:o:s")) != -1) {
+		switch (opt) {
+			case 'b':
+				baud = strtol(optarg, NULL, 0);
+				break;
+			case 'n':
+				names = optarg;
+				break;
+			case 'o':
+				store = optarg;
+				break;
+			case 's':
+				quiet = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind == argc || baud <= 0)
+		usage();
+
+	modbus_crc_init();
+	if (names)
+		read_names(names);
+	for (int i = optind; i < argc; i++)
+		read_capture(argv[i], baud);
+	qsort(frames, nframes, sizeof(*frames), cmp_frame);
+
+	for (size_t i = 0; i < nframes; i++)
+		decode(&frames[i], quiet);
+	if (store)
+		write_store(store);
+
+	fprintf(stderr, "%s: %zu frames (%zu reads, %zu responses, %zu writes, %zu exceptions), %zu bytes skipped\n",
+		progname, nframes, requests, responses, writes, exceptions, skipped);
+	fprintf(stderr, "%s: %zu registers, %zu changes\n", progname, nregs, nrecs);
+	return 0;
+}
+
+static const void *
+map_column(const char *dir, const char *name, size_t *size)
+{
+	const char *path = path_of(dir, name);
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	*size = st.st_size;
+	if (st.st_size == 0) {
+		close(fd);
+		return "";
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+	return p;
+}
+
+typedef struct {
+	unsigned slave;
+	unsigned long reg;
+	char name[128];
+	int wanted;
+	size_t changes;
+	unsigned min, max;
+} series_t;
+
+static int
+series_main(int argc, char **argv)
+{
+	const uint32_t *time;
+	const uint16_t *series, *value;
+	size_t n, size, nseries = 0, cap = 0;
+	series_t *list = NULL;
+	int opt, summary = 0, all;
+	char line[256], *e;
+	const char *dir;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "l")) != -1) {
+		switch (opt) {
+			case 'l':
+				summary = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+	dir = argv[optind++];
+
+	f = fopen(path_of(dir, "registers"), "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path_of(dir, "registers"), strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (nseries == cap) {
+			cap = cap ? cap * 2 : 64;
+			list = xrealloc(list, cap * sizeof(*list));
+		}
+		memset(&list[nseries], 0, sizeof(list[nseries]));
+		if (sscanf(line, "%*u %u %lx %127s", &list[nseries].slave, &list[nseries].reg,
+			   list[nseries].name) < 2) {
+			fprintf(stderr, "%s: %s: bad line: %s", progname, path_of(dir, "registers"), line);
+			exit(1);
+		}
+		if (list[nseries].name[0] == '\0')
+			snprintf(list[nseries].name, sizeof(list[nseries].name), "%u:0x%04lx",
+				 list[nseries].slave, list[nseries].reg);
+		list[nseries].min = 0xffff;
+		nseries++;
+	}
+	fclose(f);
+
+	/* Registers by name, or as <slave>:<register>. */
+	all = optind == argc;
+	for (int i = optind; i < argc; i++) {
+		unsigned long slave = strtoul(argv[i], &e, 0), reg = 0;
+		int found = 0;
+
+		if (*e == ':')
+			reg = strtoul(e + 1, &e, 0);
+		for (size_t s = 0; s < nseries; s++) {
+			if (strcmp(list[s].name, argv[i]) == 0 ||
+			    (*e == '\0' && e != argv[i] && list[s].slave == slave && list[s].reg == reg)) {
+				list[s].wanted = found = 1;
+			}
+		}
+		if (!found) {
+			fprintf(stderr, "%s: %s: no such register\n", progname, argv[i]);
+			exit(1);
+		}
+	}
+
+	time = map_column(dir, "time.col", &size);
+	n = size / sizeof(*time);
+	series = map_column(dir, "series.col", &size);
+	if (size / sizeof(*series) != n) {
+		fprintf(stderr, "%s: %s: columns differ in length\n", progname, dir);
+		exit(1);
+	}
+	value = map_column(dir, "value.col", &size);
+	if (size / sizeof(*value) != n) {
+		fprintf(stderr, "%s: %s: columns differ in length\n", progname, dir);
+		exit(1);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		uint16_t s = le16toh(series[i]), v = le16toh(value[i]);
+
+		if (s >= nseries || !(all || list[s].wanted))
+			continue;
+		if (summary) {
+			list[s].changes++;
+			list[s].min = v < list[s].min ? v : list[s].min;
+			list[s].max = v > list[s].max ? v : list[s].max;
+		} else {
+			printf("%.3f,%s,%u\n", le32toh(time[i]) / 1000.0, list[s].name, v);
+		}
+	}
+
+	if (summary) {
+		printf("slave register  changes    min    max  name\n");
+		for (size_t s = 0; s < nseries; s++)
+			if (all || list[s].wanted)
+				printf("%5u  0x%05lx %8zu %6u %6u  %s\n", list[s].slave, list[s].reg,
+				       list[s].changes, list[s].changes ? list[s].min : 0, list[s].max, list[s].name);
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	if (argc < 2)
+		usage();
+	if (strcmp(argv[1], "decode") == 0)
+		return decode_main(argc - 1, argv + 1);
+	if (strcmp(argv[1], "series") == 0)
+		return series_main(argc - 1, argv + 1);
+	usage();
+	return 1;
+}
@@ -0,0 +1,403 @@
+import sys
+import os
+import asyncio
+import argparse
+import collections
+import json
+import random
+import statistics
+import tempfile
+import time
+
+import zlib
+
+from cryptography.hazmat.primitives.ciphers import algorithms
+from cryptography.hazmat.primitives.ciphers import Cipher
+from cryptography.hazmat.primitives.ciphers import modes
+
+import update
+import read_logs
+
+
+# A local stand-in for the bike's Firmware (6acc5510) and Maintenance
+# (6acc55c0) services, so the transfers in update.py and read_logs.py can
+# be run, measured and tuned without a bike. The transport has the same
+# interface as their BikeTransport classes; the link model behind it is
+# deliberately simple: one queue of link layer packets drained at a fixed
+# air time, a small controller buffer for writes without response, and
+# responses coming back a connection interval after the queue has drained
+# (one interval per MTU-sized piece of a long read). A write reaches the
+# bike when its packets have been sent, so when the link drops, what was
+# still queued is lost.
+
+
+class LinkError(Exception):
+    pass
+
+
+class Disconnected(LinkError):
+    pass
+
+
+class Link:
+    def __init__(self, mtu=247, interval=0.030, packet_time=0.0025, pdu=251,
+                 buffers=8, latency=0.0, loss=0.0, disconnect=0.0, seed=None):
+        self.mtu = mtu
+        self.interval = interval
+        self.packet_time = packet_time
+        self.pdu = pdu
+        self.buffers = buffers
+        self.latency = latency
+        self.loss = loss
+        self.disconnect = disconnect
+        self.random = random.Random(seed)
+        self.free_at = 0.0
+        self.pending = collections.deque()
+        self.connected = True
+        self.writes = 0
+        self.failed = 0
+        self.drops = 0
+        self.lost = 0
+        self.latencies = []
+
+    def flush(self):
+        # Hand the writes whose packets are out by now to the bike.
+        now = time.monotonic()
+        while self.pending and self.pending[0][0] <= now:
+            self.pending.popleft()[1]()
+
+    def drop(self):
+        self.flush()
+        self.lost += len(self.pending)
+        self.pending.clear()
+        self.free_at = 0.0
+        self.connected = False
+        self.drops += 1
+
+    def reconnect(self):
+        self.connected = True
+
+    def attempt(self):
+        # `loss` is the chance that an operation fails (nothing is sent),
+        # `disconnect` the chance that the link drops on it.
+        self.writes += 1
+        if not self.connected:
+            raise Disconnected('not connected')
+        if self.random.random() < self.disconnect:
+            self.drop()
+            raise Disconnected('link lost')
+        if self.random.random() < self.loss:
+            self.failed += 1
+            raise LinkError('write failed')
+
+    def queue(self, length):
+        now = time.monotonic()
+        packets = -(-(length + 7) // self.pdu)
+        self.free_at = max(now, self.free_at) + packets * self.packet_time
+        return now
+
+    async def send(self, length, response, deliver):
+        # Returns once the controller took a write without response, or
+        # once the response to an acknowledged write is back; `deliver` is
+        # called when the write reaches the bike.
+        self.attempt()
+        if not response and length > self.mtu - 3:
+            raise LinkError(f'{length} bytes do not fit MTU {self.mtu}')
+
+        self.flush()
+        now = self.queue(length)
+        self.pending.append((self.free_at, deliver))
+
+        if response:
+            await asyncio.sleep(self.free_at - now + self.interval + self.latency)
+            self.flush()
+            self.latencies.append(time.monotonic() - now)
+        else:
+            backlog = self.free_at - now - self.buffers * self.packet_time
+            if backlog > 0:
+                await asyncio.sleep(backlog)
+
+
+    async def request(self, length, handler):
+        # An ATT request with `length` bytes (a read or an acknowledged
+        # write) behind whatever is queued; `handler` runs on the bike and
+        # returns the response. A long value takes one round trip per
+        # MTU-sized piece.
+        self.attempt()
+        self.flush()
+        now = self.queue(length)
+        response = handler()
+        rounds = max(-(-length // (self.mtu - 3)), -(-len(response) // (self.mtu - 1)), 1)
+        await asyncio.sleep(self.free_at - now + rounds * (self.interval + self.latency))
+        self.flush()
+        self.latencies.append(time.monotonic() - now)
+        return response
+
+
+class FirmwareService:
+    # What the bike does with the writes: METADATA (a zero byte, length
+    # and CRC32 big endian) starts a new image, BLOCK data is appended,
+    # and once the padded length is in, the image is decrypted with the
+    # MKEY and CRC checked.
+    def __init__(self, mkey):
+        self.mkey = bytes.fromhex(mkey)
+        self.length = None
+        self.crc = None
+        self.received = bytearray()
+        self.result = None
+        self.image = None
+
+    def metadata(self, data):
+        if len(data) != 9 or data[0] != 0:
+            raise LinkError(f'bad metadata {data.hex()}')
+        self.length = int.from_bytes(data[1:5], 'big')
+        self.crc = int.from_bytes(data[5:9], 'big')
+        self.received = bytearray()
+        self.result = None
+        self.image = None
+
+    def reset(self):
+        self.length = None
+        self.received = bytearray()
+
+    def position(self):
+        return len(self.received) if self.length is not None else 0
+
+    def block(self, data):
+        if self.length is None:
+            self.result = 'block without metadata'
+            return
+        self.received += data
+        padded = (self.length + 15) & ~15
+        if len(self.received) < padded:
+            return
+        if len(self.received) > padded:
+            self.result = f'{len(self.received) - padded} bytes too many'
+            return
+        decryptor = Cipher(algorithms.AES(self.mkey), modes.ECB()).decryptor()
+        image = decryptor.update(bytes(self.received)) + decryptor.finalize()
+        image = image[:self.length]
+        crc = zlib.crc32(image) & 0xffffffff
+        if crc == self.crc:
+            self.result = 'ok'
+            self.image = image
+        else:
+            self.result = f'crc {crc:08x}, expected {self.crc:08x}'
+
+
+class MaintenanceService:
+    # The log as the bike serves it: LOG_SIZE in 16-byte blocks, and a
+    # LOG_BLOCK write (block offset, big endian, and a block count) that
+    # selects what the next LOG_BLOCK read returns. A read is a GATT
+    # attribute value, so at most 512 bytes.
+    MAX_READ = 512
+
+    def __init__(self, log, mode=1):
+        self.data = log
+        self.mode = mode
+        self.offset = 0
+        self.count = 0
+
+    @property
+    def log(self):
+        # The last block is zero padded until the bike writes more.
+        return self.data + b'\0' * (-len(self.data) % read_logs.LOG_BLOCK_SIZE)
+
+    def append(self, data):
+        self.data += data
+
+    def read(self, characteristic):
+        block = read_logs.LOG_BLOCK_SIZE
+        if characteristic == read_logs.Maintenance.LOG_MODE:
+            return bytes([self.mode])
+        if characteristic == read_logs.Maintenance.LOG_SIZE:
+            return (len(self.log) // block).to_bytes(4, 'big')
+        if characteristic == read_logs.Maintenance.LOG_BLOCK:
+            start = self.offset * block
+            return self.log[start:start + min(self.count * block, self.MAX_READ)]
+        raise LinkError(f'cannot read {characteristic}')
+
+    def write(self, characteristic, data):
+        if characteristic != read_logs.Maintenance.LOG_BLOCK or len(data) != 5:
+            raise LinkError(f'cannot write {data.hex()} to {characteristic}')
+        self.offset = int.from_bytes(data[0:4], 'big')
+        self.count = data[4]
+        return b''
+
+
+def fixture_log(size=64 * 1024):
+    # Something log-like to serve when no fixture is given.
+    lines = []
+    total = 0
+    n = 0
+    while total < size:
+        line = f'{n * 37 // 10:8d}.{n * 373 % 1000:03d} [main] state {n % 7} speed {n % 25} km/h batt {100 - n % 100}%\n'
+        lines.append(line)
+        total += len(line)
+        n += 1
+    return ''.join(lines).encode('ascii')[:size]
+
+
+class MockTransport:
+    def __init__(self, service, link, maintenance=None):
+        self.service = service
+        self.link = link
+        self.maintenance = maintenance
+
+    @property
+    def mtu(self):
+        return self.link.mtu
+
+    @property
+    def connected(self):
+        return self.link.connected
+
+    async def position(self):
+        self.link.flush()
+        return self.service.position()
+
+    async def write_metadata(self, metadata):
+        await self.link.send(len(metadata), True, lambda: self.service.metadata(metadata))
+
+    async def write_block(self, chunk, response):
+        await self.link.send(len(chunk), response, lambda: self.service.block(chunk))
+
+    async def read(self, characteristic):
+        return await self.link.request(1, lambda: self.maintenance.read(characteristic))
+
+    async def write(self, characteristic, data):
+        await self.link.request(len(data), lambda: self.maintenance.write(characteristic, data))
+
+
+MKEY = '4638384135453030303030304d4f4f46'
+
+
+def make_link(args):
+    return Link(mtu=args.mtu, interval=args.interval / 1000, packet_time=args.packet_time / 1000,
+                latency=args.latency / 1000, loss=args.loss, disconnect=args.disconnect, seed=args.seed)
+
+
+def report(args, name, result, nbytes, elapsed, link):
+    # One summary per run, and optionally a JSON line to compare runs.
+    lat = sorted(link.latencies)
+    print(f'--- {name}: {result}, {nbytes} bytes in {elapsed:.2f}s, {nbytes / elapsed / 1024:.1f} KiB/s')
+    print(f'link: mtu {link.mtu}, interval {link.interval * 1000:g} ms, packet {link.packet_time * 1000:g} ms, '
+          f'latency {link.latency * 1000:g} ms, loss {link.loss:g}, disconnect {link.disconnect:g}')
+    print(f'operations: {link.writes}, {link.failed} failed, {link.drops} disconnects losing {link.lost} writes')
+    if lat:
+        p95 = lat[min(len(lat) - 1, int(len(lat) * 0.95))]
+        print(f'round trips: {len(lat)}, min {lat[0] * 1000:.1f} ms, median {statistics.median(lat) * 1000:.1f} ms, '
+              f'p95 {p95 * 1000:.1f} ms, max {lat[-1] * 1000:.1f} ms')
+
+    if args.json:
+        entry = {
+            'run': name, 'result': result, 'bytes': nbytes, 'seconds': round(elapsed, 3),
+            'kib_per_s': round(nbytes / elapsed / 1024, 2), 'window': getattr(args, 'window', None),
+            'mtu': link.mtu, 'interval_ms': link.interval * 1000, 'packet_ms': link.packet_time * 1000,
+            'latency_ms': link.latency * 1000, 'loss': link.loss, 'disconnect': link.disconnect,
+            'operations': link.writes, 'failed': link.failed, 'disconnects': link.drops, 'lost': link.lost,
+            'round_trips': len(lat),
+            'median_ms': round(statistics.median(lat) * 1000, 2) if lat else None,
+        }
+        with open(args.json, 'a') as f:
+            f.write(json.dumps(entry) + '\n')
+
+
+async def run_update(args):
+    service = FirmwareService(MKEY)
+    link = make_link(args)
+    transport = MockTransport(service, link)
+
+    metadata, enc = update.prepare(MKEY, args.image)
+    window = args.window or update.window_size(link.mtu, link.interval)
+    args.window = window
+
+    # The same reconnect-and-resume loop as update.py, with a throwaway
+    # checkpoint file unless one is given.
+    path = args.checkpoint or os.path.join(tempfile.mkdtemp(), 'checkpoint.json')
+    checkpoint = update.Checkpoint(path, 'mock', enc)
+    started = time.monotonic()
+    result = None
+    for attempt in range(args.reconnects + 1):
+        try:
+            await update.firmware_update(transport, metadata, enc, window, checkpoint)
+            result = service.result
+            break
+        except Disconnected as e:
+            if attempt == args.reconnects:
+                print(f'\nconnection lost ({e}), giving up')
+                result = f'disconnected {attempt + 1} times, gave up'
+                break
+            print(f'\nconnection lost ({e}), reconnecting')
+            if args.forget:
+                service.reset()
+            link.reconnect()
+    elapsed = time.monotonic() - started
+
+    report(args, 'update', result, len(enc), elapsed, link)
+    return 0 if result == 'ok' else 1
+
+
+async def run_logs(args):
+    if args.log:
+        with open(args.log, 'rb') as f:
+            log = f.read()
+    else:
+        log = fixture_log()
+    maintenance = MaintenanceService(log)
+
+    # Every run fetches into the same store, so from the second run on
+    # only what the bike logged in between (--grow bytes) is fetched.
+    store = read_logs.LogStore(args.store or tempfile.mkdtemp(), 'mock')
+    status = 0
+    for run in range(args.runs):
+        if run:
+            maintenance.append(fixture_log(len(maintenance.data) + args.grow)[len(maintenance.data):])
+        link = make_link(args)
+        transport = MockTransport(None, link, maintenance)
+
+        started = time.monotonic()
+        data = await read_logs.read_log(transport, store, echo=args.echo)
+        elapsed = time.monotonic() - started
+
+        result = 'ok' if store.read() == maintenance.log else 'mismatch'
+        report(args, f'logs run {run + 1}', result, len(data), elapsed, link)
+        if result != 'ok':
+            status = 1
+    return status
+
+
+def parse_args(argv=None):
+    link = argparse.ArgumentParser(add_help=False)
+    link.add_argument('--mtu', type=int, default=247, help='ATT MTU (default 247)')
+    link.add_argument('--interval', type=float, default=30, help='connection interval in ms (default 30)')
+    link.add_argument('--packet-time', type=float, default=2.5, help='air time per packet in ms (default 2.5)')
+    link.add_argument('--latency', type=float, default=0, help='extra latency per round trip in ms')
+    link.add_argument('--loss', type=float, default=0, help='chance that an operation fails (0..1)')
+    link.add_argument('--disconnect', type=float, default=0, help='chance that the link drops on an operation (0..1)')
+    link.add_argument('--seed', type=int, help='random seed for loss and disconnects')
+    link.add_argument('--json', help='append a JSON line with the results to this file')
+
+    parser = argparse.ArgumentParser(description='Run update.py or read_logs.py against a simulated bike.')
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    p = commands.add_parser('update', parents=[link], help='firmware update (update.py)')
+    p.add_argument('image', help='firmware image or otaenc stream (MKEY as in update.py)')
+    p.add_argument('--window', type=int, default=0, help='BLOCK writes per acknowledged write')
+    p.add_argument('--forget', action='store_true', help='the bike forgets the transfer on a disconnect')
+    p.add_argument('--reconnects', type=int, default=20, help='times to reconnect and resume (default 20)')
+    p.add_argument('--checkpoint', help='checkpoint file (default: a temporary one)')
+
+    p = commands.add_parser('logs', parents=[link], help='log download (read_logs.py)')
+    p.add_argument('--log', help='file to serve as the bike log (default: generated, 64 KiB)')
+    p.add_argument('--echo', action='store_true', help='print the log as it is read')
+    p.add_argument('--store', help='log store directory, as in read_logs.py (default: a temporary one)')
+    p.add_argument('--runs', type=int, default=1, help='downloads into the same store (default 1)')
+    p.add_argument('--grow', type=int, default=0, help='bytes the bike logs between runs')
+
+    return parser.parse_args(argv)
+
+
+if __name__ == '__main__':
+    args = parse_args()
+    sys.exit(asyncio.run(run_update(args) if args.command == 'update' else run_logs(args)))
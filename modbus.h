@@ -0,0 +1,76 @@
+#ifndef _MODBUS_H
+#define _MODBUS_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC-16/MODBUS: polynomial 0x8005 reflected (0xa001), initial value
+ * 0xffff, sent low byte first. Modbus RTU (shifter, battery) and the
+ * SLIP framed SSP packets (BLE, motor) both end in it.
+ */
+static uint16_t modbus_crc_table[256];
+
+static void
+modbus_crc_init(void)
+{
+	for (int i = 0; i < 256; i++) {
+		uint16_t crc = i;
+
+		for (int bit = 0; bit < 8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+		modbus_crc_table[i] = crc;
+	}
+}
+
+static uint16_t
+modbus_crc(const uint8_t *data, size_t len)
+{
+	uint16_t crc = 0xffff;
+
+	while (len--)
+		crc = (crc >> 8) ^ modbus_crc_table[(crc ^ *data++) & 0xff];
+	return crc;
+}
+
+/*
+ * Modbus RTU frames, as the main MCU polls the shifter (USART3) and the
+ * battery (UART4): slave address, function code, then
+ *
+ *   01-04 request   start (BE16)  count (BE16)
+ *         response  byte count  data
+ *   05/06           register (BE16)  value (BE16), echoed
+ *   0f/10 request   start (BE16)  count (BE16)  byte count  data
+ *         response  start (BE16)  count (BE16)
+ *   | 0x80          exception code
+ *
+ * and the CRC. Frames are separated by 3.5 characters of silence.
+ */
+#define MODBUS_READ_COILS	0x01
+#define MODBUS_READ_INPUTS	0x02
+#define MODBUS_READ_HOLDING	0x03
+#define MODBUS_READ_INPUT_REGS	0x04
+#define MODBUS_WRITE_COIL	0x05
+#define MODBUS_WRITE_REGISTER	0x06
+#define MODBUS_WRITE_COILS	0x0f
+#define MODBUS_WRITE_REGISTERS	0x10
+#define MODBUS_EXCEPTION	0x80
+
+#define MODBUS_MAX_FRAME	256
+
+/*
+ * Register time series, as written by `mbdump decode -o`. A store is a
+ * directory of columns with one record per change of a register value:
+ *
+ *   registers    text, `<series> <slave> <register> [<name>]` per line;
+ *                input registers (function 04) have 0x10000 added to
+ *                the register number
+ *   time.col     uint32 per record: ms since the start of the capture
+ *   series.col   uint16 per record: the series
+ *   value.col    uint16 per record: the new value
+ *
+ * in time order, little endian, to be mmap'ed.
+ */
+#define MODBUS_INPUT_REG	0x10000
+
+#endif
@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s -k <hexkey> [-o <otafile>] <binfile>\n", progname);
+	fprintf(stderr, "       %s -b <keylist> -d <dir> <binfile>\n", progname);
+	exit(1);
+}
+
+/*
+ * The firmware update service takes a 9-byte metadata write (a zero byte,
+ * then the image length and zlib CRC32, both big endian) followed by the
+ * image, padded with 0xff to the AES block size, encrypted with AES-ECB
+ * under the manufacturer key (MKEY) and written in 240-byte chunks.
+ *
+ * The output is those GATT writes as a stream of frames, so whatever does
+ * the BLE transfer (update.py) only has to forward them:
+ *
+ *   "VMOT"                               once, at the start
+ *   'M' <len> <len bytes>                write to the METADATA characteristic
+ *   'B' <len> <len bytes>                write to the BLOCK characteristic
+ */
+#define OTA_MAGIC	"VMOT"
+#define OTA_METADATA	'M'
+#define OTA_BLOCK	'B'
+#define OTA_CHUNK	240
+
+/* Encrypt this much per EVP call: a multiple of both 16 and 240. */
+#define OTA_BATCH	(OTA_CHUNK * 273)
+
+static uint8_t *
+read_file(const char *path, size_t *lenp)
+{
+	struct stat st;
+	uint8_t *buf;
+	size_t total;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "%s: %s: empty file\n", progname, path);
+		exit(1);
+	}
+
+	buf = malloc(st.st_size);
+	if (buf == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname,
+			(size_t)st.st_size);
+		exit(1);
+	}
+
+	total = 0;
+	while (total < (size_t)st.st_size) {
+		n = read(fd, buf + total, st.st_size - total);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read(%s): %s\n", progname, path,
+				n < 0 ? strerror(errno) : "short read");
+			exit(1);
+		}
+		total += n;
+	}
+	close(fd);
+
+	*lenp = total;
+	return buf;
+}
+
+/* AES-128/192/256 key from hex; returns the cipher, or NULL if malformed. */
+static const EVP_CIPHER *
+parse_key(const char *hex, uint8_t *key)
+{
+	size_t len = strlen(hex), i;
+
+	if (len != 32 && len != 48 && len != 64)
+		return NULL;
+	for (i = 0; i < len; i += 2) {
+		if (!isxdigit((unsigned char)hex[i]) || !isxdigit((unsigned char)hex[i + 1]))
+			return NULL;
+		sscanf(hex + i, "%2hhx", &key[i / 2]);
+	}
+
+	return len == 32 ? EVP_aes_128_ecb() : len == 48 ? EVP_aes_192_ecb() : EVP_aes_256_ecb();
+}
+
+/* Frames are collected here and written in large pieces. */
+static uint8_t outbuf[OTA_BATCH / OTA_CHUNK * (OTA_CHUNK + 2)];
+static size_t outlen;
+
+static void
+flush_out(int out, const char *name)
+{
+	if (outlen && write(out, outbuf, outlen) != (ssize_t)outlen) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, name, strerror(errno));
+		exit(1);
+	}
+	outlen = 0;
+}
+
+static void
+put_frame(int out, const char *name, uint8_t type, const uint8_t *data, size_t len)
+{
+	if (outlen + len + 2 > sizeof(outbuf))
+		flush_out(out, name);
+	outbuf[outlen++] = type;
+	outbuf[outlen++] = len;
+	memcpy(outbuf + outlen, data, len);
+	outlen += len;
+}
+
+/*
+ * Write the whole frame stream for one key. The image is encrypted in
+ * OTA_BATCH pieces straight into chunk frames; only the last piece needs
+ * the 0xff padding.
+ */
+static size_t
+encode(int out, const char *name, const EVP_CIPHER *cipher, const uint8_t *key,
+       const uint8_t *data, size_t length, uint32_t crc)
+{
+	uint8_t metadata[9];
+	uint8_t in[OTA_BATCH], enc[OTA_BATCH];
+	size_t offset, n, padded, chunks = 0, i;
+	EVP_CIPHER_CTX *ctx;
+	int outl;
+
+	metadata[0] = 0;
+	metadata[1] = length >> 24;
+	metadata[2] = length >> 16;
+	metadata[3] = length >> 8;
+	metadata[4] = length;
+	metadata[5] = crc >> 24;
+	metadata[6] = crc >> 16;
+	metadata[7] = crc >> 8;
+	metadata[8] = crc;
+
+	outlen = 0;
+	memcpy(outbuf, OTA_MAGIC, 4);
+	outlen = 4;
+	put_frame(out, name, OTA_METADATA, metadata, sizeof(metadata));
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL || !EVP_EncryptInit_ex(ctx, cipher, NULL, key, NULL)) {
+		fprintf(stderr, "%s: EVP_EncryptInit failed\n", progname);
+		exit(1);
+	}
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+	for (offset = 0; offset < length; offset += n) {
+		n = length - offset < OTA_BATCH ? length - offset : OTA_BATCH;
+		padded = (n + 15) & ~(size_t)15;
+		memcpy(in, data + offset, n);
+		memset(in + n, 0xff, padded - n);
+
+		if (!EVP_EncryptUpdate(ctx, enc, &outl, in, padded) || (size_t)outl != padded) {
+			fprintf(stderr, "%s: EVP_EncryptUpdate failed\n", progname);
+			exit(1);
+		}
+		for (i = 0; i < padded; i += OTA_CHUNK, chunks++)
+			put_frame(out, name, OTA_BLOCK, enc + i, padded - i < OTA_CHUNK ? padded - i : OTA_CHUNK);
+	}
+	flush_out(out, name);
+
+	EVP_CIPHER_CTX_free(ctx);
+	return chunks;
+}
+
+static int
+create(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+/*
+ * Batch mode: one output per line of the key list, `<name> <hexkey>`,
+ * written to <dir>/<name>.ota. The image is read and CRC'd once.
+ */
+static void
+batch(const char *keylist, const char *dir, const uint8_t *data, size_t length, uint32_t crc)
+{
+	char line[512], name[256], hex[256], path[4096];
+	const EVP_CIPHER *cipher;
+	uint8_t key[32];
+	int lineno = 0, count = 0, out;
+	FILE *f;
+
+	f = fopen(keylist, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, keylist, strerror(errno));
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (sscanf(line, "%255s %255s", name, hex) != 2 || name[0] == '#') {
+			if (sscanf(line, "%255s", name) == 1 && name[0] != '#') {
+				fprintf(stderr, "%s: %s:%d: expected <name> <hexkey>\n", progname, keylist, lineno);
+				exit(1);
+			}
+			continue;
+		}
+		cipher = parse_key(hex, key);
+		if (cipher == NULL || strchr(name, '/')) {
+			fprintf(stderr, "%s: %s:%d: bad %s\n", progname, keylist, lineno,
+				cipher == NULL ? "key" : "name");
+			exit(1);
+		}
+
+		snprintf(path, sizeof(path), "%s/%s.ota", dir, name);
+		out = create(path);
+		encode(out, path, cipher, key, data, length, crc);
+		if (close(out) < 0) {
+			fprintf(stderr, "%s: close(%s): %s\n", progname, path, strerror(errno));
+			exit(1);
+		}
+		count++;
+	}
+	fclose(f);
+
+	fprintf(stderr, "%s: %d images written to %s\n", progname, count, dir);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *hexkey = NULL, *outfile = NULL, *keylist = NULL, *dir = NULL;
+	const EVP_CIPHER *cipher;
+	uint8_t key[32];
+	uint8_t *data;
+	size_t length, chunks;
+	uint32_t crc;
+	int out, opt;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "k:o:b:d:")) != -1) {
+		switch (opt) {
+			case 'k':
+				hexkey = optarg;
+				break;
+			case 'o':
+				outfile = optarg;
+				break;
+			case 'b':
+				keylist = optarg;
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 1 || (hexkey == NULL) == (keylist == NULL) ||
+	    (keylist && (dir == NULL || outfile)) || (hexkey && dir))
+		usage();
+
+	data = read_file(argv[optind], &length);
+	if (length > UINT32_MAX) {
+		fprintf(stderr, "%s: %s: larger than 4 GiB\n", progname, argv[optind]);
+		exit(1);
+	}
+	crc = crc32(0, data, length);
+	fprintf(stderr, "file %s: len %zu crc 0x%08x\n", argv[optind], length, crc);
+
+	if (keylist) {
+		batch(keylist, dir, data, length, crc);
+		free(data);
+		return 0;
+	}
+
+	cipher = parse_key(hexkey, key);
+	if (cipher == NULL) {
+		fprintf(stderr, "%s: key must be 32, 48 or 64 hex digits\n", progname);
+		exit(1);
+	}
+
+	if (outfile) {
+		out = create(outfile);
+	} else {
+		if (isatty(STDOUT_FILENO)) {
+			fprintf(stderr, "%s: refusing to write binary frames to a terminal\n", progname);
+			exit(1);
+		}
+		out = STDOUT_FILENO;
+		outfile = "stdout";
+	}
+
+	chunks = encode(out, outfile, cipher, key, data, length, crc);
+	if (close(out) < 0) {
+		fprintf(stderr, "%s: close(%s): %s\n", progname, outfile, strerror(errno));
+		exit(1);
+	}
+	fprintf(stderr, "%s: metadata + %zu chunks of %d bytes\n", outfile, chunks, OTA_CHUNK);
+
+	free(data);
+	return 0;
+}
@@ -4,34 +4,770 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/sha.h>
 
 #include "endian_compat.h"
+#include "copy_compat.h"
 
 #include "pack.h"
 #include "ware.h"
+#include "ware_check.h"
 
 static char *progname;
 
+/* Running SHA256 over everything written, for --head; NULL otherwise. */
+static EVP_MD_CTX *sha_ctx;
+
+static int verify, stamp;
+/* The PACK being written, removed again when --verify rejects an entry. */
+static const char *outfile;
+
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s <packfile> <warefile> [<warefile> ...]\n", progname);
+	fprintf(stderr, "usage: %s [--verify] [--stamp] [--head [--key <pemfile>]] <packfile>|- <warefile> [<warefile> ...]\n", progname);
+	fprintf(stderr, "       %s [--verify] [--stamp] [--head [--key <pemfile>]] -M <manifest> <packfile>|-\n", progname);
+	fprintf(stderr, "       %s --update [-M <manifest>] <packfile> <warefile> [<warefile> ...]\n", progname);
+	fprintf(stderr, "       %s --compact [-M <manifest>] <packfile>\n", progname);
+	exit(1);
+}
+
+static void
+write_out(int out, const void *data, size_t length)
+{
+	ssize_t n;
+
+	n = write(out, data, length);
+	if (n != (ssize_t)length) {
+		fprintf(stderr, "%s: write(%zu): %zd\n", progname, length, n);
+		exit(1);
+	}
+	if (sha_ctx)
+		EVP_DigestUpdate(sha_ctx, data, length);
+}
+
+/* Zero-fill after an entry of `length` bytes up to the 4-byte alignment. */
+static void
+pad_entry(int out, size_t length)
+{
+	static const char pad[3];
+
+	if (length & 3)
+		write_out(out, pad, 4 - (length & 3));
+}
+
+/* Zero-fill from `from` up to the next entry (or directory) at `to`. */
+static void
+pad_to(int out, size_t from, size_t to)
+{
+	static const char zero[4096];
+
+	while (from < to) {
+		size_t m = to - from < sizeof(zero) ? to - from : sizeof(zero);
+		write_out(out, zero, m);
+		from += m;
+	}
+}
+
+/*
+ * Copy one input file into the PACK. Unhashed, the kernel moves the data;
+ * with --head or --verify it has to pass through here once anyway.
+ */
+static int
+copy_entry(int in, int out, size_t length, ware_check_t *check)
+{
+	char buffer[65536];
+	size_t total = 0;
+	ssize_t n;
+
+	if (sha_ctx == NULL && check == NULL)
+		return copy_range(in, 0, out, length);
+
+	while (total < length) {
+		size_t m = length - total;
+		if (m > sizeof(buffer))
+			m = sizeof(buffer);
+		n = pread(in, buffer, m, total);
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		write_out(out, buffer, n);
+		if (check)
+			ware_check_update(check, buffer, n);
+		total += n;
+	}
+
+	return 0;
+}
+
+static void
+add_tlv(uint8_t *trailer, size_t *length, uint16_t type, const void *data, size_t size)
+{
+	image_tlv_t tlv;
+
+	tlv.type = htole16(type);
+	tlv.length = htole16(size);
+	memcpy(trailer + *length, &tlv, sizeof(tlv));
+	memcpy(trailer + *length + sizeof(tlv), data, size);
+	*length += sizeof(tlv) + size;
+}
+
+/*
+ * Finish the running SHA256 and build the signature trailer that follows
+ * a HEAD-wrapped PACK: the TLV info header, the SHA256 of everything in
+ * front of the trailer and, with a key, the SHA256 of its public key
+ * (DER SubjectPublicKeyInfo) and the ECDSA signature over the image hash.
+ * Returns the trailer length.
+ */
+static size_t
+build_trailer(uint8_t *trailer, EVP_PKEY *key)
+{
+	uint8_t sha[SHA256_DIGEST_LENGTH];
+	unsigned char *der = NULL;
+	uint8_t keyhash[SHA256_DIGEST_LENGTH];
+	uint8_t sig[256];
+	size_t length = sizeof(image_tlv_t);
+	size_t sig_len = sizeof(sig);
+	image_tlv_t tlv;
+	EVP_PKEY_CTX *ctx;
+	int der_len;
+
+	EVP_DigestFinal_ex(sha_ctx, sha, NULL);
+	add_tlv(trailer, &length, IMAGE_TLV_SHA256, sha, sizeof(sha));
+
+	if (key) {
+		der_len = i2d_PUBKEY(key, &der);
+		if (der_len <= 0) {
+			fprintf(stderr, "%s: cannot encode the public key\n", progname);
+			exit(1);
+		}
+		EVP_Digest(der, der_len, keyhash, NULL, EVP_sha256(), NULL);
+		OPENSSL_free(der);
+		add_tlv(trailer, &length, IMAGE_TLV_KEYHASH, keyhash, sizeof(keyhash));
+
+		ctx = EVP_PKEY_CTX_new(key, NULL);
+		if (ctx == NULL || EVP_PKEY_sign_init(ctx) <= 0 ||
+		    EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) <= 0 ||
+		    EVP_PKEY_sign(ctx, sig, &sig_len, sha, sizeof(sha)) <= 0) {
+			fprintf(stderr, "%s: ECDSA signing failed\n", progname);
+			exit(1);
+		}
+		EVP_PKEY_CTX_free(ctx);
+		add_tlv(trailer, &length, IMAGE_TLV_ECDSA_SIG, sig, sig_len);
+	}
+
+	tlv.type = htole16(IMAGE_TLV_INFO_MAGIC);
+	tlv.length = htole16(length);
+	memcpy(trailer, &tlv, sizeof(tlv));
+
+	return length;
+}
+
+static EVP_PKEY *
+load_key(const char *keyfile)
+{
+	EVP_PKEY *key;
+	FILE *f;
+
+	f = fopen(keyfile, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, keyfile, strerror(errno));
+		exit(1);
+	}
+	key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+	fclose(f);
+	if (key == NULL || EVP_PKEY_base_id(key) != EVP_PKEY_EC) {
+		fprintf(stderr, "%s: %s: not an EC private key\n", progname, keyfile);
+		exit(1);
+	}
+
+	return key;
+}
+
+static const char *
+base_name(const char *path)
+{
+	const char *basename = strrchr(path, '/');
+
+	return basename ? basename + 1 : path;
+}
+
+/*
+ * Read the directory of an existing, bare PACK that is to be modified. A
+ * HEAD wrapper or a signature trailer behind the directory would no longer
+ * match afterwards, so those are refused: rebuild and re-sign instead.
+ * `spare` extra entries are allocated for appending.
+ */
+static pack_entry_t *
+read_directory(int fd, const char *packfile, pack_header_t *header, size_t spare)
+{
+	pack_entry_t *entries;
+	struct stat st;
+	size_t dir_len;
+
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, packfile, strerror(errno));
+		exit(1);
+	}
+	if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+	    memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0) {
+		fprintf(stderr, "%s: %s: not a bare PACK file\n", progname, packfile);
+		exit(1);
+	}
+
+	dir_len = le32toh(header->length);
+	if ((off_t)le32toh(header->offset) + dir_len != st.st_size) {
+		fprintf(stderr, "%s: %s: data behind the PACK directory (signature?), rebuild it instead\n",
+			progname, packfile);
+		exit(1);
+	}
+
+	entries = calloc(dir_len / sizeof(pack_entry_t) + spare, sizeof(pack_entry_t));
+	if (entries == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, dir_len);
+		exit(1);
+	}
+	if (pread(fd, entries, dir_len, le32toh(header->offset)) != (ssize_t)dir_len) {
+		fprintf(stderr, "%s: read(%zu): %s\n", progname, dir_len, strerror(errno));
+		exit(1);
+	}
+
+	return entries;
+}
+
+static size_t entry_align(const char *name);
+
+/*
+ * Replace or add entries in an existing PACK without rewriting the rest.
+ * A new version that fits the old entry's 4-byte padded slot is written
+ * over it. Anything else goes behind the current end of the file, 4-byte
+ * aligned or as the -M manifest asks (see entry_align()), followed by a
+ * new directory; the header, pointing at the new directory, is written
+ * last. The old directory and outgrown slots become dead space until
+ * --compact.
+ */
+static void
+update_pack(const char *packfile, char **files, int count)
+{
+	static const char zero[4096];
+	pack_header_t header;
+	pack_entry_t *entries;
+	struct stat st;
+	unsigned n_entries, j;
+	size_t end, length, slot, offset;
+	int fd, in, i;
+
+	fd = open(packfile, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, packfile, strerror(errno));
+		exit(1);
+	}
+
+	entries = read_directory(fd, packfile, &header, count);
+	n_entries = le32toh(header.length) / sizeof(pack_entry_t);
+	end = le32toh(header.offset) + le32toh(header.length);
+
+	for (i = 0; i < count; i++) {
+		const char *name = base_name(files[i]);
+
+		in = open(files[i], O_RDONLY);
+		if (in < 0 || fstat(in, &st) < 0) {
+			fprintf(stderr, "%s: open(%s): %s\n", progname, files[i], strerror(errno));
+			exit(1);
+		}
+		length = st.st_size;
+
+		for (j = 0; j < n_entries; j++)
+			if (strncmp(entries[j].filename, name, sizeof(entries[j].filename)) == 0)
+				break;
+
+		slot = j < n_entries ? (le32toh(entries[j].length) + 3) & ~(size_t)3 : 0;
+		if (j < n_entries && ((length + 3) & ~(size_t)3) <= slot) {
+			if (lseek(fd, le32toh(entries[j].offset), SEEK_SET) < 0 ||
+			    copy_range(in, 0, fd, length) < 0) {
+				fprintf(stderr, "%s: copy(%s, 0x%zx): %s\n", progname, files[i], length, strerror(errno));
+				exit(1);
+			}
+			/* Clear what is left of the old data in the slot. */
+			for (size_t off = length; off < slot; off += sizeof(zero)) {
+				size_t m = slot - off < sizeof(zero) ? slot - off : sizeof(zero);
+				if (pwrite(fd, zero, m, le32toh(entries[j].offset) + off) != (ssize_t)m) {
+					fprintf(stderr, "%s: write(%zu): %s\n", progname, m, strerror(errno));
+					exit(1);
+				}
+			}
+			entries[j].length = htole32(length);
+			printf("file: %s, offset 0x%08x, length 0x%08x (in place)\n", entries[j].filename,
+				le32toh(entries[j].offset), le32toh(entries[j].length));
+		} else {
+			size_t align = entry_align(name);
+
+			offset = (end + align - 1) & ~(align - 1);
+			if (offset + length + n_entries * sizeof(pack_entry_t) > UINT32_MAX) {
+				fprintf(stderr, "%s: %s: PACK would exceed 4 GiB\n", progname, files[i]);
+				exit(1);
+			}
+			if (j == n_entries) {
+				strncpy(entries[j].filename, name, sizeof(entries[j].filename));
+				n_entries++;
+			}
+			if (lseek(fd, end, SEEK_SET) < 0) {
+				fprintf(stderr, "%s: lseek(%s): %s\n", progname, packfile, strerror(errno));
+				exit(1);
+			}
+			pad_to(fd, end, offset);
+			if (copy_range(in, 0, fd, length) < 0) {
+				fprintf(stderr, "%s: copy(%s, 0x%zx): %s\n", progname, files[i], length, strerror(errno));
+				exit(1);
+			}
+			pad_entry(fd, length);
+			entries[j].offset = htole32(offset);
+			entries[j].length = htole32(length);
+			end = (offset + length + 3) & ~(size_t)3;
+			printf("file: %s, offset 0x%08x, length 0x%08x (%s)\n", entries[j].filename,
+				le32toh(entries[j].offset), le32toh(entries[j].length),
+				slot ? "moved" : "added");
+		}
+
+		close(in);
+	}
+
+	/* Something moved: new directory behind the data, then the header. */
+	if (end != le32toh(header.offset) + le32toh(header.length)) {
+		header.offset = htole32(end);
+		header.length = htole32(n_entries * sizeof(pack_entry_t));
+	}
+	if (pwrite(fd, entries, le32toh(header.length), le32toh(header.offset)) != (ssize_t)le32toh(header.length) ||
+	    pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, packfile, strerror(errno));
+		exit(1);
+	}
+
+	free(entries);
+	if (close(fd) < 0) {
+		fprintf(stderr, "%s: close(%s): %s\n", progname, packfile, strerror(errno));
+		exit(1);
+	}
+}
+
+/*
+ * Drop the dead space --update leaves behind: write the entries back to
+ * back into a new file next to the PACK and rename it over the original.
+ */
+static void
+compact_pack(const char *packfile)
+{
+	char tmp[4096];
+	pack_header_t header;
+	pack_entry_t *entries;
+	struct stat st;
+	unsigned n_entries, j;
+	size_t offset, length;
+	int fd, out;
+
+	fd = open(packfile, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, packfile, strerror(errno));
+		exit(1);
+	}
+	entries = read_directory(fd, packfile, &header, 0);
+	n_entries = le32toh(header.length) / sizeof(pack_entry_t);
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", packfile);
+	out = mkstemp(tmp);
+	if (out < 0) {
+		fprintf(stderr, "%s: mkstemp(%s): %s\n", progname, tmp, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) == 0)
+		fchmod(out, st.st_mode & 0777);
+
+	/*
+	 * Same layout rule as a fresh pack: back to back, 4-byte aligned or as
+	 * the -M manifest asks (see entry_align()).
+	 */
+	offset = sizeof(header);
+	if (write(out, &header, sizeof(header)) != sizeof(header)) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, tmp, strerror(errno));
+		exit(1);
+	}
+	for (j = 0; j < n_entries; j++) {
+		size_t align = entry_align(entries[j].filename);
+
+		length = le32toh(entries[j].length);
+		pad_to(out, offset, (offset + align - 1) & ~(align - 1));
+		offset = (offset + align - 1) & ~(align - 1);
+		if (copy_range(fd, le32toh(entries[j].offset), out, length) < 0) {
+			fprintf(stderr, "%s: copy(%.56s, 0x%zx): %s\n", progname, entries[j].filename, length, strerror(errno));
+			exit(1);
+		}
+		pad_entry(out, length);
+		entries[j].offset = htole32(offset);
+		offset = (offset + length + 3) & ~(size_t)3;
+	}
+	header.offset = htole32(offset);
+	if (write(out, entries, le32toh(header.length)) != (ssize_t)le32toh(header.length) ||
+	    pwrite(out, &header, sizeof(header), 0) != sizeof(header)) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, tmp, strerror(errno));
+		exit(1);
+	}
+	if (close(out) < 0 || rename(tmp, packfile) < 0) {
+		fprintf(stderr, "%s: rename(%s, %s): %s\n", progname, tmp, packfile, strerror(errno));
+		unlink(tmp);
+		exit(1);
+	}
+
+	printf("%s: compacted 0x%08llx -> 0x%08zx bytes\n", packfile,
+		(unsigned long long)st.st_size, offset + le32toh(header.length));
+	free(entries);
+	close(fd);
+}
+
+/*
+ * One entry of the PACK being built: from the command line (4-byte
+ * aligned, named after the file) or from a -M manifest line.
+ */
+typedef struct {
+	char *path;
+	char name[56];
+	size_t align;
+	size_t length;
+	/* Filled in by the reader threads (-M only). */
+	uint8_t *data;
+	uint32_t crc;
+	int done;
+	int error;
+} pack_input_t;
+
+/*
+ * Parse a manifest: one entry per line, `<name> <path> [<align>]`, blank
+ * lines and lines starting with '#' ignored. A relative path is taken
+ * relative to the manifest's directory; the alignment (default 4) must be
+ * a power of two of at least 4.
+ */
+static pack_input_t *
+read_manifest(const char *manifest, int *count)
+{
+	pack_input_t *inputs = NULL;
+	char line[4096], name[4096], path[4096], align[64];
+	const char *dir_end = strrchr(manifest, '/');
+	int dir_len = dir_end ? dir_end - manifest + 1 : 0;
+	int n = 0, size = 0, lineno = 0, fields;
+	FILE *f;
+
+	f = fopen(manifest, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, manifest, strerror(errno));
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		fields = sscanf(line, "%4095s %4095s %63s", name, path, align);
+		if (fields <= 0 || name[0] == '#')
+			continue;
+		if (fields < 2) {
+			fprintf(stderr, "%s: %s:%d: expected <name> <path> [<align>]\n", progname, manifest, lineno);
+			exit(1);
+		}
+
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			inputs = realloc(inputs, size * sizeof(*inputs));
+			if (inputs == NULL) {
+				fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, size * sizeof(*inputs));
+				exit(1);
+			}
+		}
+		memset(&inputs[n], 0, sizeof(inputs[n]));
+
+		if (strlen(name) > sizeof(inputs[n].name)) {
+			fprintf(stderr, "%s: %s:%d: name longer than %zu bytes\n", progname, manifest, lineno,
+				sizeof(inputs[n].name));
+			exit(1);
+		}
+		strncpy(inputs[n].name, name, sizeof(inputs[n].name));
+
+		if (path[0] == '/')
+			inputs[n].path = strdup(path);
+		else if (asprintf(&inputs[n].path, "%.*s%s", dir_len, manifest, path) < 0)
+			inputs[n].path = NULL;
+		if (inputs[n].path == NULL) {
+			fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, strlen(path));
+			exit(1);
+		}
+
+		inputs[n].align = 4;
+		if (fields == 3) {
+			char *end;
+			unsigned long a = strtoul(align, &end, 0);
+			if (*end != '\0' || a < 4 || (a & (a - 1)) != 0 || a > 0x100000) {
+				fprintf(stderr, "%s: %s:%d: bad alignment %s\n", progname, manifest, lineno, align);
+				exit(1);
+			}
+			inputs[n].align = a;
+		}
+		n++;
+	}
+	fclose(f);
+
+	if (n == 0) {
+		fprintf(stderr, "%s: %s: no entries\n", progname, manifest);
+		exit(1);
+	}
+
+	*count = n;
+	return inputs;
+}
+
+/*
+ * --update and --compact: the directory does not record the alignment an
+ * entry was built with, so it comes from the same -M manifest, if given.
+ */
+static pack_input_t *align_inputs;
+static int align_count;
+
+static size_t
+entry_align(const char *name)
+{
+	for (int i = 0; i < align_count; i++)
+		if (strncmp(align_inputs[i].name, name, sizeof(align_inputs[i].name)) == 0)
+			return align_inputs[i].align;
+	return 4;
+}
+
+/*
+ * Reader pool for -M: a few threads open, read and CRC the inputs ahead
+ * of the writer, so per-file open/read latency overlaps instead of adding
+ * up over thousands of small files. The writer still emits the entries
+ * strictly in manifest order. Readers stay at most READ_AHEAD entries and
+ * READ_BUDGET bytes ahead; the entry the writer waits for is always taken.
+ */
+#define READERS		8
+#define READ_AHEAD	256
+#define READ_BUDGET	(64 * 1024 * 1024)
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t room;
+	pack_input_t *inputs;
+	int count;
+	int next;		/* next entry for a reader */
+	int written;		/* entries the writer is done with */
+	size_t in_flight;	/* bytes held in read buffers */
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+	.room = PTHREAD_COND_INITIALIZER,
+};
+
+static int
+read_input(pack_input_t *input)
+{
+	struct stat st;
+	size_t total = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(input->path, O_RDONLY);
+	if (fd < 0)
+		return errno;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != input->length) {
+		close(fd);
+		return ESTALE;
+	}
+
+	input->data = malloc(input->length ? input->length : 1);
+	if (input->data == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+	while (total < input->length) {
+		n = read(fd, input->data + total, input->length - total);
+		if (n <= 0) {
+			close(fd);
+			return n == 0 ? ESTALE : errno;
+		}
+		total += n;
+	}
+	close(fd);
+
+	return 0;
+}
+
+static void *
+reader(void *arg)
+{
+	pack_input_t *input;
+	int i;
+
+	(void)arg;
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.next < pool.count && pool.next > pool.written &&
+		       (pool.next - pool.written >= READ_AHEAD ||
+			pool.in_flight + pool.inputs[pool.next].length > READ_BUDGET))
+			pthread_cond_wait(&pool.room, &pool.lock);
+		if (pool.next >= pool.count)
+			break;
+
+		i = pool.next++;
+		input = &pool.inputs[i];
+		pool.in_flight += input->length;
+		pthread_mutex_unlock(&pool.lock);
+
+		input->error = read_input(input);
+		if (input->error == 0)
+			input->crc = crc32(0, input->data, input->length);
+
+		pthread_mutex_lock(&pool.lock);
+		input->done = 1;
+		pthread_cond_broadcast(&pool.ready);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+static void
+start_readers(pack_input_t *inputs, int count)
+{
+	pthread_t thread;
+	int i;
+
+	pool.inputs = inputs;
+	pool.count = count;
+	for (i = 0; i < READERS && i < count; i++) {
+		int err = pthread_create(&thread, NULL, reader, NULL);
+
+		if (err != 0) {
+			fprintf(stderr, "%s: pthread_create: %s\n", progname, strerror(err));
+			exit(1);
+		}
+		pthread_detach(thread);
+	}
+}
+
+static pack_input_t *
+wait_input(int i)
+{
+	pack_input_t *input = &pool.inputs[i];
+
+	pthread_mutex_lock(&pool.lock);
+	while (!input->done)
+		pthread_cond_wait(&pool.ready, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	if (input->error) {
+		fprintf(stderr, "%s: read(%s): %s\n", progname, input->path,
+			input->error == ESTALE ? "changed size while packing" : strerror(input->error));
+		exit(1);
+	}
+
+	return input;
+}
+
+static void
+release_input(pack_input_t *input)
+{
+	free(input->data);
+	input->data = NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.written++;
+	pool.in_flight -= input->length;
+	pthread_cond_broadcast(&pool.room);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void
+print_version(const uint8_t *data, size_t length)
+{
+	vanmoof_ware_t ware;
+
+	if (length < sizeof(ware))
+		return;
+	memcpy(&ware, data, sizeof(ware));
+	if (le32toh(ware.magic) == WARE_MAGIC) {
+		printf("      version %x.%x.%x (0x%02x == %s), %.12s %.12s\n",
+			ware.version[3], ware.version[2], ware.version[1],
+			ware.version[0], ware_type_name(ware.version[0]),
+			ware.date, ware.time);
+	}
+}
+
+static int
+is_ware(const uint8_t *data, size_t length)
+{
+	uint32_t magic;
+
+	if (length < sizeof(vanmoof_ware_t))
+		return 0;
+	memcpy(&magic, data, sizeof(magic));
+	return le32toh(magic) == WARE_MAGIC;
+}
+
+/* --stamp: set the length and crc of a ware in its copy, as crc32 -w does. */
+static void
+stamp_entry(pack_input_t *input)
+{
+	uint32_t crc;
+
+	if (!is_ware(input->data, input->length))
+		return;
+
+	crc = ware_stamp(input->data, input->length);
+	if (crc == 0) {
+		fprintf(stderr, "%s: %s: image size 0x%zx is not a word-aligned ware, cannot stamp\n",
+			progname, input->path, input->length);
+		exit(1);
+	}
+	printf("      stamped crc 0x%08x length 0x%08zx\n", crc, input->length);
+}
+
+/* --verify: report the check of an entry, and give up on a failed one. */
+static void
+check_entry(const pack_input_t *input, ware_check_t *check)
+{
+	char msg[256];
+
+	if (ware_check_final(check, msg, sizeof(msg)) != CHECK_FAIL) {
+		printf("      %s\n", msg);
+		return;
+	}
+
+	fprintf(stderr, "%s: %s: %s\n", progname, input->path, msg);
+	if (outfile)
+		unlink(outfile);
 	exit(1);
 }
 
 int
 main(int argc, char **argv)
 {
-	char buffer[8196];
 	char *packfile;
+	char *manifest = NULL;
 	int fd, out;
 	struct stat st;
 	pack_header_t header;
 	pack_entry_t *entries;
-	size_t offset;
-	size_t total;
-	ssize_t n, m;
+	pack_input_t *inputs;
+	vanmoof_head_t head;
+	EVP_PKEY *key = NULL;
+	uint8_t trailer[512];
+	uint8_t buffer[sizeof(vanmoof_ware_t)];
+	size_t offset, pos;
+	size_t length;
+	int with_head = 0;
+	int count;
 	int i;
 
 	progname = strrchr(argv[0], '/');
@@ -40,125 +776,246 @@ main(int argc, char **argv)
 	else
 		progname = argv[0];
 
-	if (argc < 3)
-		usage();
+	if (argc > 1 && (strcmp(argv[1], "--compact") == 0 || strcmp(argv[1], "--update") == 0)) {
+		int compact = strcmp(argv[1], "--compact") == 0;
 
-	packfile = argv[1];
-
-	entries = malloc((argc - 2) * sizeof(pack_entry_t));
-	if (entries == NULL) {
-		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, (argc - 2) * sizeof(pack_entry_t));
-		exit(1);
+		argc--;
+		argv++;
+		if (argc > 2 && strcmp(argv[1], "-M") == 0) {
+			align_inputs = read_manifest(argv[2], &align_count);
+			argc -= 2;
+			argv += 2;
+		}
+		if (compact ? argc != 2 : argc < 3)
+			usage();
+		if (compact)
+			compact_pack(argv[1]);
+		else
+			update_pack(argv[1], argv + 2, argc - 2);
+		return 0;
 	}
-	memset(entries, 0, (argc - 2) * sizeof(pack_entry_t));
 
-	out = open(packfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-	if (out < 0) {
-		fprintf(stderr, "%s: open(%s): %s\n", progname, packfile, strerror(errno));
-		exit(1);
+	while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+		if (strcmp(argv[1], "--head") == 0) {
+			with_head = 1;
+		} else if (strcmp(argv[1], "--key") == 0 && argc > 2) {
+			key = load_key(argv[2]);
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--verify") == 0) {
+			verify = 1;
+		} else if (strcmp(argv[1], "--stamp") == 0) {
+			stamp = 1;
+		} else if (strcmp(argv[1], "-M") == 0 && argc > 2) {
+			manifest = argv[2];
+			argc--;
+			argv++;
+		} else {
+			usage();
+		}
+		argc--;
+		argv++;
 	}
+	if (argc < 2 || (manifest == NULL && argc < 3) || (manifest && argc != 2) ||
+	    (key && !with_head))
+		usage();
 
-	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
-	header.length = htole32((argc - 2) * sizeof(pack_entry_t));
+	packfile = argv[1];
+
+	if (manifest) {
+		inputs = read_manifest(manifest, &count);
+	} else {
+		count = argc - 2;
+		inputs = calloc(count, sizeof(*inputs));
+		if (inputs == NULL) {
+			fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, count * sizeof(*inputs));
+			exit(1);
+		}
+		for (i = 0; i < count; i++) {
+			inputs[i].path = argv[i + 2];
+			strncpy(inputs[i].name, base_name(argv[i + 2]), sizeof(inputs[i].name));
+			inputs[i].align = 4;
+		}
+	}
 
-	n = write(out, &header, sizeof(header));
-	if (n != sizeof(header)) {
-		fprintf(stderr, "%s: write(%zu): %zd\n", progname, sizeof(header), n);
+	entries = calloc(count, sizeof(pack_entry_t));
+	if (entries == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, count * sizeof(pack_entry_t));
 		exit(1);
 	}
 
+	/*
+	 * Lay the whole PACK out before writing anything: every entry's
+	 * offset (each aligned to 4 bytes, or its manifest alignment) and with
+	 * that the directory offset are known from the input sizes alone. The
+	 * file can then be written strictly front to back - header, data,
+	 * directory - which needs no seek back to the header and so also works
+	 * into a pipe.
+	 */
 	offset = sizeof(header);
-	for (i = 0; i < argc - 2; i++) {
-		fd = open(argv[i + 2], O_RDONLY);
-		if (fd < 0) {
-			fprintf(stderr, "%s: open(%s): %s\n", progname, argv[i + 2], strerror(errno));
+	for (i = 0; i < count; i++) {
+		if (stat(inputs[i].path, &st) < 0) {
+			fprintf(stderr, "%s: stat(%s): %s\n", progname, inputs[i].path, strerror(errno));
 			exit(1);
 		}
-
-		if (fstat(fd, &st) < 0) {
-			fprintf(stderr, "%s: fstat(%s): %s\n", progname, argv[i + 2], strerror(errno));
+		if (!S_ISREG(st.st_mode)) {
+			fprintf(stderr, "%s: %s: not a regular file\n", progname, inputs[i].path);
 			exit(1);
 		}
 
-		char *basename = strrchr(argv[i + 2], '/');
-		if (basename)
-			basename++;
-		else
-			basename = argv[i + 2];
-		strncpy(entries[i].filename, basename, sizeof(entries[i].filename));
+		offset = (offset + inputs[i].align - 1) & ~(inputs[i].align - 1);
+		inputs[i].length = st.st_size;
+		memcpy(entries[i].filename, inputs[i].name, sizeof(entries[i].filename));
 		entries[i].offset = htole32(offset);
 		entries[i].length = htole32(st.st_size);
 
-		printf("file: %s, offset 0x%08x, length 0x%08x\n", entries[i].filename,
-			le32toh(entries[i].offset), le32toh(entries[i].length));
+		offset = (offset + st.st_size + 3) & ~(size_t)3;
+		if (offset > UINT32_MAX) {
+			fprintf(stderr, "%s: %s: PACK would exceed 4 GiB\n", progname, inputs[i].path);
+			exit(1);
+		}
+	}
+
+	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+	header.offset = htole32(offset);
+	header.length = htole32(count * sizeof(pack_entry_t));
 
-		/* Parse the firmware header so the packed version is reported. */
-		vanmoof_ware_t ware;
-		if (st.st_size >= (off_t)sizeof(ware) &&
-		    read(fd, &ware, sizeof(ware)) == (ssize_t)sizeof(ware) &&
-		    le32toh(ware.magic) == WARE_MAGIC) {
-			printf("      version %x.%x.%x (0x%02x == %s), %.12s %.12s\n",
-				ware.version[3], ware.version[2], ware.version[1],
-				ware.version[0], ware_type_name(ware.version[0]),
-				ware.date, ware.time);
+	if (strcmp(packfile, "-") == 0) {
+		/* The PACK owns stdout; the listing goes to stderr instead. */
+		if (isatty(STDOUT_FILENO)) {
+			fprintf(stderr, "%s: refusing to write a PACK file to a terminal\n", progname);
+			exit(1);
+		}
+		out = dup(STDOUT_FILENO);
+		if (out < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			fprintf(stderr, "%s: dup(stdout): %s\n", progname, strerror(errno));
+			exit(1);
+		}
+	} else {
+		out = open(packfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (out < 0) {
+			fprintf(stderr, "%s: open(%s): %s\n", progname, packfile, strerror(errno));
+			exit(1);
 		}
-		if (lseek(fd, 0, SEEK_SET) != 0) {
-			fprintf(stderr, "%s: lseek(%s): %s\n", progname, argv[i + 2], strerror(errno));
+	}
+
+	if (fstat(out, &st) == 0 && S_ISREG(st.st_mode)) {
+		preallocate(out, offset + le32toh(header.length));
+		if (out != STDOUT_FILENO && strcmp(packfile, "-") != 0)
+			outfile = packfile;
+	}
+
+	/*
+	 * --head: the HEAD header goes in front and the PACK is hashed as it
+	 * is written, so the signature trailer can follow the directory
+	 * without reading the result back.
+	 */
+	if (with_head) {
+		sha_ctx = EVP_MD_CTX_new();
+		if (sha_ctx == NULL || !EVP_DigestInit_ex(sha_ctx, EVP_sha256(), NULL)) {
+			fprintf(stderr, "%s: EVP_DigestInit failed\n", progname);
 			exit(1);
 		}
+		memset(&head, 0, sizeof(head));
+		head.magic = htole32(HEAD_MAGIC);
+		head.offset = htole32(sizeof(head));
+		head.length = htole32(offset + le32toh(header.length));
+		write_out(out, &head, sizeof(head));
+	}
 
-		total = 0;
-		while (total < st.st_size) {
-			m = st.st_size - total;
-			if (m > sizeof(buffer))
-				m = sizeof(buffer);
-			n = read(fd, buffer, m);
-			if (n != m) {
-				fprintf(stderr, "%s: read(%zu): %zd\n", progname, m, n);
+	write_out(out, &header, sizeof(header));
+	pos = sizeof(header);
+
+	if (manifest)
+		start_readers(inputs, count);
+
+	for (i = 0; i < count; i++) {
+		pack_input_t *input = &inputs[i];
+		ware_check_t check;
+
+		pad_to(out, pos, le32toh(entries[i].offset));
+		pos = le32toh(entries[i].offset) + le32toh(entries[i].length);
+		fd = -1;
+
+		if (manifest) {
+			input = wait_input(i);
+			printf("file: %s, offset 0x%08x, length 0x%08x, crc 0x%08x\n", input->name,
+				le32toh(entries[i].offset), le32toh(entries[i].length), input->crc);
+			print_version(input->data, input->length);
+		} else {
+			fd = open(input->path, O_RDONLY);
+			if (fd < 0) {
+				fprintf(stderr, "%s: open(%s): %s\n", progname, input->path, strerror(errno));
 				exit(1);
 			}
-			n = write(out, buffer, m);
-			if (n != m) {
-				fprintf(stderr, "%s: write(%zu): %zd\n", progname, m, n);
+
+			if (fstat(fd, &st) < 0 || (size_t)st.st_size != input->length) {
+				fprintf(stderr, "%s: %s: changed size while packing\n", progname, input->path);
 				exit(1);
 			}
-			total += n;
-		}
 
-		close(fd);
+			printf("file: %s, offset 0x%08x, length 0x%08x\n", entries[i].filename,
+				le32toh(entries[i].offset), le32toh(entries[i].length));
 
-		offset += st.st_size;
+			/* Parse the firmware header so the packed version is reported. */
+			if (input->length >= sizeof(buffer) &&
+			    pread(fd, buffer, sizeof(buffer), 0) == (ssize_t)sizeof(buffer)) {
+				print_version(buffer, sizeof(buffer));
 
-		switch (offset & 3) {
-			case 1:
-				write(out, "\0", 1);
-				offset++;
-			case 2:
-				write(out, "\0", 1);
-				offset++;
-			case 3:
-				write(out, "\0", 1);
-				offset++;
+				/* A ware to stamp is small; its header can only be
+				 * written once the whole image has been seen. */
+				if (stamp && is_ware(buffer, sizeof(buffer)) &&
+				    (errno = read_input(input)) != 0) {
+					fprintf(stderr, "%s: read(%s): %s\n", progname, input->path,
+						errno == ESTALE ? "changed size while packing" : strerror(errno));
+					exit(1);
+				}
+			}
 		}
-	}
 
-	header.offset = htole32(offset);
+		if (verify)
+			ware_check_init(&check, input->length);
 
-	n = write(out, entries, le32toh(header.length));
-	if (n != le32toh(header.length)) {
-		fprintf(stderr, "%s: write(%u): %zd\n", progname, le32toh(header.length), n);
-		exit(1);
+		if (input->data) {
+			if (stamp)
+				stamp_entry(input);
+			write_out(out, input->data, input->length);
+			if (verify)
+				ware_check_update(&check, input->data, input->length);
+		} else if (copy_entry(fd, out, input->length, verify ? &check : NULL) < 0) {
+			fprintf(stderr, "%s: copy(%s, 0x%zx): %s\n", progname, input->path,
+				input->length, strerror(errno));
+			exit(1);
+		}
+
+		if (verify)
+			check_entry(input, &check);
+
+		if (manifest)
+			release_input(input);
+		else
+			free(input->data);
+		if (fd >= 0)
+			close(fd);
 	}
+	pad_to(out, pos, offset);
 
-	n = lseek(out, 0, SEEK_SET);
-        if (n != 0) {
-		fprintf(stderr, "%s: seek(%u): %zd\n", progname, 0, n);
-		exit(1);
+	write_out(out, entries, le32toh(header.length));
+
+	if (with_head) {
+		length = build_trailer(trailer, key);
+		EVP_MD_CTX_free(sha_ctx);
+		sha_ctx = NULL;
+
+		write_out(out, trailer, length);
+		printf("signature: offset 0x%08zx, length 0x%08zx%s\n",
+			sizeof(head) + offset + le32toh(header.length), length,
+			key ? ", signed" : "");
+		EVP_PKEY_free(key);
 	}
 
-	n = write(out, &header, sizeof(header));
-	if (n != sizeof(header)) {
-		fprintf(stderr, "%s: write(%zu): %zd\n", progname, sizeof(header), n);
+	if (close(out) < 0) {
+		fprintf(stderr, "%s: close(%s): %s\n", progname, packfile, strerror(errno));
 		exit(1);
 	}
 
@@ -0,0 +1,412 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "endian_compat.h"
+
+#include "delta.h"
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s <old-packfile> <new-packfile> <deltafile>\n", progname);
+	exit(1);
+}
+
+static uint8_t *
+read_file(const char *path, size_t *lenp)
+{
+	struct stat st;
+	uint8_t *buf;
+	size_t total;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "%s: %s: empty file\n", progname, path);
+		exit(1);
+	}
+	if (st.st_size > INT32_MAX) {
+		fprintf(stderr, "%s: %s: larger than 2 GiB\n", progname, path);
+		exit(1);
+	}
+
+	buf = malloc(st.st_size);
+	if (buf == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname,
+			(size_t)st.st_size);
+		exit(1);
+	}
+
+	total = 0;
+	while (total < (size_t)st.st_size) {
+		n = read(fd, buf + total, st.st_size - total);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read(%s): %s\n", progname, path,
+				n < 0 ? strerror(errno) : "short read");
+			exit(1);
+		}
+		total += n;
+	}
+	close(fd);
+
+	*lenp = total;
+	return buf;
+}
+
+static void *
+xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (p == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, size);
+		exit(1);
+	}
+	return p;
+}
+
+/*
+ * Suffix array of `data` by prefix doubling: after the round for `k`,
+ * suffixes are sorted by their first 2k bytes. Each round is two stable
+ * counting sorts over the current ranks (second half, then first half),
+ * so a round is O(n) and the whole sort O(n log n) even over the long
+ * 0xff runs of unused flash that a comparison sort chokes on. Stops as
+ * soon as all ranks are distinct.
+ */
+static int32_t *
+suffix_array(const uint8_t *data, size_t n)
+{
+	int32_t *sa = xmalloc(n * sizeof(*sa));
+	int32_t *rank = xmalloc(n * sizeof(*rank));
+	int32_t *tmp = xmalloc(n * sizeof(*tmp));
+	size_t m = n > 256 ? n : 256;
+	int32_t *count = xmalloc((m + 1) * sizeof(*count));
+	size_t i, j, k, p;
+
+	memset(count, 0, 257 * sizeof(*count));
+	for (i = 0; i < n; i++)
+		count[data[i] + 1]++;
+	for (i = 1; i <= 256; i++)
+		count[i] += count[i - 1];
+	for (i = 0; i < n; i++)
+		sa[count[data[i]]++] = i;
+	rank[sa[0]] = 0;
+	for (i = 1; i < n; i++)
+		rank[sa[i]] = rank[sa[i - 1]] + (data[sa[i]] != data[sa[i - 1]]);
+
+	for (k = 1; k < n && (size_t)rank[sa[n - 1]] < n - 1; k *= 2) {
+		/* By second half: suffixes too short to have one come first. */
+		p = 0;
+		for (i = n - k; i < n; i++)
+			tmp[p++] = i;
+		for (i = 0; i < n; i++)
+			if ((size_t)sa[i] >= k)
+				tmp[p++] = sa[i] - k;
+
+		/* Then stable by first half. */
+		memset(count, 0, (m + 1) * sizeof(*count));
+		for (i = 0; i < n; i++)
+			count[rank[i] + 1]++;
+		for (i = 1; i <= m; i++)
+			count[i] += count[i - 1];
+		for (i = 0; i < n; i++)
+			sa[count[rank[tmp[i]]]++] = tmp[i];
+
+		tmp[sa[0]] = 0;
+		for (i = 1; i < n; i++) {
+			j = sa[i - 1];
+			p = sa[i];
+			tmp[p] = tmp[j] + (rank[p] != rank[j] ||
+					   (p + k < n ? rank[p + k] : -1) != (j + k < n ? rank[j + k] : -1));
+		}
+		memcpy(rank, tmp, n * sizeof(*rank));
+	}
+
+	free(rank);
+	free(tmp);
+	free(count);
+	return sa;
+}
+
+static size_t
+match_length(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen)
+{
+	size_t i;
+
+	for (i = 0; i < alen && i < blen; i++)
+		if (a[i] != b[i])
+			break;
+	return i;
+}
+
+/* Longest match of `new` anywhere in `old`; its position goes to `pos`. */
+static size_t
+search(const int32_t *sa, const uint8_t *old, size_t oldsize,
+       const uint8_t *new, size_t newsize, size_t *pos)
+{
+	size_t lo = 0, hi = oldsize - 1, mid, x, y;
+
+	while (hi - lo >= 2) {
+		mid = lo + (hi - lo) / 2;
+		x = oldsize - sa[mid];
+		if (memcmp(old + sa[mid], new, x < newsize ? x : newsize) < 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	x = match_length(old + sa[lo], oldsize - sa[lo], new, newsize);
+	y = match_length(old + sa[hi], oldsize - sa[hi], new, newsize);
+	if (x >= y) {
+		*pos = sa[lo];
+		return x;
+	}
+	*pos = sa[hi];
+	return y;
+}
+
+typedef struct {
+	uint8_t *data;
+	size_t length;
+	size_t size;
+} stream_t;
+
+static void
+stream_put(stream_t *s, const void *data, size_t length)
+{
+	if (s->length + length > s->size) {
+		s->size = (s->length + length) * 2;
+		s->data = realloc(s->data, s->size);
+		if (s->data == NULL) {
+			fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, s->size);
+			exit(1);
+		}
+	}
+	memcpy(s->data + s->length, data, length);
+	s->length += length;
+}
+
+static void
+add_ctrl(stream_t *ctrl, size_t diff, size_t extra, ssize_t seek)
+{
+	delta_ctrl_t c;
+
+	c.diff = htole32((int32_t)diff);
+	c.extra = htole32((int32_t)extra);
+	c.seek = htole32((int32_t)seek);
+	stream_put(ctrl, &c, sizeof(c));
+}
+
+/*
+ * The bsdiff way of matching (C. Percival, "Naive differences of
+ * executable code"): find exact matches through the suffix array, but only
+ * switch to a new match once it is clearly better than just continuing
+ * with the current offset into the old image. Around each match, extend
+ * as long as at least half the bytes agree - recompiled code differs in
+ * scattered bytes (moved addresses), which the diff stream stores as
+ * mostly zeroes that compress well. What no match covers goes to extra.
+ */
+static void
+diff_images(const uint8_t *old, size_t oldsize, const uint8_t *new, size_t newsize,
+	    stream_t *ctrl, stream_t *diff, stream_t *extra)
+{
+	int32_t *sa = suffix_array(old, oldsize);
+	size_t scan = 0, len = 0, pos = 0, scsc;
+	size_t lastscan = 0, lastpos = 0;
+	ssize_t lastoffset = 0;
+	ssize_t s, sf, sb, ss;
+	size_t lenf, lenb, lens, overlap, i;
+	size_t oldscore;
+	uint8_t byte;
+
+	while (scan < newsize) {
+		oldscore = 0;
+
+		for (scsc = scan += len; scan < newsize; scan++) {
+			len = search(sa, old, oldsize, new + scan, newsize - scan, &pos);
+
+			for (; scsc < scan + len; scsc++)
+				if (scsc + lastoffset < oldsize && old[scsc + lastoffset] == new[scsc])
+					oldscore++;
+
+			if ((len == oldscore && len != 0) || len > oldscore + 8)
+				break;
+
+			if (scan + lastoffset < oldsize && old[scan + lastoffset] == new[scan])
+				oldscore--;
+		}
+
+		if (len == oldscore && scan != newsize)
+			continue;
+
+		/* Extend the previous match forward... */
+		s = sf = 0;
+		lenf = 0;
+		for (i = 0; lastscan + i < scan && lastpos + i < oldsize; ) {
+			if (old[lastpos + i] == new[lastscan + i])
+				s++;
+			i++;
+			if (s * 2 - (ssize_t)i > sf * 2 - (ssize_t)lenf) {
+				sf = s;
+				lenf = i;
+			}
+		}
+
+		/* ...and the new one backward... */
+		lenb = 0;
+		if (scan < newsize) {
+			s = sb = 0;
+			for (i = 1; scan >= lastscan + i && pos >= i; i++) {
+				if (old[pos - i] == new[scan - i])
+					s++;
+				if (s * 2 - (ssize_t)i > sb * 2 - (ssize_t)lenb) {
+					sb = s;
+					lenb = i;
+				}
+			}
+		}
+
+		/* ...and split any overlap where it suits both best. */
+		if (lastscan + lenf > scan - lenb) {
+			overlap = (lastscan + lenf) - (scan - lenb);
+			s = ss = 0;
+			lens = 0;
+			for (i = 0; i < overlap; i++) {
+				if (new[lastscan + lenf - overlap + i] == old[lastpos + lenf - overlap + i])
+					s++;
+				if (new[scan - lenb + i] == old[pos - lenb + i])
+					s--;
+				if (s > ss) {
+					ss = s;
+					lens = i + 1;
+				}
+			}
+			lenf += lens - overlap;
+			lenb -= lens;
+		}
+
+		for (i = 0; i < lenf; i++) {
+			byte = new[lastscan + i] - old[lastpos + i];
+			stream_put(diff, &byte, 1);
+		}
+		stream_put(extra, new + lastscan + lenf, (scan - lenb) - (lastscan + lenf));
+		add_ctrl(ctrl, lenf, (scan - lenb) - (lastscan + lenf),
+			 (ssize_t)(pos - lenb) - (ssize_t)(lastpos + lenf));
+
+		lastscan = scan - lenb;
+		lastpos = pos - lenb;
+		lastoffset = (ssize_t)pos - (ssize_t)scan;
+	}
+
+	free(sa);
+}
+
+static void
+write_stream(int fd, const char *deltafile, const stream_t *s, uint32_t *length, uint32_t *zlength)
+{
+	uLongf zlen = compressBound(s->length);
+	uint8_t *z = xmalloc(zlen);
+	int ret;
+
+	ret = compress2(z, &zlen, s->data ? s->data : z, s->length, Z_BEST_COMPRESSION);
+	if (ret != Z_OK) {
+		fprintf(stderr, "%s: compress(%zu): %s\n", progname, s->length, zError(ret));
+		exit(1);
+	}
+	if (write(fd, z, zlen) != (ssize_t)zlen) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, deltafile, strerror(errno));
+		exit(1);
+	}
+
+	*length = htole32(s->length);
+	*zlength = htole32(zlen);
+	free(z);
+}
+
+int
+main(int argc, char **argv)
+{
+	stream_t ctrl = { 0 }, diff = { 0 }, extra = { 0 };
+	delta_header_t header;
+	uint8_t *old, *new;
+	size_t oldsize, newsize;
+	off_t size;
+	int fd;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	if (argc != 4)
+		usage();
+
+	old = read_file(argv[1], &oldsize);
+	new = read_file(argv[2], &newsize);
+
+	diff_images(old, oldsize, new, newsize, &ctrl, &diff, &extra);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+	header.old_length = htole32(oldsize);
+	header.old_crc = htole32(crc32(0, old, oldsize));
+	header.new_length = htole32(newsize);
+	header.new_crc = htole32(crc32(0, new, newsize));
+
+	fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, argv[3], strerror(errno));
+		exit(1);
+	}
+
+	/* The header goes in front once the stream sizes are known. */
+	if (lseek(fd, sizeof(header), SEEK_SET) < 0) {
+		fprintf(stderr, "%s: lseek(%s): %s\n", progname, argv[3], strerror(errno));
+		exit(1);
+	}
+	write_stream(fd, argv[3], &ctrl, &header.ctrl_length, &header.ctrl_zlength);
+	write_stream(fd, argv[3], &diff, &header.diff_length, &header.diff_zlength);
+	write_stream(fd, argv[3], &extra, &header.extra_length, &header.extra_zlength);
+
+	size = lseek(fd, 0, SEEK_CUR);
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, argv[3], strerror(errno));
+		exit(1);
+	}
+	if (close(fd) < 0) {
+		fprintf(stderr, "%s: close(%s): %s\n", progname, argv[3], strerror(errno));
+		exit(1);
+	}
+
+	printf("%s: 0x%08zx bytes, crc 0x%08x\n", argv[1], oldsize, le32toh(header.old_crc));
+	printf("%s: 0x%08zx bytes, crc 0x%08x\n", argv[2], newsize, le32toh(header.new_crc));
+	printf("%s: 0x%08llx bytes (%.1f%% of new), %zu blocks, 0x%zx diff, 0x%zx extra\n",
+		argv[3], (unsigned long long)size, 100.0 * size / newsize,
+		ctrl.length / sizeof(delta_ctrl_t), diff.length, extra.length);
+
+	free(ctrl.data);
+	free(diff.data);
+	free(extra.data);
+	free(old);
+	free(new);
+
+	return 0;
+}
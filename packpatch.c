@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "endian_compat.h"
+
+#include "delta.h"
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s <old-packfile> <deltafile> <new-packfile>\n", progname);
+	exit(1);
+}
+
+static uint8_t *
+read_file(const char *path, size_t *lenp)
+{
+	struct stat st;
+	uint8_t *buf;
+	size_t total;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "%s: %s: empty file\n", progname, path);
+		exit(1);
+	}
+
+	buf = malloc(st.st_size);
+	if (buf == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname,
+			(size_t)st.st_size);
+		exit(1);
+	}
+
+	total = 0;
+	while (total < (size_t)st.st_size) {
+		n = read(fd, buf + total, st.st_size - total);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read(%s): %s\n", progname, path,
+				n < 0 ? strerror(errno) : "short read");
+			exit(1);
+		}
+		total += n;
+	}
+	close(fd);
+
+	*lenp = total;
+	return buf;
+}
+
+/* Inflate one of the delta's streams, which must come out at `length`. */
+static uint8_t *
+inflate_stream(const char *deltafile, const char *name, const uint8_t *z, size_t zlength, size_t length)
+{
+	uLongf out = length;
+	uint8_t *data;
+	int ret;
+
+	data = malloc(length ? length : 1);
+	if (data == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, length);
+		exit(1);
+	}
+
+	ret = uncompress(data, &out, z, zlength);
+	if (ret != Z_OK || out != length) {
+		fprintf(stderr, "%s: %s: %s stream: %s\n", progname, deltafile, name,
+			ret != Z_OK ? zError(ret) : "wrong length");
+		exit(1);
+	}
+
+	return data;
+}
+
+static void
+corrupt(const char *deltafile, size_t block)
+{
+	fprintf(stderr, "%s: %s: block %zu points outside the images\n", progname, deltafile, block);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	delta_header_t header;
+	delta_ctrl_t c;
+	uint8_t *old, *delta, *new;
+	uint8_t *ctrl, *diff, *extra;
+	size_t oldsize, deltasize, newsize;
+	size_t ctrl_len, diff_len, extra_len;
+	size_t offset, newpos = 0, diffpos = 0, extrapos = 0, blocks, n, i;
+	ssize_t oldpos = 0;
+	uint32_t crc;
+	int fd;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	if (argc != 4)
+		usage();
+
+	old = read_file(argv[1], &oldsize);
+	delta = read_file(argv[2], &deltasize);
+
+	if (deltasize < sizeof(header)) {
+		fprintf(stderr, "%s: %s: not a delta file\n", progname, argv[2]);
+		exit(1);
+	}
+	memcpy(&header, delta, sizeof(header));
+	if (memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "%s: %s: not a delta file\n", progname, argv[2]);
+		exit(1);
+	}
+
+	crc = crc32(0, old, oldsize);
+	if (oldsize != le32toh(header.old_length) || crc != le32toh(header.old_crc)) {
+		fprintf(stderr, "%s: %s: 0x%08zx bytes, crc 0x%08x, but the delta is from 0x%08x bytes, crc 0x%08x\n",
+			progname, argv[1], oldsize, crc, le32toh(header.old_length), le32toh(header.old_crc));
+		exit(1);
+	}
+
+	offset = sizeof(header);
+	if ((uint64_t)offset + le32toh(header.ctrl_zlength) + le32toh(header.diff_zlength) +
+	    le32toh(header.extra_zlength) > deltasize) {
+		fprintf(stderr, "%s: %s: truncated delta file\n", progname, argv[2]);
+		exit(1);
+	}
+	ctrl_len = le32toh(header.ctrl_length);
+	diff_len = le32toh(header.diff_length);
+	extra_len = le32toh(header.extra_length);
+	ctrl = inflate_stream(argv[2], "ctrl", delta + offset, le32toh(header.ctrl_zlength), ctrl_len);
+	offset += le32toh(header.ctrl_zlength);
+	diff = inflate_stream(argv[2], "diff", delta + offset, le32toh(header.diff_zlength), diff_len);
+	offset += le32toh(header.diff_zlength);
+	extra = inflate_stream(argv[2], "extra", delta + offset, le32toh(header.extra_zlength), extra_len);
+
+	newsize = le32toh(header.new_length);
+	new = malloc(newsize ? newsize : 1);
+	if (new == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, newsize);
+		exit(1);
+	}
+
+	blocks = ctrl_len / sizeof(c);
+	for (i = 0; i < blocks; i++) {
+		memcpy(&c, ctrl + i * sizeof(c), sizeof(c));
+
+		/* Old bytes plus the diff stream. */
+		n = (uint32_t)le32toh(c.diff);
+		if ((int32_t)le32toh(c.diff) < 0 || n > newsize - newpos || n > diff_len - diffpos ||
+		    (n && (oldpos < 0 || (size_t)oldpos > oldsize || n > oldsize - (size_t)oldpos)))
+			corrupt(argv[2], i);
+		for (size_t j = 0; j < n; j++)
+			new[newpos + j] = old[oldpos + j] + diff[diffpos + j];
+		newpos += n;
+		diffpos += n;
+		oldpos += n;
+
+		/* Then new bytes from the extra stream. */
+		n = (uint32_t)le32toh(c.extra);
+		if ((int32_t)le32toh(c.extra) < 0 || n > newsize - newpos || n > extra_len - extrapos)
+			corrupt(argv[2], i);
+		memcpy(new + newpos, extra + extrapos, n);
+		newpos += n;
+		extrapos += n;
+
+		oldpos += (int32_t)le32toh(c.seek);
+	}
+
+	if (newpos != newsize) {
+		fprintf(stderr, "%s: %s: delta ends at 0x%zx of 0x%zx bytes\n", progname, argv[2], newpos, newsize);
+		exit(1);
+	}
+
+	/* Only write what is bit-exact. */
+	crc = crc32(0, new, newsize);
+	if (crc != le32toh(header.new_crc)) {
+		fprintf(stderr, "%s: %s: crc 0x%08x, expected 0x%08x\n", progname, argv[3], crc,
+			le32toh(header.new_crc));
+		exit(1);
+	}
+
+	fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, argv[3], strerror(errno));
+		exit(1);
+	}
+	if (write(fd, new, newsize) != (ssize_t)newsize || close(fd) < 0) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, argv[3], strerror(errno));
+		exit(1);
+	}
+
+	printf("%s: 0x%08zx bytes, crc 0x%08x OK\n", argv[3], newsize, crc);
+
+	free(old);
+	free(delta);
+	free(ctrl);
+	free(diff);
+	free(extra);
+	free(new);
+
+	return 0;
+}
@@ -1,17 +1,9 @@
 import sys
+import os
 import asyncio
-
-import bleak
-import zlib
-
-from pymoof.clients.sx3 import Sound
-from pymoof.clients.sx3 import SX3Client
-from pymoof.tools import discover_bike
-from pymoof.tools import retrieve_encryption_key
-from pymoof.util import bleak_utils
+import argparse
 
 import enum
-import math
 
 
 class Maintenance(enum.Enum):
@@ -23,7 +15,148 @@ class Maintenance(enum.Enum):
     LOG_BLOCK = '6acc55c3-e631-4069-944d-b8ca7598ad50'
 
 
-async def read_logs():
+# The log is addressed in blocks of this many bytes.
+LOG_BLOCK_SIZE = 16
+
+
+class BikeTransport:
+    # Reads and writes of the maintenance characteristics, through
+    # pymoof (which encrypts them with the UKEY). mock_bike.py has the
+    # same interface without a bike.
+    def __init__(self, client):
+        self.client = client
+
+    async def read(self, characteristic):
+        return await self.client._read(characteristic)
+
+    async def write(self, characteristic, data):
+        await self.client._write(characteristic, data)
+
+
+class LogStore:
+    # The raw log of one bike as far as it has been fetched, in
+    # <directory>/<bike>.log: whole blocks from offset 0, so the next run
+    # only has to fetch from len // LOG_BLOCK_SIZE on. The last block may
+    # have been only partly written on the bike (zero padded); it is
+    # fetched again. A log that no longer matches (cleared or wrapped on
+    # the bike) is moved to <bike>.log.1 and fetched from the start.
+    def __init__(self, directory, bike):
+        os.makedirs(directory, exist_ok=True)
+        self.path = os.path.join(directory, f'{bike.replace(":", "")}.log')
+
+    def blocks(self):
+        try:
+            return os.path.getsize(self.path) // LOG_BLOCK_SIZE
+        except OSError:
+            return 0
+
+    def block(self, offset):
+        with open(self.path, 'rb') as f:
+            f.seek(offset * LOG_BLOCK_SIZE)
+            return f.read(LOG_BLOCK_SIZE)
+
+    def truncate(self, offset):
+        with open(self.path, 'r+b') as f:
+            f.truncate(offset * LOG_BLOCK_SIZE)
+
+    def append(self, data):
+        with open(self.path, 'ab') as f:
+            f.write(data)
+
+    def rotate(self):
+        if os.path.exists(self.path):
+            os.replace(self.path, f'{self.path}.1')
+
+    def read(self):
+        with open(self.path, 'rb') as f:
+            return f.read()
+
+
+async def read_blocks(transport, offset):
+    # Select from block `offset` on and read what the bike returns (up to
+    # 255 blocks asked, in practice what fits one attribute read).
+    block = offset.to_bytes(4, 'big') + bytes([255]) # Number of blocks
+    await transport.write(Maintenance.LOG_BLOCK, block)
+    return await transport.read(Maintenance.LOG_BLOCK)
+
+
+async def resume(transport, store, size):
+    # Where to continue from, and the first blocks already fetched. The
+    # check re-reads the last cached block, which also fetches the new
+    # ones after it, so a run with nothing new costs one read.
+    offset = store.blocks()
+    if offset == 0:
+        return 0, b''
+    if offset > size:
+        print(f'Log is shorter than cached ({size} < {offset} blocks), starting over')
+        store.rotate()
+        return 0, b''
+
+    last = store.block(offset - 1)
+    result = await read_blocks(transport, offset - 1)
+    if not result or not result.startswith(last.rstrip(b'\0')):
+        print('Log does not match the cache, starting over')
+        store.rotate()
+        return 0, b''
+
+    # A partly written last block is replaced by what the bike has now.
+    if last != result[:LOG_BLOCK_SIZE]:
+        offset -= 1
+    else:
+        result = result[LOG_BLOCK_SIZE:]
+    store.truncate(offset)
+    return offset, result
+
+
+async def read_log(transport, store=None, echo=True):
+    # Fetch the log from the bike, or with a store only the blocks after
+    # what is cached; returns the newly fetched data. Blocks go to the
+    # store as they arrive, so an interrupted run keeps what it got.
+    result = await transport.read(Maintenance.LOG_MODE)
+    mode = int(result[0])
+    print(f'Log mode: {mode}')
+    result = await transport.read(Maintenance.LOG_SIZE)
+    size = int.from_bytes(result[0:4], "big")
+    print(f'Log size: {size}')
+
+    log_data = bytearray()
+    offset = 0
+    pending = b''
+    if store:
+        offset, pending = await resume(transport, store, size)
+        if offset:
+            print(f'Cached: {offset} blocks, fetching {size - offset}')
+
+    try:
+        if echo:
+            print('Log data:')
+        while offset < size:
+            result = pending or await read_blocks(transport, offset)
+            pending = b''
+            if len(result) < LOG_BLOCK_SIZE:
+                break
+            if store:
+                store.append(result)
+            if echo:
+                print(result.decode('ASCII', 'replace'), end='')
+            log_data += result
+            offset += len(result) // LOG_BLOCK_SIZE
+        if echo:
+            print('')
+    except Exception as e:
+        print(f'Error reading logs: {e}, last offset {offset}')
+
+    return bytes(log_data)
+
+
+async def read_logs(args):
+    import bleak
+
+    from pymoof.clients.sx3 import Sound
+    from pymoof.clients.sx3 import SX3Client
+    from pymoof.tools import discover_bike
+    from pymoof.tools import retrieve_encryption_key
+
     # print('Getting key from vanmoof servers')
     # key, user_key_id = retrieve_encryption_key.query()
 
@@ -45,34 +178,27 @@ async def read_logs():
 
         await client.play_sound(Sound.BEEP_POSITIVE)
 
-        result = await client._read(Maintenance.LOG_MODE)
-        mode = int(result[0])
-        print(f'Log mode: {mode}')
-        result = await client._read(Maintenance.LOG_SIZE)
-        size = int.from_bytes(result[0:4], "big")
-        print(f'Log size: {size}')
+        store = None
+        if args.store:
+            store = LogStore(args.store, device.address)
+            if args.full:
+                store.rotate()
 
-        log_data = ''
-        offset = 0
+        log_data = await read_log(BikeTransport(client), store, echo=not args.quiet)
+        print(f'{len(log_data)} bytes fetched' + (f', log in {store.path}' if store else ''))
 
-        try:
-            print('Log data:')
-            while offset < size:
-                block = bytearray()
-                block.append((offset >> 24) & 0xff)
-                block.append((offset >> 16) & 0xff)
-                block.append((offset >> 8) & 0xff)
-                block.append(offset & 0xff)
-                block.append(255) # Number of blocks
-                await client._write(Maintenance.LOG_BLOCK, block)
-                result = await client._read(Maintenance.LOG_BLOCK)
-                text = result.decode('ASCII')
-                print(text, end='')
-                log_data += text
-                offset += int(len(result) / 16)
-            print('')
-        except Exception as e:
-            print(f'Error reading logs: {e}, last offset {offset}')
+
+def parse_args(argv=None):
+    parser = argparse.ArgumentParser(description='Read the debug log from the bike.')
+    parser.add_argument('--store', default=os.path.expanduser('~/.vanmoof-logs'),
+                        help='directory with the logs fetched so far, per bike (default ~/.vanmoof-logs)')
+    parser.add_argument('--no-store', dest='store', action='store_const', const=None,
+                        help='fetch the whole log and keep nothing')
+    parser.add_argument('--full', action='store_true',
+                        help='fetch the whole log again (the cached one is kept as <bike>.log.1)')
+    parser.add_argument('--quiet', action='store_true', help='do not print the log')
+    return parser.parse_args(argv)
 
 
-asyncio.run(read_logs())
+if __name__ == '__main__':
+    asyncio.run(read_logs(parse_args()))
@@ -0,0 +1,646 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "endian_compat.h"
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s watch [-r <ms>] [-w <reports>] [-i <s>] [-o <store>] [-q] [<capture>...]\n", progname);
+	fprintf(stderr, "       %s series [-l] <store> [<series>...]\n", progname);
+	exit(1);
+}
+
+/*
+ * Follows the output of the BLE console's `rtos-statistics`, which prints
+ * a memory report every 500 ms, from captures or from a pipe (`console -t
+ * ... | rtosstat watch`). A report is a group of lines
+ *
+ *   <name>: <field> <number>[, <field> <number>]...
+ *
+ * such as `Heap: total 20480, used 13120, free 7360` or `Task ble: stack
+ * 2048, peak 1436`; every `<name>.<field>` is a series, spaces in it turn
+ * into underscores. A report ends where a series comes round again. The
+ * time of a line is its `console -t` stamp, or else the number of the
+ * report times the report interval. Other lines are ignored.
+ *
+ * Per series the all-time minimum and maximum are kept, and a window of
+ * the last reports for its rolling minimum, median, 99th percentile and
+ * maximum. Series whose field says free, largest or avail are worse when
+ * lower; all others when higher. After the first window, a new worst
+ * value is reported as a high-water mark. A leak is reported when the
+ * best value of a window, the floor, has got worse in three windows in a
+ * row: allocations come and go, but the floor only moves with memory that
+ * is not given back.
+ *
+ * With -o, every change of a value is written to a column store:
+ *
+ *   series       text, `<series> <name>` per line
+ *   time.col     uint32 per record: ms since the start
+ *   series.col   uint16 per record: the series
+ *   value.col    uint32 per record: the new value
+ *
+ * in time order, little endian, like the Modbus store of mbdump.
+ */
+#define MAX_SERIES	65536
+#define LEAK_WINDOWS	4
+
+typedef struct {
+	char name[128];
+	int low;			/* smaller is worse */
+	size_t n;
+	uint32_t last, min, max, worst;
+	uint32_t *window;		/* ring of the last `window` values */
+	uint32_t floor;			/* best value of the current window */
+	uint32_t floors[LEAK_WINDOWS];
+	double floor_time[LEAK_WINDOWS];
+	size_t nfloors;
+	int leaking;
+	double rate;			/* per minute, while leaking */
+	size_t report;			/* last report it was seen in */
+} series_t;
+
+static series_t *list;
+static size_t nseries, list_size;
+static size_t window = 120;
+static size_t report;
+static double interval = 0.5;
+static int quiet;
+
+static uint32_t *rec_time;
+static uint16_t *rec_series;
+static uint32_t *rec_value;
+static size_t nrecs, recs_size;
+
+static volatile sig_atomic_t stop;
+
+static void *
+xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, size);
+		exit(1);
+	}
+	return p;
+}
+
+static const char *
+path_of(const char *dir, const char *name)
+{
+	static char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return path;
+}
+
+static int
+worse(const series_t *s, uint32_t a, uint32_t b)
+{
+	return s->low ? a < b : a > b;
+}
+
+static series_t *
+series_of(const char *name)
+{
+	static size_t hint;
+	const char *field;
+	series_t *s;
+
+	/* Reports repeat in the same order, so the next one is usually it. */
+	if (hint < nseries && strcmp(list[hint].name, name) == 0)
+		return &list[hint++];
+	for (size_t i = 0; i < nseries; i++) {
+		if (strcmp(list[i].name, name) == 0) {
+			hint = i + 1;
+			return &list[i];
+		}
+	}
+
+	if (nseries == MAX_SERIES) {
+		fprintf(stderr, "%s: more than %d series\n", progname, MAX_SERIES);
+		exit(1);
+	}
+	if (nseries == list_size) {
+		list_size = list_size ? list_size * 2 : 64;
+		list = xrealloc(list, list_size * sizeof(*list));
+	}
+	s = &list[nseries++];
+	memset(s, 0, sizeof(*s));
+	strcpy(s->name, name);
+	field = strrchr(s->name, '.');
+	s->low = field && (strstr(field, "free") || strstr(field, "largest") || strstr(field, "avail"));
+	s->window = xrealloc(NULL, window * sizeof(*s->window));
+	hint = nseries;
+	return s;
+}
+
+static void
+record(double time, const series_t *s, uint32_t value)
+{
+	if (nrecs == recs_size) {
+		recs_size = recs_size ? recs_size * 2 : 65536;
+		rec_time = xrealloc(rec_time, recs_size * sizeof(*rec_time));
+		rec_series = xrealloc(rec_series, recs_size * sizeof(*rec_series));
+		rec_value = xrealloc(rec_value, recs_size * sizeof(*rec_value));
+	}
+	rec_time[nrecs] = time > 0 ? (uint32_t)(time * 1000 + 0.5) : 0;
+	rec_series[nrecs] = s - list;
+	rec_value[nrecs] = value;
+	nrecs++;
+}
+
+static void
+sample(double time, series_t *s, uint32_t value)
+{
+	size_t i = s->n % window;
+
+	if (s->n == 0 || value != s->last)
+		record(time, s, value);
+	if (s->n == 0) {
+		s->min = s->max = s->worst = s->floor = value;
+	} else if (worse(s, value, s->worst)) {
+		if (report > window && !quiet) {
+			printf("%10.3f hwm %s %u (was %u)\n", time, s->name, value, s->worst);
+			fflush(stdout);
+		}
+		s->worst = value;
+	}
+	s->min = value < s->min ? value : s->min;
+	s->max = value > s->max ? value : s->max;
+	s->last = value;
+	s->window[i] = value;
+	s->n++;
+
+	/* The floor of each full window, for the leak check. */
+	if (i == 0)
+		s->floor = value;
+	else if (worse(s, s->floor, value))
+		s->floor = value;
+	if (i != window - 1)
+		return;
+
+	if (s->nfloors == LEAK_WINDOWS) {
+		memmove(s->floors, s->floors + 1, (LEAK_WINDOWS - 1) * sizeof(*s->floors));
+		memmove(s->floor_time, s->floor_time + 1, (LEAK_WINDOWS - 1) * sizeof(*s->floor_time));
+		s->nfloors--;
+	}
+	s->floors[s->nfloors] = s->floor;
+	s->floor_time[s->nfloors++] = time;
+	if (s->nfloors < LEAK_WINDOWS)
+		return;
+
+	for (i = 1; i < LEAK_WINDOWS; i++)
+		if (!worse(s, s->floors[i], s->floors[i - 1]))
+			break;
+	if (i < LEAK_WINDOWS) {
+		s->leaking = 0;
+		return;
+	}
+	s->rate = ((double)s->floors[LEAK_WINDOWS - 1] - s->floors[0]) * 60 /
+		  (s->floor_time[LEAK_WINDOWS - 1] - s->floor_time[0]);
+	if (!s->leaking) {
+		printf("%10.3f leak %s %+.0f/min, floor %u\n", time, s->name, s->rate, s->floor);
+		fflush(stdout);
+	}
+	s->leaking = 1;
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+summary(double time)
+{
+	uint32_t *sorted = xrealloc(NULL, window * sizeof(*sorted));
+
+	printf("%10.3f %zu reports, window %zu\n", time, report, window);
+	printf("%-28s %8s %8s %8s %8s %8s %8s %8s %8s\n", "series", "samples", "last", "min", "max",
+	       "wmin", "p50", "p99", "wmax");
+	for (size_t i = 0; i < nseries; i++) {
+		series_t *s = &list[i];
+		size_t n = s->n < window ? s->n : window;
+
+		memcpy(sorted, s->window, n * sizeof(*sorted));
+		qsort(sorted, n, sizeof(*sorted), cmp_u32);
+		printf("%-28s %8zu %8u %8u %8u %8u %8u %8u %8u", s->name, s->n, s->last, s->min, s->max,
+		       sorted[0], sorted[n / 2], sorted[n * 99 / 100], sorted[n - 1]);
+		if (s->leaking)
+			printf("  leak %+.0f/min", s->rate);
+		putchar('\n');
+	}
+	fflush(stdout);
+	free(sorted);
+}
+
+/*
+ * One line of a report into `name` and its fields; returns the number of
+ * fields, 0 if it is not a stats line. The line is modified.
+ */
+#define MAX_FIELDS	16
+
+static int
+parse_line(char *line, double *stamp, char **name, char **fields, uint32_t *values)
+{
+	char *p = line, *colon, *part, *next, *e, *q;
+	int nfields = 0;
+	double t;
+
+	/* `console -t` stamps, and other [...] prefixes. */
+	while (*p == '[' && (e = strchr(p, ']'))) {
+		t = strtod(p + 1, &q);
+		if (q != p + 1 && q == e)
+			*stamp = t;
+		for (p = e + 1; *p == ' '; p++)
+			;
+	}
+
+	colon = strchr(p, ':');
+	if (colon == NULL || colon == p)
+		return 0;
+	*colon = '\0';
+	*name = p;
+
+	for (part = colon + 1; part; part = next) {
+		unsigned long v;
+		char *end;
+
+		next = strchr(part, ',');
+		if (next)
+			*next++ = '\0';
+		while (*part == ' ' || *part == '\t')
+			part++;
+		e = part + strlen(part);
+		while (e > part && (e[-1] == ' ' || e[-1] == '\t'))
+			*--e = '\0';
+
+		/* `<field> <number>`, also `<field>=<number>` or `<field>: <number>`. */
+		q = e;
+		while (q > part && q[-1] != ' ' && q[-1] != '=' && q[-1] != ':')
+			q--;
+		if (q == part || q == e || nfields == MAX_FIELDS)
+			return 0;
+		errno = 0;
+		v = strtoul(q, &end, 0);
+		if (*end || errno || v > UINT32_MAX || *q == '-')
+			return 0;
+		while (q > part && (q[-1] == ' ' || q[-1] == '=' || q[-1] == ':'))
+			q--;
+		*q = '\0';
+		if (q == part)
+			return 0;
+		fields[nfields] = part;
+		values[nfields++] = v;
+	}
+	return nfields;
+}
+
+static void
+underscores(char *s)
+{
+	for (; *s; s++)
+		if (*s == ' ' || *s == '\t')
+			*s = '_';
+}
+
+static void
+on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/*
+ * Follow one capture; `base` is the time the previous one ended, so that
+ * several captures of a soak run make one time line.
+ */
+static double
+follow(FILE *f, double base, double every, double *next_summary)
+{
+	char line[1024], key[sizeof(list->name)], *name, *fields[MAX_FIELDS];
+	uint32_t values[MAX_FIELDS];
+	double stamp, time = base;
+	int n, stamped = 0;
+	size_t first = report;
+
+	while (!stop && fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		stamp = -1;
+		n = parse_line(line, &stamp, &name, fields, values);
+		if (n == 0)
+			continue;
+		underscores(name);
+
+		for (int i = 0; i < n; i++) {
+			series_t *s;
+
+			underscores(fields[i]);
+			if (snprintf(key, sizeof(key), "%s.%s", name, fields[i]) >= (int)sizeof(key))
+				continue;
+			s = series_of(key);
+			if (s->report == report || report == 0)
+				report++;
+			s->report = report;
+
+			if (stamp >= 0)
+				stamped = 1;
+			if (stamped)
+				time = stamp >= 0 ? base + stamp : time;
+			else
+				time = base + (report - first - 1) * interval;
+			sample(time, s, values[i]);
+		}
+
+		if (every > 0 && time >= *next_summary) {
+			summary(time);
+			while (*next_summary <= time)
+				*next_summary += every;
+		}
+	}
+	return time + interval;
+}
+
+static void
+write_column(const char *dir, const char *name, const void *data, size_t size)
+{
+	const char *path = path_of(dir, name);
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if ((size && fwrite(data, size, 1, f) != 1) || fclose(f) != 0) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+}
+
+static void
+write_store(const char *dir)
+{
+	const char *path;
+	FILE *f;
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "%s: mkdir(%s): %s\n", progname, dir, strerror(errno));
+		exit(1);
+	}
+
+	path = path_of(dir, "series");
+	f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	for (size_t s = 0; s < nseries; s++)
+		fprintf(f, "%zu %s\n", s, list[s].name);
+	if (fclose(f) != 0) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+
+	for (size_t i = 0; i < nrecs; i++) {
+		rec_time[i] = htole32(rec_time[i]);
+		rec_series[i] = htole16(rec_series[i]);
+		rec_value[i] = htole32(rec_value[i]);
+	}
+	write_column(dir, "time.col", rec_time, nrecs * sizeof(*rec_time));
+	write_column(dir, "series.col", rec_series, nrecs * sizeof(*rec_series));
+	write_column(dir, "value.col", rec_value, nrecs * sizeof(*rec_value));
+}
+
+static int
+watch_main(int argc, char **argv)
+{
+	const char *store = NULL;
+	double every = 0, time = 0, next_summary;
+	struct sigaction sa;
+	int opt;
+	long n;
+
+	while ((opt = getopt(argc, argv, "r:w:i:o:q")) != -1) {
+		switch (opt) {
+			case 'r':
+				n = strtol(optarg, NULL, 0);
+				if (n <= 0)
+					usage();
+				interval = n / 1000.0;
+				break;
+			case 'w':
+				n = strtol(optarg, NULL, 0);
+				if (n < 2)
+					usage();
+				window = n;
+				break;
+			case 'i':
+				every = strtod(optarg, NULL);
+				break;
+			case 'o':
+				store = optarg;
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	/* Ctrl-C ends a live run with the summary and the store. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	next_summary = every;
+	if (optind == argc)
+		time = follow(stdin, time, every, &next_summary);
+	for (int i = optind; i < argc && !stop; i++) {
+		FILE *f = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "r");
+
+		if (f == NULL) {
+			fprintf(stderr, "%s: open(%s): %s\n", progname, argv[i], strerror(errno));
+			exit(1);
+		}
+		time = follow(f, time, every, &next_summary);
+		if (f != stdin)
+			fclose(f);
+	}
+
+	summary(time - interval);
+	if (store)
+		write_store(store);
+	fprintf(stderr, "%s: %zu reports, %zu series, %zu changes\n", progname, report, nseries, nrecs);
+	return 0;
+}
+
+static const void *
+map_column(const char *dir, const char *name, size_t *size)
+{
+	const char *path = path_of(dir, name);
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	*size = st.st_size;
+	if (st.st_size == 0) {
+		close(fd);
+		return "";
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+	return p;
+}
+
+typedef struct {
+	char name[128];
+	int wanted;
+	size_t changes;
+	uint32_t min, max;
+} stored_t;
+
+static int
+series_main(int argc, char **argv)
+{
+	const uint32_t *time, *value;
+	const uint16_t *series;
+	size_t n, size, count = 0, cap = 0;
+	stored_t *stored = NULL;
+	int opt, summary = 0, all;
+	char line[256];
+	const char *dir;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "l")) != -1) {
+		switch (opt) {
+			case 'l':
+				summary = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+	dir = argv[optind++];
+
+	f = fopen(path_of(dir, "series"), "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path_of(dir, "series"), strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (count == cap) {
+			cap = cap ? cap * 2 : 64;
+			stored = xrealloc(stored, cap * sizeof(*stored));
+		}
+		memset(&stored[count], 0, sizeof(stored[count]));
+		if (sscanf(line, "%*u %127s", stored[count].name) != 1) {
+			fprintf(stderr, "%s: %s: bad line: %s", progname, path_of(dir, "series"), line);
+			exit(1);
+		}
+		stored[count].min = UINT32_MAX;
+		count++;
+	}
+	fclose(f);
+
+	all = optind == argc;
+	for (int i = optind; i < argc; i++) {
+		int found = 0;
+
+		for (size_t s = 0; s < count; s++)
+			if (strcmp(stored[s].name, argv[i]) == 0)
+				stored[s].wanted = found = 1;
+		if (!found) {
+			fprintf(stderr, "%s: %s: no such series\n", progname, argv[i]);
+			exit(1);
+		}
+	}
+
+	time = map_column(dir, "time.col", &size);
+	n = size / sizeof(*time);
+	series = map_column(dir, "series.col", &size);
+	if (size / sizeof(*series) != n) {
+		fprintf(stderr, "%s: %s: columns differ in length\n", progname, dir);
+		exit(1);
+	}
+	value = map_column(dir, "value.col", &size);
+	if (size / sizeof(*value) != n) {
+		fprintf(stderr, "%s: %s: columns differ in length\n", progname, dir);
+		exit(1);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		uint16_t s = le16toh(series[i]);
+		uint32_t v = le32toh(value[i]);
+
+		if (s >= count || !(all || stored[s].wanted))
+			continue;
+		if (summary) {
+			stored[s].changes++;
+			stored[s].min = v < stored[s].min ? v : stored[s].min;
+			stored[s].max = v > stored[s].max ? v : stored[s].max;
+		} else {
+			printf("%.3f,%s,%u\n", le32toh(time[i]) / 1000.0, stored[s].name, v);
+		}
+	}
+
+	if (summary) {
+		printf(" changes        min        max  series\n");
+		for (size_t s = 0; s < count; s++)
+			if (all || stored[s].wanted)
+				printf("%8zu %10u %10u  %s\n", stored[s].changes,
+				       stored[s].changes ? stored[s].min : 0, stored[s].max, stored[s].name);
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	if (argc < 2)
+		usage();
+	if (strcmp(argv[1], "watch") == 0)
+		return watch_main(argc - 1, argv + 1);
+	if (strcmp(argv[1], "series") == 0)
+		return series_main(argc - 1, argv + 1);
+	usage();
+	return 1;
+}
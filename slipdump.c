@@ -0,0 +1,306 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+
+#include "modbus.h"
+#include "slipdump.h"
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-b <baud>] [-r <tries>] [-w <ms>] [-o <binary>] <tty> <addr> <n>\n", progname);
+	exit(1);
+}
+
+/*
+ * Dumps memory through the dumpslip.c payload of patch-dump: runs `help
+ * <addr> <n>` on the (logged in) main shell, collects the SLIP frames and
+ * asks for every block that did not come through with a good CRC again,
+ * up to -r times, before it lets the payload return. The blocks that are
+ * still missing are filled with 0xff and reported, with exit status 2.
+ */
+static uint8_t *image;
+static uint8_t *have;
+static size_t length, blocks;
+static size_t good, bad, resent;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static speed_t
+baud_rate(long baud)
+{
+	static const struct { long baud; speed_t speed; } rates[] = {
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+		{ 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 }, { 921600, B921600 },
+	};
+
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+		if (rates[i].baud == baud)
+			return rates[i].speed;
+	fprintf(stderr, "%s: unsupported baud rate %ld\n", progname, baud);
+	exit(1);
+}
+
+static int
+open_tty(const char *path, long baud)
+{
+	struct termios tio;
+	int fd;
+
+	fd = open(path, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (tcgetattr(fd, &tio) < 0) {
+		fprintf(stderr, "%s: tcgetattr(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, baud_rate(baud));
+	cfsetospeed(&tio, baud_rate(baud));
+	if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+		fprintf(stderr, "%s: tcsetattr(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+static void
+send_bytes(int fd, const void *data, size_t len)
+{
+	if (write(fd, data, len) != (ssize_t)len) {
+		fprintf(stderr, "%s: write: %s\n", progname, strerror(errno));
+		exit(1);
+	}
+}
+
+/* SLIP decoding state; a frame only starts after an END. */
+static uint8_t frame[2 + SLIP_BLOCK + 2];
+static size_t frame_len;
+static int in_frame, escaped, broken;
+
+/*
+ * One complete frame: returns its sequence number, or -1 if it is not a
+ * good frame.
+ */
+static long
+take_frame(void)
+{
+	size_t seq, len;
+
+	if (broken || frame_len < 4 ||
+	    modbus_crc(frame, frame_len - 2) != (frame[frame_len - 2] | frame[frame_len - 1] << 8)) {
+		bad++;
+		return -1;
+	}
+	seq = frame[0] | frame[1] << 8;
+	len = frame_len - 4;
+	if (seq == SLIP_LAST)
+		return len == 0 ? SLIP_LAST : -1;
+	if (seq >= blocks || len != (seq == blocks - 1 ? length - seq * SLIP_BLOCK : SLIP_BLOCK)) {
+		bad++;
+		return -1;
+	}
+	memcpy(image + seq * SLIP_BLOCK, frame + 2, len);
+	if (!have[seq])
+		good++;
+	have[seq] = 1;
+	return seq;
+}
+
+/*
+ * Read frames until `want` (a sequence number) has come in; returns 0
+ * then, -1 if nothing came for `first` ms, or the line has been quiet
+ * for `gap` ms after something did.
+ */
+static int
+receive(int fd, long want, int first, int gap)
+{
+	struct pollfd p = { .fd = fd, .events = POLLIN };
+	uint8_t buf[4096];
+	ssize_t n;
+	long seq;
+	int found = 0, wait = first;
+
+	while (!found) {
+		if (poll(&p, 1, wait) <= 0)
+			return -1;
+		wait = gap;
+		n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			fprintf(stderr, "%s: read: %s\n", progname, n < 0 ? strerror(errno) : "end of file");
+			exit(1);
+		}
+
+		for (ssize_t i = 0; i < n; i++) {
+			uint8_t c = buf[i];
+
+			if (c == SLIP_END) {
+				if (in_frame && frame_len) {
+					seq = take_frame();
+					if (seq == want)
+						found = 1;
+				}
+				in_frame = 1;
+				frame_len = escaped = broken = 0;
+				continue;
+			}
+			if (!in_frame)
+				continue;
+			if (escaped) {
+				escaped = 0;
+				if (c != SLIP_ESC_END && c != SLIP_ESC_ESC)
+					broken = 1;
+				c = c == SLIP_ESC_END ? SLIP_END : SLIP_ESC;
+			} else if (c == SLIP_ESC) {
+				escaped = 1;
+				continue;
+			}
+			if (frame_len == sizeof(frame))
+				broken = 1;
+			else
+				frame[frame_len++] = c;
+		}
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *outfile = NULL;
+	char command[64], *end;
+	unsigned long addr, n;
+	long baud = 115200;
+	int fd, out, opt, tries = 5, quiet = 2000, frame_ms;
+	size_t missing;
+	double start, took;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "b:r:w:o:")) != -1) {
+		switch (opt) {
+			case 'b':
+				baud = strtol(optarg, NULL, 0);
+				break;
+			case 'r':
+				tries = strtol(optarg, NULL, 0);
+				break;
+			case 'w':
+				quiet = strtol(optarg, NULL, 0);
+				break;
+			case 'o':
+				outfile = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind != 3 || tries < 0 || quiet <= 0)
+		usage();
+
+	addr = strtoul(argv[optind + 1], &end, 16);
+	if (*end != '\0' || addr > UINT32_MAX)
+		usage();
+	n = strtoul(argv[optind + 2], &end, 16);
+	if (*end != '\0' || n == 0 || n > (unsigned long)(SLIP_LAST - 1) * SLIP_BLOCK) {
+		fprintf(stderr, "%s: <n> is hex, at most %x\n", progname, (SLIP_LAST - 1) * SLIP_BLOCK);
+		exit(1);
+	}
+
+	if (outfile == NULL && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "%s: refusing to write binary data to a terminal\n", progname);
+		exit(1);
+	}
+
+	modbus_crc_init();
+	length = n;
+	blocks = (n + SLIP_BLOCK - 1) / SLIP_BLOCK;
+	image = malloc(length);
+	have = calloc(blocks, 1);
+	if (image == NULL || have == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, length);
+		exit(1);
+	}
+	memset(image, 0xff, length);
+
+	fd = open_tty(argv[optind], baud);
+	start = now();
+	snprintf(command, sizeof(command), "help %lx %lx\r", addr, n);
+	send_bytes(fd, command, strlen(command));
+	/*
+	 * Once the frames stop, the payload only waits SLIP_IDLE for a
+	 * request: a lost end frame must not keep us longer than a frame.
+	 */
+	frame_ms = (2 + 2 * (4 + SLIP_BLOCK)) * 10 * 1000 / baud + 200;
+	if (receive(fd, SLIP_LAST, quiet, frame_ms) < 0)
+		fprintf(stderr, "%s: no end frame\n", progname);
+
+	/* One request at a time: the payload polls a single byte register. */
+	for (int round = 0; round < tries; round++) {
+		for (size_t seq = 0; seq < blocks; seq++) {
+			uint8_t req[3] = { SLIP_RESEND, seq & 0xff, seq >> 8 };
+
+			if (have[seq])
+				continue;
+			send_bytes(fd, req, sizeof(req));
+			resent++;
+			receive(fd, seq, frame_ms, frame_ms);
+		}
+	}
+	send_bytes(fd, (uint8_t []){ SLIP_QUIT }, 1);
+	took = now() - start;
+
+	missing = blocks - good;
+	for (size_t seq = 0, run; seq < blocks; seq += run) {
+		for (run = 0; seq + run < blocks && have[seq + run] == have[seq]; run++)
+			;
+		if (!have[seq])
+			fprintf(stderr, "%s: missing %08lx, %zu blocks\n", progname,
+				addr + (unsigned long)seq * SLIP_BLOCK, run);
+	}
+
+	if (outfile) {
+		out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (out < 0) {
+			fprintf(stderr, "%s: open(%s): %s\n", progname, outfile, strerror(errno));
+			exit(1);
+		}
+	} else {
+		out = STDOUT_FILENO;
+		outfile = "stdout";
+	}
+	if (write(out, image, length) != (ssize_t)length || close(out) < 0) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, outfile, strerror(errno));
+		exit(1);
+	}
+
+	fprintf(stderr, "%s: %zu of %zu blocks in %.1f s (%.0f bytes/s), %zu bad frames, %zu resent\n",
+		progname, good, blocks, took, length / took, bad, resent);
+	return missing ? 2 : 0;
+}
@@ -0,0 +1,42 @@
+#ifndef _SLIPDUMP_H
+#define _SLIPDUMP_H 1
+
+/*
+ * Binary memory dumps over the debug console, between the dumpslip.c
+ * payload (behind `help <addr> <n>`, see patch-dump) and slipdump. Only
+ * defines, the payload is built freestanding.
+ *
+ * The payload sends the memory in blocks of SLIP_BLOCK bytes, the last
+ * one shorter, each in a SLIP frame
+ *
+ *   END  seq (LE16)  data  CRC (LE16)  END
+ *
+ * with END and ESC in between escaped, and the Modbus CRC over the
+ * sequence number and the data; SLIP and CRC as on the SSP links. A frame
+ * with sequence number SLIP_LAST and no data follows the last block, so
+ * a dump is at most 65535 blocks.
+ *
+ * The payload then waits for requests: SLIP_RESEND and a sequence number
+ * (LE16) sends that block again, SLIP_QUIT returns to the console, as do
+ * SLIP_IDLE polls of the UART without a request. Any other byte gets a
+ * SLIP_LAST frame. A garbled request is harmless: the frame it brings
+ * carries its own sequence number and CRC.
+ *
+ * SLIP_IDLE counts from the end of each frame and each request byte, and
+ * is only a second or so on the MCU: the host has to send its next
+ * request well within that, or its bytes end up in the console. slipdump
+ * waits at most a frame time plus 200 ms for a frame that does not come.
+ */
+#define SLIP_END		0xc0
+#define SLIP_ESC		0xdb
+#define SLIP_ESC_END		0xdc
+#define SLIP_ESC_ESC		0xdd
+
+#define SLIP_BLOCK		128
+#define SLIP_LAST		0xffff
+
+#define SLIP_RESEND		'R'
+#define SLIP_QUIT		'Q'
+#define SLIP_IDLE		(1 << 25)	/* a second or two */
+
+#endif
@@ -0,0 +1,500 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "modbus.h"
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-b <baud>] [-w <ms>] [-s | -v] <capture>...\n", progname);
+	exit(1);
+}
+
+/*
+ * Decodes captures of the SSP links between the main MCU and the BLE and
+ * motor MCUs (see "Internal communication" in the README). Packets are
+ * SLIP framed:
+ *
+ *   C0  sender  command  seq  [offset/function (LE16)  [length (LE16)  data]]  CRC (LE16)  C0
+ *
+ * READ (06) carries a function, WRITE (07) a function, a length and data,
+ * and ACK (05) only the sequence number of the request it answers, from
+ * the other side. A capture is one UART line, or both if they were wired
+ * together; pass one file per line and they are merged by time.
+ *
+ * A capture is either the raw bytes of the line, timed by their position
+ * at <baud>, or the CSV export of a logic analyser's async serial decoder:
+ * one byte per line, the first number on it being the time in seconds and
+ * the first 0x.. field the byte.
+ */
+#define SLIP_END	0xc0
+#define SLIP_ESC	0xdb
+#define SLIP_ESC_END	0xdc
+#define SLIP_ESC_ESC	0xdd
+
+#define SSP_ACK		0x05
+#define SSP_READ	0x06
+#define SSP_WRITE	0x07
+
+#define MAX_FRAME	4096
+
+typedef struct {
+	double time;
+	size_t order;			/* to keep the capture order on equal times */
+	size_t data;			/* frame bytes in `arena` */
+	size_t len;
+} packet_t;
+
+static packet_t *packets;
+static size_t npackets, packets_size;
+static uint8_t *arena;
+static size_t arena_len, arena_size;
+
+/* Per sender, command and function. */
+typedef struct {
+	uint32_t key;
+	int used;
+	size_t requests, retries, acked, lost;
+	float *latency;			/* ms */
+	size_t nlatency, latency_size;
+} stat_t;
+
+#define STATS		4096		/* hash slots, a power of two */
+
+static stat_t stats[STATS];
+static size_t nstats;
+
+/* Requests waiting for their ACK, by sender and sequence number. */
+static struct {
+	double time;
+	stat_t *stat;
+	int valid;
+} pending[256][256];
+
+static size_t frames, bad_crc, short_frames, unpaired;
+
+static void *
+xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, size);
+		exit(1);
+	}
+	return p;
+}
+
+static void
+add_packet(double time, const uint8_t *frame, size_t len)
+{
+	if (npackets == packets_size) {
+		packets_size = packets_size ? packets_size * 2 : 4096;
+		packets = xrealloc(packets, packets_size * sizeof(*packets));
+	}
+	while (arena_len + len > arena_size) {
+		arena_size = arena_size ? arena_size * 2 : 1 << 20;
+		arena = xrealloc(arena, arena_size);
+	}
+	memcpy(arena + arena_len, frame, len);
+	packets[npackets].time = time;
+	packets[npackets].order = npackets;
+	packets[npackets].data = arena_len;
+	packets[npackets].len = len;
+	npackets++;
+	arena_len += len;
+}
+
+/* SLIP unframing, one byte at a time; a frame is timed by its first byte. */
+typedef struct {
+	uint8_t frame[MAX_FRAME];
+	size_t len;
+	double start;
+	int escaped, overrun;
+} slip_t;
+
+static void
+slip_byte(slip_t *s, double time, uint8_t c)
+{
+	if (c == SLIP_END) {
+		if (s->len && !s->overrun) {
+			add_packet(s->start, s->frame, s->len);
+			frames++;
+		}
+		s->len = 0;
+		s->escaped = s->overrun = 0;
+		return;
+	}
+	if (s->len == 0)
+		s->start = time;
+	if (s->escaped) {
+		c = c == SLIP_ESC_END ? SLIP_END : c == SLIP_ESC_ESC ? SLIP_ESC : c;
+		s->escaped = 0;
+	} else if (c == SLIP_ESC) {
+		s->escaped = 1;
+		return;
+	}
+	if (s->len == MAX_FRAME) {
+		s->overrun = 1;		/* no END for too long: not SSP */
+		return;
+	}
+	s->frame[s->len++] = c;
+}
+
+/* A text line with a comma in it: the header or first row of a CSV. */
+static int
+is_csv(const char *p, const char *end)
+{
+	int comma = 0;
+
+	for (; p < end && *p != '\n'; p++) {
+		if (*p == ',')
+			comma = 1;
+		else if ((*p < 0x20 || *p > 0x7e) && *p != '\t' && *p != '\r')
+			return 0;
+	}
+	return comma && p < end;
+}
+
+/* A CSV row: the time and the byte, -1 if it has no byte. */
+static int
+csv_row(const char *line, const char *nl, double *time)
+{
+	const char *field, *next;
+	int have_time = 0, c = -1;
+	char buf[64], *e;
+	size_t n;
+
+	for (field = line; field < nl; field = next + 1) {
+		next = memchr(field, ',', nl - field);
+		if (next == NULL)
+			next = nl;
+		while (field < next && (*field == ' ' || *field == '"'))
+			field++;
+		n = next - field < (ptrdiff_t)sizeof(buf) - 1 ? (size_t)(next - field) : sizeof(buf) - 1;
+		memcpy(buf, field, n);
+		buf[n] = '\0';
+
+		if (c < 0 && buf[0] == '0' && (buf[1] == 'x' || buf[1] == 'X')) {
+			c = strtol(buf, &e, 16);
+			if (e == buf + 2 || c > 0xff)
+				c = -1;
+		} else if (!have_time) {
+			*time = strtod(buf, &e);
+			have_time = e != buf;
+		}
+	}
+	return have_time ? c : -1;
+}
+
+static void
+read_capture(const char *path, long baud)
+{
+	static slip_t slip;
+	const char *p, *end, *nl;
+	struct stat st;
+	double time;
+	int fd, c;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+	end = p + st.st_size;
+	memset(&slip, 0, sizeof(slip));
+
+	if (!is_csv(p, end)) {
+		/* Raw bytes, 10 bits each. */
+		for (size_t i = 0; i < (size_t)st.st_size; i++)
+			slip_byte(&slip, i * 10.0 / baud, p[i]);
+	} else {
+		for (const char *line = p; line < end; line = nl + 1) {
+			nl = memchr(line, '\n', end - line);
+			if (nl == NULL)
+				nl = end;
+			c = csv_row(line, nl, &time);
+			if (c >= 0)
+				slip_byte(&slip, time, c);
+		}
+	}
+	munmap((void *)p, st.st_size);
+}
+
+static int
+cmp_packet(const void *a, const void *b)
+{
+	const packet_t *x = a, *y = b;
+
+	if (x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static stat_t *
+stat_of(uint8_t sender, uint8_t command, uint16_t function)
+{
+	uint32_t key = (uint32_t)sender << 24 | command << 16 | function;
+	size_t i = (key * 2654435761u) & (STATS - 1);
+
+	while (stats[i].used && stats[i].key != key)
+		i = (i + 1) & (STATS - 1);
+	if (!stats[i].used) {
+		if (nstats == STATS - 1) {
+			fprintf(stderr, "%s: more than %d functions, not SSP?\n", progname, STATS - 1);
+			exit(1);
+		}
+		stats[i].key = key;
+		stats[i].used = 1;
+		nstats++;
+	}
+	return &stats[i];
+}
+
+static const char *
+command_name(uint8_t command)
+{
+	switch (command) {
+		case SSP_ACK:	return "ACK";
+		case SSP_READ:	return "READ";
+		case SSP_WRITE:	return "WRITE";
+		default:	return "?";
+	}
+}
+
+static void
+print_bytes(const uint8_t *data, size_t len, int verbose)
+{
+	size_t n = verbose || len <= 16 ? len : 16;
+
+	for (size_t i = 0; i < n; i++)
+		printf(" %02x", data[i]);
+	if (n < len)
+		printf(" ...");
+}
+
+/* One packet: pair it, count it and, unless `quiet`, log it. */
+static void
+decode(const packet_t *pk, double timeout, int quiet, int verbose)
+{
+	const uint8_t *f = arena + pk->data;
+	uint8_t sender, command, seq;
+	uint16_t function = 0, length;
+	size_t len = pk->len, body;
+	double latency = -1;
+	stat_t *st = NULL;
+	int retry = 0;
+
+	if (len < 5) {
+		short_frames++;
+		if (!quiet) {
+			printf("%12.6f  short frame:", pk->time);
+			print_bytes(f, len, 1);
+			printf("\n");
+		}
+		return;
+	}
+	if (modbus_crc(f, len - 2) != (f[len - 2] | f[len - 1] << 8)) {
+		bad_crc++;
+		if (!quiet) {
+			printf("%12.6f  bad CRC:", pk->time);
+			print_bytes(f, len, verbose);
+			printf("\n");
+		}
+		return;
+	}
+	sender = f[0];
+	command = f[1];
+	seq = f[2];
+	body = len - 5;
+
+	if (command == SSP_READ || command == SSP_WRITE) {
+		if (body >= 2)
+			function = f[3] | f[4] << 8;
+		st = stat_of(sender, command, function);
+		if (pending[sender][seq].valid && pending[sender][seq].stat == st &&
+		    pk->time - pending[sender][seq].time < timeout) {
+			/* Sent again before the ACK came: keep the first time. */
+			st->retries++;
+			retry = 1;
+		} else {
+			if (pending[sender][seq].valid)
+				pending[sender][seq].stat->lost++;
+			pending[sender][seq].time = pk->time;
+			pending[sender][seq].stat = st;
+			pending[sender][seq].valid = 1;
+		}
+		st->requests++;
+	} else if (command == SSP_ACK) {
+		int from = -1;
+
+		/* The latest request with this number from anyone else. */
+		for (int s = 0; s < 256; s++)
+			if (s != sender && pending[s][seq].valid &&
+			    (from < 0 || pending[s][seq].time > pending[from][seq].time))
+				from = s;
+		if (from >= 0 && pk->time - pending[from][seq].time < timeout) {
+			st = pending[from][seq].stat;
+			latency = (pk->time - pending[from][seq].time) * 1000;
+			pending[from][seq].valid = 0;
+			st->acked++;
+			if (st->nlatency == st->latency_size) {
+				st->latency_size = st->latency_size ? st->latency_size * 2 : 64;
+				st->latency = xrealloc(st->latency, st->latency_size * sizeof(*st->latency));
+			}
+			st->latency[st->nlatency++] = latency;
+		} else {
+			unpaired++;
+			st = NULL;
+		}
+	}
+	if (quiet)
+		return;
+
+	printf("%12.6f  %02x > %-5s %02x", pk->time, sender, command_name(command), seq);
+	if (command == SSP_WRITE && body >= 4) {
+		length = f[5] | f[6] << 8;
+		printf(" %04x %u:", function, length);
+		print_bytes(f + 7, body - 4, verbose);
+		if (length != body - 4)
+			printf(" (length %u, %zu bytes)", length, body - 4);
+	} else if (command == SSP_READ && body >= 2) {
+		printf(" %04x", function);
+		if (body > 2)
+			print_bytes(f + 5, body - 2, verbose);
+	} else if (command == SSP_ACK) {
+		if (st)
+			printf(" %8.3f ms  %s %04x", latency, command_name(st->key >> 16 & 0xff), st->key & 0xffff);
+		else
+			printf(" unpaired");
+		if (body)
+			print_bytes(f + 3, body, verbose);
+	} else if (body) {
+		print_bytes(f + 3, body, verbose);
+	}
+	if (retry)
+		printf(" (again)");
+	printf("\n");
+}
+
+static int
+cmp_float(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int
+cmp_stat(const void *a, const void *b)
+{
+	const stat_t *x = a, *y = b;
+
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static void
+print_stats(void)
+{
+	stat_t *list = xrealloc(NULL, nstats * sizeof(*list));
+	size_t n = 0;
+
+	for (size_t i = 0; i < STATS; i++)
+		if (stats[i].used)
+			list[n++] = stats[i];
+	qsort(list, n, sizeof(*list), cmp_stat);
+
+	printf("\nfrom  command function  requests  again  acked   lost      min   median      p99      max (ms)\n");
+	for (size_t i = 0; i < n; i++) {
+		stat_t *st = &list[i];
+		float *l = st->latency;
+		size_t k = st->nlatency;
+
+		printf("  %02x  %-7s     %04x  %8zu %6zu %6zu %6zu", st->key >> 24, command_name(st->key >> 16 & 0xff),
+		       st->key & 0xffff, st->requests, st->retries, st->acked, st->lost);
+		if (k) {
+			qsort(l, k, sizeof(*l), cmp_float);
+			printf(" %8.3f %8.3f %8.3f %8.3f", l[0], l[k / 2], l[(k * 99) / 100 < k ? (k * 99) / 100 : k - 1],
+			       l[k - 1]);
+		}
+		printf("\n");
+	}
+	free(list);
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt, quiet = 0, verbose = 0;
+	double timeout = 1.0;
+	long baud = 115200;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "b:w:sv")) != -1) {
+		switch (opt) {
+			case 'b':
+				baud = strtol(optarg, NULL, 0);
+				break;
+			case 'w':
+				timeout = strtod(optarg, NULL) / 1000;
+				break;
+			case 's':
+				quiet = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind == argc || baud <= 0)
+		usage();
+
+	modbus_crc_init();
+	for (int i = optind; i < argc; i++)
+		read_capture(argv[i], baud);
+	qsort(packets, npackets, sizeof(*packets), cmp_packet);
+
+	for (size_t i = 0; i < npackets; i++)
+		decode(&packets[i], timeout, quiet, verbose);
+
+	/* Whatever is still waiting never got its ACK. */
+	for (int s = 0; s < 256; s++)
+		for (int q = 0; q < 256; q++)
+			if (pending[s][q].valid)
+				pending[s][q].stat->lost++;
+
+	print_stats();
+	fprintf(stderr, "%s: %zu frames, %zu bad CRC, %zu short, %zu unpaired ACKs\n", progname,
+		frames, bad_crc, short_frames, unpaired);
+	return 0;
+}
@@ -4,9 +4,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 
 #include "endian_compat.h"
+#include "copy_compat.h"
 
 #include <openssl/evp.h>
 #include <openssl/sha.h>    /* SHA256_DIGEST_LENGTH */
@@ -14,14 +18,26 @@
 
 #include "pack.h"
 #include "ware.h"
+#include "ware_check.h"
 
 static char *progname;
 static int human = 0;
+static int list_only = 0;
+static int recursive = 0;
+static int tar_fd = -1;
+static time_t default_mtime;
+static char *store_dir = NULL;
+static const char *release = NULL;
+static char *index_rows;		/* this release's index lines */
+static size_t index_len, index_size;
+static int verify = 0;
+static int strict = 0;
+static int verify_failed = 0;
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-l] [-h] [-d <dir>] <packfile>\n", progname);
+	fprintf(stderr, "usage: %s [-l] [-h] [-r] [--verify] [--strict] [--tar | --store <dir> [--release <name>]] [-d <dir>] <packfile>|-\n", progname);
 	exit(1);
 }
 
@@ -41,34 +57,91 @@ format_size(uint32_t bytes, char *buf, size_t bufsize)
 	}
 }
 
+/*
+ * Print the TLV entries of a signature trailer that has already been read
+ * into memory, checking the SHA256 entry against `sha`, the digest of
+ * everything in front of the trailer.
+ */
+static void
+print_signature(const uint8_t *trailer, size_t sig_offset, size_t sig_length,
+		const uint8_t *sha)
+{
+	image_tlv_t tlv;
+	size_t offset;
+
+	memcpy(&tlv, trailer, sizeof(tlv));
+	printf("%s: Vanmoof signature: Offset 0x%zx, Magic 0x%x, Length 0x%x\n",
+		progname, sig_offset, tlv.type, tlv.length);
+
+	offset = sizeof(image_tlv_t);
+	while (offset + sizeof(tlv) <= sig_length) {
+		memcpy(&tlv, trailer + offset, sizeof(tlv));
+		offset += sizeof(tlv);
+
+		if (tlv.length > sig_length - offset)
+			return;
+		const uint8_t *value = trailer + offset;
+
+		switch (tlv.type) {
+			case IMAGE_TLV_SHA256:
+				printf("%s: Vanmoof signature: SHA256 at 0x%zx, Length 0x%x: %s\n",
+					progname, sig_offset + offset, tlv.length,
+					(tlv.length == SHA256_DIGEST_LENGTH && memcmp(sha, value, tlv.length) == 0) ? "OK" : "FAIL");
+				break;
+			case IMAGE_TLV_KEYHASH:
+				printf("%s: Vanmoof signature: KEYHASH at 0x%zx, Length 0x%x\n",
+					progname, sig_offset + offset, tlv.length);
+				break;
+			case IMAGE_TLV_ECDSA_SIG: {
+				BIO *bio = BIO_new_fd(fileno(stdout), BIO_NOCLOSE);
+				printf("%s: Vanmoof signature: ECDSA_SIG at 0x%zx, Length 0x%x\n",
+					progname, sig_offset + offset, tlv.length);
+				fflush(stdout);
+				ASN1_parse_dump(bio, value, tlv.length, 0, -1);
+				BIO_free(bio);
+				break;
+			}
+			default:
+				printf("%s: Vanmoof signature: Type 0x%04x at 0x%zx, Length 0x%x\n",
+					progname, tlv.type, sig_offset + offset, tlv.length);
+				break;
+		}
+		offset += tlv.length;
+	}
+}
+
+/* A TLV trailer starts with the info magic and its own total length. */
+static int
+is_signature(const uint8_t *trailer, size_t sig_length)
+{
+	image_tlv_t tlv;
+
+	if (sig_length < sizeof(image_tlv_t))
+		return 0;
+	memcpy(&tlv, trailer, sizeof(tlv));
+	return tlv.type == IMAGE_TLV_INFO_MAGIC && tlv.length == sig_length;
+}
+
 static int
 parse_signature(int fd, size_t sig_offset, size_t sig_length)
 {
 	char buffer[8196];
-	image_tlv_t tlv;
-	uint8_t value[256];
+	uint8_t trailer[0x10000];
 	uint8_t sha[SHA256_DIGEST_LENGTH];
 	EVP_MD_CTX *sha_ctx;
-	size_t offset;
 	size_t remaining;
 	ssize_t n;
 
-	if (sig_length < sizeof(image_tlv_t))
-		return 0;
-
-	if (lseek(fd, sig_offset, SEEK_SET) != (off_t)sig_offset)
+	/* tlv.length is 16 bits, so a real trailer always fits. */
+	if (sig_length < sizeof(image_tlv_t) || sig_length > sizeof(trailer))
 		return 0;
 
-	n = read(fd, &tlv, sizeof(tlv));
-	if (n != sizeof(tlv))
+	if (pread(fd, trailer, sig_length, sig_offset) != (ssize_t)sig_length)
 		return 0;
 
-	if (tlv.type != IMAGE_TLV_INFO_MAGIC || tlv.length != sig_length)
+	if (!is_signature(trailer, sig_length))
 		return 0;
 
-	printf("%s: Vanmoof signature: Offset 0x%zx, Magic 0x%x, Length 0x%x\n",
-		progname, sig_offset, tlv.type, tlv.length);
-
 	sha_ctx = EVP_MD_CTX_new();
 	EVP_DigestInit_ex(sha_ctx, EVP_sha256(), NULL);
 	if (lseek(fd, 0, SEEK_SET) != 0) {
@@ -89,65 +162,729 @@ parse_signature(int fd, size_t sig_offset, size_t sig_length)
 	EVP_DigestFinal_ex(sha_ctx, sha, NULL);
 	EVP_MD_CTX_free(sha_ctx);
 
-	offset = sizeof(image_tlv_t);
-	while (offset < sig_length) {
-		if (lseek(fd, sig_offset + offset, SEEK_SET) != (off_t)(sig_offset + offset))
-			return 1;
-		n = read(fd, &tlv, sizeof(tlv));
-		if (n != sizeof(tlv))
-			return 1;
-		offset += sizeof(tlv);
+	print_signature(trailer, sig_offset, sig_length, sha);
+	return 1;
+}
 
-		if (tlv.length > sizeof(value))
-			return 1;
-		n = read(fd, value, tlv.length);
-		if (n != tlv.length)
-			return 1;
+/*
+ * Parse the __DATE__ ("Jun  7 2023") and __TIME__ ("07:21:48") strings the
+ * firmware headers carry. Returns 0 if they don't look like that.
+ */
+static time_t
+build_time(const char *date_field, const char *time_field)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char date[13], time[13], mon[4];
+	const char *p;
+	struct tm tm;
 
-		switch (tlv.type) {
-			case IMAGE_TLV_SHA256:
-				printf("%s: Vanmoof signature: SHA256 at 0x%zx, Length 0x%x: %s\n",
-					progname, sig_offset + offset, tlv.length,
-					(tlv.length == SHA256_DIGEST_LENGTH && memcmp(sha, value, tlv.length) == 0) ? "OK" : "FAIL");
-				break;
-			case IMAGE_TLV_KEYHASH:
-				printf("%s: Vanmoof signature: KEYHASH at 0x%zx, Length 0x%x\n",
-					progname, sig_offset + offset, tlv.length);
-				break;
-			case IMAGE_TLV_ECDSA_SIG: {
-				BIO *bio = BIO_new_fd(fileno(stdout), BIO_NOCLOSE);
-				printf("%s: Vanmoof signature: ECDSA_SIG at 0x%zx, Length 0x%x\n",
-					progname, sig_offset + offset, tlv.length);
-				fflush(stdout);
-				ASN1_parse_dump(bio, value, tlv.length, 0, -1);
-				BIO_free(bio);
-				break;
+	memcpy(date, date_field, 12);
+	date[12] = '\0';
+	memcpy(time, time_field, 12);
+	time[12] = '\0';
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(date, "%3s %d %d", mon, &tm.tm_mday, &tm.tm_year) != 3 ||
+	    sscanf(time, "%d:%d:%d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 3)
+		return 0;
+	p = strstr(months, mon);
+	if (p == NULL || (p - months) % 3 != 0)
+		return 0;
+	tm.tm_mon = (p - months) / 3;
+	tm.tm_year -= 1900;
+
+	return timegm(&tm);
+}
+
+/*
+ * Modification time for a tar member: the build date of a vanmoof_ware_t
+ * or S5/A5 VMFW image, the PACK file's own mtime for anything else.
+ */
+static time_t
+entry_mtime(int fd, off_t offset, size_t length)
+{
+	vanmoof_ware_t ware;
+	vmfw_ware_t vmfw;
+	time_t t = 0;
+
+	if (length >= sizeof(ware) &&
+	    pread(fd, &ware, sizeof(ware), offset) == sizeof(ware) &&
+	    le32toh(ware.magic) == WARE_MAGIC)
+		t = build_time(ware.date, ware.time);
+	else if (length > VMFW_OFFSET + sizeof(vmfw) &&
+		 pread(fd, &vmfw, sizeof(vmfw), offset + VMFW_OFFSET) == sizeof(vmfw) &&
+		 memcmp(vmfw.magic, VMFW_MAGIC, sizeof(vmfw.magic)) == 0)
+		t = build_time(vmfw.date, vmfw.time);	/* 0 for the S6 dialect */
+
+	return t ? t : default_mtime;
+}
+
+static void
+tar_write(const void *buf, size_t len)
+{
+	if (write(tar_fd, buf, len) != (ssize_t)len) {
+		fprintf(stderr, "%s: write(%zu): %s\n", progname, len, strerror(errno));
+		exit(1);
+	}
+}
+
+/*
+ * Append one POSIX ustar member to tar_fd: a 512-byte header, the data
+ * straight from the PACK (copy_range uses sendfile when tar_fd is a pipe)
+ * and zero padding up to the next 512-byte block.
+ */
+static void
+tar_entry(int fd, off_t offset, const char *name, size_t length)
+{
+	static const char zero[512];
+	char hdr[512];
+	unsigned sum = 0;
+	size_t i;
+
+	memset(hdr, 0, sizeof(hdr));
+	if (strlen(name) <= 100) {
+		memcpy(hdr, name, strlen(name));
+	} else {
+		/* Too long for the name field: move leading directories into
+		 * the ustar prefix field. */
+		const char *slash = strchr(name + strlen(name) - 101, '/');
+		if (slash == NULL || slash - name > 155) {
+			fprintf(stderr, "%s: %s: name too long for tar\n", progname, name);
+			exit(1);
+		}
+		memcpy(hdr, slash + 1, strlen(slash + 1));
+		memcpy(hdr + 345, name, slash - name);
+	}
+	snprintf(hdr + 100, 8, "%07o", 0644);				/* mode */
+	snprintf(hdr + 108, 8, "%07o", 0);				/* uid */
+	snprintf(hdr + 116, 8, "%07o", 0);				/* gid */
+	snprintf(hdr + 124, 12, "%011zo", length);			/* size */
+	snprintf(hdr + 136, 12, "%011llo",
+		(unsigned long long)entry_mtime(fd, offset, length));	/* mtime */
+	memset(hdr + 148, ' ', 8);					/* chksum */
+	hdr[156] = '0';							/* typeflag */
+	memcpy(hdr + 257, "ustar", 6);					/* magic */
+	memcpy(hdr + 263, "00", 2);					/* version */
+
+	for (i = 0; i < sizeof(hdr); i++)
+		sum += (unsigned char)hdr[i];
+	snprintf(hdr + 148, 8, "%06o", sum);
+	hdr[155] = ' ';
+
+	tar_write(hdr, sizeof(hdr));
+
+	if (copy_range(fd, offset, tar_fd, length) < 0) {
+		fprintf(stderr, "%s: copy(%s, 0x%zx): %s\n", progname, name, length, strerror(errno));
+		exit(1);
+	}
+
+	if (length % 512)
+		tar_write(zero, 512 - length % 512);
+}
+
+/* Two zero blocks end the archive. */
+static void
+tar_finish(void)
+{
+	static const char zero[1024];
+
+	tar_write(zero, sizeof(zero));
+}
+
+/*
+ * --verify: report the verdict of the incremental checks (the same
+ * detectors crc32 uses) next to the entry. Returns -1 when the entry failed
+ * and --strict says not to write it.
+ */
+static int
+report_check(ware_check_t *check, const char *name)
+{
+	char msg[160];
+
+	if (ware_check_final(check, msg, sizeof(msg)) != CHECK_FAIL) {
+		printf("%s: %s\n", name, msg);
+		return 0;
+	}
+
+	verify_failed = 1;
+	printf("%s: %s%s\n", name, msg, strict ? ", not extracted" : "");
+	return strict ? -1 : 0;
+}
+
+/* Verification on its own, for -l and for outputs that can't be undone. */
+static int
+verify_entry(int fd, off_t offset, const char *name, size_t length)
+{
+	char buffer[8196];
+	ware_check_t check;
+	size_t total;
+	ssize_t n;
+
+	ware_check_init(&check, length);
+	for (total = 0; total < length; total += n) {
+		size_t m = length - total < sizeof(buffer) ? length - total : sizeof(buffer);
+		n = pread(fd, buffer, m, offset + total);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read(%zu): %zd\n", progname, m, n);
+			exit(1);
+		}
+		ware_check_update(&check, buffer, n);
+	}
+
+	return report_check(&check, name);
+}
+
+/*
+ * Content-addressed store (--store <dir>): every entry is kept once, as
+ * <dir>/objects/<xx>/<sha256>, and the release tree in the output directory
+ * is made of hard links to those objects (reflinks or copies where a link
+ * is not possible, e.g. across filesystems). <dir>/index gets one
+ * "<release> <path> <sha256> <length>" line per entry, tab separated, so
+ * finding every release that ships a given image is a grep for its hash.
+ * The lines are collected and replace the release's old ones at the end
+ * (store_finish()), so unpacking a release again does not count it twice.
+ */
+static void
+store_entry(int fd, off_t offset, const char *name, size_t length)
+{
+	char buffer[8196];
+	uint8_t sha[SHA256_DIGEST_LENGTH];
+	char hex[2 * SHA256_DIGEST_LENGTH + 1];
+	char object[PATH_MAX], tmp[PATH_MAX], line[PATH_MAX + 256];
+	ware_check_t check;
+	EVP_MD_CTX *sha_ctx;
+	size_t total;
+	ssize_t n;
+	int in, out, i, dup = 1;
+
+	sha_ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(sha_ctx, EVP_sha256(), NULL);
+	ware_check_init(&check, length);
+	for (total = 0; total < length; total += n) {
+		size_t m = length - total < sizeof(buffer) ? length - total : sizeof(buffer);
+		n = pread(fd, buffer, m, offset + total);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read(%zu): %zd\n", progname, m, n);
+			exit(1);
+		}
+		EVP_DigestUpdate(sha_ctx, buffer, n);
+		if (verify)
+			ware_check_update(&check, buffer, n);
+	}
+	EVP_DigestFinal_ex(sha_ctx, sha, NULL);
+	EVP_MD_CTX_free(sha_ctx);
+
+	if (verify && report_check(&check, name) < 0)
+		return;
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		snprintf(hex + 2 * i, 3, "%02x", sha[i]);
+
+	snprintf(object, sizeof(object), "%s/objects/%.2s", store_dir, hex);
+	if (mkdir(object, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "%s: mkdir(%s): %s\n", progname, object, strerror(errno));
+		exit(1);
+	}
+	snprintf(object, sizeof(object), "%s/objects/%.2s/%s", store_dir, hex, hex);
+
+	/* New content: write it under a temporary name and rename it into
+	 * place, so a concurrent unpack never links a half-written object. */
+	if (access(object, F_OK) < 0) {
+		dup = 0;
+		snprintf(tmp, sizeof(tmp), "%s/objects/%.2s/.tmp-XXXXXX", store_dir, hex);
+		out = mkstemp(tmp);
+		if (out < 0) {
+			fprintf(stderr, "%s: mkstemp(%s): %s\n", progname, tmp, strerror(errno));
+			exit(1);
+		}
+		if (copy_range(fd, offset, out, length) < 0) {
+			fprintf(stderr, "%s: copy(%s, 0x%zx): %s\n", progname, tmp, length, strerror(errno));
+			exit(1);
+		}
+		fchmod(out, 0444);
+		close(out);
+		if (rename(tmp, object) < 0) {
+			fprintf(stderr, "%s: rename(%s, %s): %s\n", progname, tmp, object, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (unlink(name) < 0 && errno != ENOENT) {
+		fprintf(stderr, "%s: unlink(%s): %s\n", progname, name, strerror(errno));
+		exit(1);
+	}
+	if (link(object, name) < 0) {
+		in = open(object, O_RDONLY);
+		out = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0444);
+		if (in < 0 || out < 0) {
+			fprintf(stderr, "%s: open(%s): %s\n", progname, in < 0 ? object : name, strerror(errno));
+			exit(1);
+		}
+		if (clone_file(in, out) < 0 && copy_range(in, 0, out, length) < 0) {
+			fprintf(stderr, "%s: copy(%s, 0x%zx): %s\n", progname, name, length, strerror(errno));
+			exit(1);
+		}
+		close(in);
+		close(out);
+	}
+
+	printf("store: %s %s%s\n", name, hex, dup ? " (dup)" : "");
+
+	n = snprintf(line, sizeof(line), "%s\t%s\t%s\t%zu\n", release, name, hex, length);
+	if (index_len + n > index_size) {
+		index_size = 2 * (index_len + n);
+		index_rows = realloc(index_rows, index_size);
+		if (index_rows == NULL) {
+			fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, index_size);
+			exit(1);
+		}
+	}
+	memcpy(index_rows + index_len, line, n);
+	index_len += n;
+}
+
+/*
+ * Rewrite <store>/index: the lines of other releases, then this one's.
+ * The store directory is locked meanwhile, so concurrent unpacks into the
+ * same store do not lose each other's lines.
+ */
+static void
+store_finish(void)
+{
+	char path[PATH_MAX], tmp[PATH_MAX], *line = NULL;
+	size_t size = 0, rlen;
+	ssize_t n;
+	FILE *in, *out;
+	mode_t mask;
+	int lock, fd;
+
+	if (store_dir == NULL || list_only)
+		return;
+
+	lock = open(store_dir, O_RDONLY);
+	if (lock < 0 || flock(lock, LOCK_EX) < 0) {
+		fprintf(stderr, "%s: lock(%s): %s\n", progname, store_dir, strerror(errno));
+		exit(1);
+	}
+	snprintf(path, sizeof(path), "%s/index", store_dir);
+	snprintf(tmp, sizeof(tmp), "%s/.index-XXXXXX", store_dir);
+	fd = mkstemp(tmp);
+	if (fd < 0 || (out = fdopen(fd, "w")) == NULL) {
+		fprintf(stderr, "%s: mkstemp(%s): %s\n", progname, tmp, strerror(errno));
+		exit(1);
+	}
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	rlen = strlen(release);
+	in = fopen(path, "r");
+	if (in == NULL && errno != ENOENT) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	while (in && (n = getline(&line, &size, in)) > 0)
+		if (strncmp(line, release, rlen) != 0 || line[rlen] != '\t')
+			fwrite(line, 1, n, out);
+	if (in)
+		fclose(in);
+	free(line);
+
+	fwrite(index_rows, 1, index_len, out);
+	if (fclose(out) != 0 || rename(tmp, path) < 0) {
+		fprintf(stderr, "%s: write(%s): %s\n", progname, path, strerror(errno));
+		unlink(tmp);
+		exit(1);
+	}
+	close(lock);
+}
+
+/*
+ * Write `length` bytes at `offset` of `fd` to a new file `name`, or to the
+ * tar stream with --tar, or through the store with --store.
+ */
+static void
+extract_entry(int fd, off_t offset, const char *name, size_t length)
+{
+	char buffer[8196];
+	ware_check_t check;
+	size_t total;
+	ssize_t n;
+	int out;
+
+	if (tar_fd >= 0) {
+		/* A tar member can't be taken back, so check before writing. */
+		if (verify && verify_entry(fd, offset, name, length) < 0)
+			return;
+		tar_entry(fd, offset, name, length);
+		return;
+	}
+	if (store_dir) {
+		store_entry(fd, offset, name, length);
+		return;
+	}
+
+	out = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (out < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, name, strerror(errno));
+		exit(1);
+	}
+
+	if (!verify) {
+		if (copy_range(fd, offset, out, length) < 0) {
+			fprintf(stderr, "%s: copy(%s, 0x%zx): %s\n", progname, name, length, strerror(errno));
+			exit(1);
+		}
+		close(out);
+		return;
+	}
+
+	/* Check the bytes on their way through, then drop a failed entry. */
+	ware_check_init(&check, length);
+	for (total = 0; total < length; total += n) {
+		size_t m = length - total < sizeof(buffer) ? length - total : sizeof(buffer);
+		n = pread(fd, buffer, m, offset + total);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read(%zu): %zd\n", progname, m, n);
+			exit(1);
+		}
+		ware_check_update(&check, buffer, n);
+		if (write(out, buffer, n) != n) {
+			fprintf(stderr, "%s: write(%zu): %s\n", progname, (size_t)n, strerror(errno));
+			exit(1);
+		}
+	}
+	close(out);
+
+	if (report_check(&check, name) < 0)
+		unlink(name);
+}
+
+/*
+ * Does the entry at `offset` hold a PACK, bare or HEAD-wrapped? If so, fill
+ * in its header and where it starts in `fd`.
+ */
+static int
+nested_pack(int fd, off_t offset, size_t length, pack_header_t *header, off_t *start)
+{
+	vanmoof_head_t head;
+
+	if (length < sizeof(*header) ||
+	    pread(fd, header, sizeof(*header), offset) != sizeof(*header))
+		return 0;
+
+	if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) == 0) {
+		*start = offset;
+		return 1;
+	}
+
+	if (length < sizeof(head) ||
+	    pread(fd, &head, sizeof(head), offset) != sizeof(head) ||
+	    le32toh(head.magic) != HEAD_MAGIC ||
+	    (size_t)le32toh(head.offset) + le32toh(head.length) > length ||
+	    le32toh(head.length) < sizeof(*header))
+		return 0;
+
+	*start = offset + le32toh(head.offset);
+	if (pread(fd, header, sizeof(*header), *start) != sizeof(*header))
+		return 0;
+	return memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) == 0;
+}
+
+static void unpack_nested(int fd, off_t start, size_t length, const pack_header_t *header,
+			  const char *path, int depth);
+
+/*
+ * List and extract the entries of one PACK directory. `base` is where the
+ * PACK starts in `fd` (entry offsets are relative to it), `prefix` is
+ * prepended to every name. With -r an entry that is itself a PACK is
+ * expanded into a subdirectory instead of being written out.
+ */
+static void
+unpack_entries(int fd, off_t base, const pack_entry_t *entries, unsigned count,
+	       size_t dir_off, const char *prefix, int depth)
+{
+	char path[PATH_MAX];
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		const pack_entry_t *entry = &entries[i];
+		size_t eoff = le32toh(entry->offset);
+		size_t elen = le32toh(entry->length);
+
+		snprintf(path, sizeof(path), "%s%.*s", prefix,
+			(int)sizeof(entry->filename), entry->filename);
+
+		if (eoff < sizeof(pack_header_t) || eoff + elen > dir_off) {
+			fprintf(stderr, "%s: file %s offset 0x%08zx + length 0x%08zx is outside the PACK data 0x%08zx..0x%08zx\n",
+				progname, path, eoff, elen, sizeof(pack_header_t), dir_off);
+			exit(1);
+		}
+
+		{
+			char len_buf[32];
+			format_size(elen, len_buf, sizeof(len_buf));
+			printf("file: %s, offset 0x%08zx, length %s\n", path, eoff, len_buf);
+		}
+
+		if (recursive) {
+			pack_header_t header;
+			off_t start;
+
+			if (nested_pack(fd, base + eoff, elen, &header, &start)) {
+				if (depth < 8) {
+					unpack_nested(fd, start, elen - (start - base - eoff),
+						      &header, path, depth + 1);
+					continue;
+				}
+				printf("%s: %s: nesting too deep, not expanding\n", progname, path);
 			}
-			default:
-				printf("%s: Vanmoof signature: Type 0x%04x at 0x%zx, Length 0x%x\n",
-					progname, tlv.type, sig_offset + offset, tlv.length);
-				break;
 		}
-		offset += tlv.length;
+
+		if (!list_only)
+			extract_entry(fd, base + eoff, path, elen);
+		else if (verify)
+			verify_entry(fd, base + eoff, path, elen);
 	}
-	return 1;
+}
+
+/*
+ * Expand a PACK found inside another one into a directory named after the
+ * entry, minus its extension ("animations.pak" -> "animations/"). The
+ * directory is read straight from the parent's byte range.
+ */
+static void
+unpack_nested(int fd, off_t start, size_t length, const pack_header_t *header,
+	      const char *path, int depth)
+{
+	char dir[PATH_MAX];
+	pack_entry_t *entries;
+	size_t dir_off = le32toh(header->offset);
+	size_t dir_len = le32toh(header->length);
+	char *base, *dot;
+
+	if (dir_off + dir_len > length) {
+		fprintf(stderr, "%s: %s: PACK directory 0x%08zx + 0x%08zx is beyond end of entry 0x%08zx\n",
+			progname, path, dir_off, dir_len, length);
+		exit(1);
+	}
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	base = strrchr(dir, '/');
+	base = base ? base + 1 : dir;
+	dot = strrchr(base, '.');
+	if (dot && dot != base)
+		*dot = '\0';
+	else
+		strncat(dir, ".d", sizeof(dir) - strlen(dir) - 1);
+
+	if (!list_only && tar_fd < 0 && mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "%s: mkdir(%s): %s\n", progname, dir, strerror(errno));
+		exit(1);
+	}
+
+	entries = malloc(dir_len);
+	if (entries == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, dir_len);
+		exit(1);
+	}
+	if (pread(fd, entries, dir_len, start + dir_off) != (ssize_t)dir_len) {
+		fprintf(stderr, "%s: read(%zu): %s\n", progname, dir_len, strerror(errno));
+		exit(1);
+	}
+
+	printf("%s: nested PACK file, %zu entries\n", path, dir_len / sizeof(pack_entry_t));
+
+	strncat(dir, "/", sizeof(dir) - strlen(dir) - 1);
+	unpack_entries(fd, start, entries, dir_len / sizeof(pack_entry_t), dir_off, dir, depth);
+	free(entries);
+}
+
+/*
+ * Streaming input (a pipe from a download or decompression stage) can't
+ * seek to the PACK directory, which sits behind the data. Read the stream
+ * front to back instead: hash every byte in front of the signature trailer
+ * as it passes, spool the data area between the PACK header and the
+ * directory into an unlinked temporary file in the output directory, and
+ * cut the entries out of the spool once the directory has arrived. The
+ * trailer, if any, is whatever is left when the stream ends. Until the
+ * directory is in, no byte can be told to belong to an entry: the spool
+ * takes the whole data area, and nothing is extracted before the end.
+ */
+static void
+stream_read(int fd, void *buf, size_t len, EVP_MD_CTX *sha)
+{
+	size_t total = 0;
+	ssize_t n;
+
+	while (total < len) {
+		n = read(fd, (char *)buf + total, len - total);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read(%zu): %zd: unexpected end of stream\n",
+				progname, len - total, n);
+			exit(1);
+		}
+		total += n;
+	}
+	if (sha)
+		EVP_DigestUpdate(sha, buf, len);
+}
+
+/* Pass `len` bytes of the stream through the hash into `out` (or nowhere). */
+static void
+stream_copy(int fd, int out, size_t len, EVP_MD_CTX *sha)
+{
+	char buffer[8196];
+	size_t m;
+
+	while (len > 0) {
+		m = len < sizeof(buffer) ? len : sizeof(buffer);
+		stream_read(fd, buffer, m, sha);
+		if (out >= 0 && write(out, buffer, m) != (ssize_t)m) {
+			fprintf(stderr, "%s: write(%zu): %s\n", progname, m, strerror(errno));
+			exit(1);
+		}
+		len -= m;
+	}
+}
+
+static void
+stream_unpack(int fd, const char *packfile)
+{
+	pack_header_t header;
+	pack_entry_t *entries;
+	uint8_t trailer[0x10000];
+	uint8_t sha[SHA256_DIGEST_LENGTH];
+	EVP_MD_CTX *sha_ctx;
+	size_t pack_start = 0;
+	size_t pack_end;
+	size_t sig_offset = 0;
+	size_t dir_off, dir_len;
+	size_t sig_length;
+	ssize_t n;
+	int spool = -1;
+
+	sha_ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(sha_ctx, EVP_sha256(), NULL);
+
+	stream_read(fd, &header, sizeof(header), sha_ctx);
+
+	if (memcmp(header.magic, PACK_MAGIC, sizeof(header.magic))) {
+		uint32_t magic;
+		vanmoof_head_t head;
+
+		memcpy(&magic, header.magic, sizeof(magic));
+		if (le32toh(magic) != HEAD_MAGIC) {
+			fprintf(stderr, "%s: %s: not a PACK file\n", progname, packfile);
+			exit(1);
+		}
+
+		memcpy(&head, &header, sizeof(header));
+		stream_read(fd, (char *)&head + sizeof(header), sizeof(head) - sizeof(header), sha_ctx);
+
+		pack_start = le32toh(head.offset);
+		if (pack_start < sizeof(head)) {
+			fprintf(stderr, "%s: %s: HEAD offset 0x%zx inside the HEAD header\n",
+				progname, packfile, pack_start);
+			exit(1);
+		}
+		sig_offset = pack_start + le32toh(head.length);
+		{
+			char len_buf[32];
+			format_size(le32toh(head.length), len_buf, sizeof(len_buf));
+			printf("%s: Vanmoof software: Version %d.%d.%d.%d, Offset 0x%x, Length %s\n",
+				progname, (le32toh(head.version0) >> 0) & 0xff, (le32toh(head.version0) >> 8) & 0xff,
+				(le32toh(head.version0) >> 16) & 0xff, le32toh(head.version1),
+				le32toh(head.offset), len_buf);
+		}
+
+		stream_copy(fd, -1, pack_start - sizeof(head), sha_ctx);
+		stream_read(fd, &header, sizeof(header), sha_ctx);
+		if (memcmp(header.magic, PACK_MAGIC, sizeof(header.magic))) {
+			fprintf(stderr, "%s: %s: not a PACK file\n", progname, packfile);
+			exit(1);
+		}
+	}
+
+	dir_off = le32toh(header.offset);
+	dir_len = le32toh(header.length);
+	if (dir_off < sizeof(header)) {
+		fprintf(stderr, "%s: PACK directory offset 0x%08zx is inside the PACK header\n",
+			progname, dir_off);
+		exit(1);
+	}
+	pack_end = pack_start + dir_off + dir_len;
+	if (sig_offset == 0)
+		sig_offset = pack_end;
+	if (sig_offset < pack_end) {
+		fprintf(stderr, "%s: WARNING: PACK offset 0x%08zx + length 0x%08zx is beyond end of HEAD payload 0x%08zx\n",
+			progname, dir_off, dir_len, sig_offset - pack_start);
+		exit(1);
+	}
+
+	if (!list_only || recursive || verify) {
+		char name[] = ".unpack-XXXXXX";
+
+		spool = mkstemp(name);
+		if (spool < 0) {
+			fprintf(stderr, "%s: mkstemp(%s): %s\n", progname, name, strerror(errno));
+			exit(1);
+		}
+		unlink(name);
+	}
+	stream_copy(fd, spool, dir_off - sizeof(header), sha_ctx);
+
+	entries = malloc(dir_len);
+	if (entries == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname, dir_len);
+		exit(1);
+	}
+	stream_read(fd, entries, dir_len, sha_ctx);
+
+	/* The spool holds the PACK from just past its header. */
+	unpack_entries(spool, -(off_t)sizeof(header), entries, dir_len / sizeof(pack_entry_t),
+		       dir_off, "", 0);
+
+	free(entries);
+	if (spool >= 0)
+		close(spool);
+	if (tar_fd >= 0 && !list_only)
+		tar_finish();
+
+	/* Whatever is between the directory and the HEAD payload end is
+	 * still covered by the hash; the rest of the stream is the trailer. */
+	stream_copy(fd, -1, sig_offset - pack_end, sha_ctx);
+	EVP_DigestFinal_ex(sha_ctx, sha, NULL);
+	EVP_MD_CTX_free(sha_ctx);
+
+	sig_length = 0;
+	while ((n = read(fd, trailer + sig_length, sizeof(trailer) - sig_length)) > 0) {
+		sig_length += n;
+		if (sig_length == sizeof(trailer))
+			break;
+	}
+
+	if (sig_length == 0)
+		return;
+
+	if (is_signature(trailer, sig_length))
+		print_signature(trailer, sig_offset, sig_length, sha);
+	else
+		printf("%s: Vanmoof signature?: Offset 0x%zx, Length 0x%zx%s\n", progname,
+			sig_offset, sig_length, sig_length == sizeof(trailer) ? "+" : "");
 }
 
 int
 main(int argc, char **argv)
 {
-	char buffer[8196];
 	char *packfile;
-	int fd, out;
+	int fd;
 	struct stat st;
 	pack_header_t header;
-	pack_entry_t entry;
+	pack_entry_t *entries;
 	size_t pack_start = 0;
 	size_t offset;
-	size_t total;
-	ssize_t n, m;
-	int i;
-	int list_only = 0;
+	ssize_t n;
 	int signature_parsed = 0;
 	char *outdir = NULL;
 
@@ -157,7 +894,7 @@ main(int argc, char **argv)
 	else
 		progname = argv[0];
 
-	while (argc > 1 && argv[1][0] == '-') {
+	while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
 		if (strcmp(argv[1], "-l") == 0) {
 			list_only = 1;
 			argc--;
@@ -166,6 +903,34 @@ main(int argc, char **argv)
 			human = 1;
 			argc--;
 			argv++;
+		} else if (strcmp(argv[1], "-r") == 0) {
+			recursive = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--verify") == 0) {
+			verify = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--strict") == 0) {
+			verify = strict = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--tar") == 0) {
+			tar_fd = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--store") == 0) {
+			if (argc < 3)
+				usage();
+			store_dir = argv[2];
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--release") == 0) {
+			if (argc < 3)
+				usage();
+			release = argv[2];
+			argc -= 2;
+			argv += 2;
 		} else if (strcmp(argv[1], "-d") == 0) {
 			if (argc < 3)
 				usage();
@@ -181,15 +946,19 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (argc < 2)
+	if (argc < 2 || (tar_fd >= 0 && store_dir))
 		usage();
 
 	packfile = argv[1];
 
-	fd = open(packfile, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "%s: open(%s): %s\n", progname, packfile, strerror(errno));
-		exit(1);
+	if (strcmp(packfile, "-") == 0) {
+		fd = STDIN_FILENO;
+	} else {
+		fd = open(packfile, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "%s: open(%s): %s\n", progname, packfile, strerror(errno));
+			exit(1);
+		}
 	}
 
 	if (fstat(fd, &st) < 0) {
@@ -197,6 +966,50 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
+	default_mtime = st.st_mtime;
+
+	/* The tar stream owns stdout; the listing goes to stderr instead. */
+	if (tar_fd >= 0 && !list_only) {
+		if (isatty(STDOUT_FILENO)) {
+			fprintf(stderr, "%s: refusing to write a tar stream to a terminal\n", progname);
+			exit(1);
+		}
+		tar_fd = dup(STDOUT_FILENO);
+		if (tar_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			fprintf(stderr, "%s: dup(stdout): %s\n", progname, strerror(errno));
+			exit(1);
+		}
+	} else {
+		tar_fd = -1;
+	}
+
+	/* The store path must survive the chdir into the output directory. */
+	if (store_dir && !list_only) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/objects", store_dir);
+		if ((mkdir(store_dir, 0777) < 0 && errno != EEXIST) ||
+		    (mkdir(path, 0777) < 0 && errno != EEXIST)) {
+			fprintf(stderr, "%s: mkdir(%s): %s\n", progname, path, strerror(errno));
+			exit(1);
+		}
+		store_dir = realpath(store_dir, NULL);
+		if (store_dir == NULL) {
+			fprintf(stderr, "%s: realpath(%s): %s\n", progname, path, strerror(errno));
+			exit(1);
+		}
+		if (release == NULL && strcmp(packfile, "-") == 0) {
+			fprintf(stderr, "%s: --store on standard input needs --release <name>\n", progname);
+			exit(1);
+		}
+		if (release == NULL) {
+			release = strrchr(packfile, '/');
+			release = release ? release + 1 : packfile;
+		}
+	} else {
+		store_dir = NULL;
+	}
+
 	if (outdir && !list_only) {
 		if (mkdir(outdir, 0777) < 0 && errno != EEXIST) {
 			fprintf(stderr, "%s: mkdir(%s): %s\n", progname, outdir, strerror(errno));
@@ -208,6 +1021,13 @@ main(int argc, char **argv)
 		}
 	}
 
+	/* Pipes, sockets and ttys can't seek to the directory. */
+	if (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) {
+		stream_unpack(fd, packfile);
+		store_finish();
+		return verify_failed;
+	}
+
 retry:
 	n = read(fd, &header, sizeof(header));
 	if (n != sizeof(header)) {
@@ -271,68 +1091,24 @@ retry:
 	}
 
 	offset = le32toh(header.offset);
-	for (i = 0; i < le32toh(header.length) / sizeof(entry); i++) {
-		n = lseek(fd, offset + pack_start, SEEK_SET);
-		if (n != offset + pack_start) {
-			fprintf(stderr, "%s: seek(%zu): %zd\n", progname, offset + pack_start, n);
-			exit(1);
-		}
-
-		n = read(fd, &entry, sizeof(entry));
-		if (n != sizeof(entry)) {
-			fprintf(stderr, "%s: read(%zu): %zd\n", progname, sizeof(entry), n);
-			exit(1);
-		}
-
-		if (le32toh(entry.offset) + le32toh(entry.length) > le32toh(header.offset)) {
-			fprintf(stderr, "%s: file %s offset 0x%08x + length 0x%08x is beyond start of PACK directoy 0x%08x\n",
-				progname, entry.filename, le32toh(entry.offset), le32toh(entry.length), le32toh(header.offset));
-			exit(1);
-		}
-
-		{
-			char len_buf[32];
-			format_size(le32toh(entry.length), len_buf, sizeof(len_buf));
-			printf("file: %s, offset 0x%08x, length %s\n", entry.filename,
-				le32toh(entry.offset), len_buf);
-		}
-
-		if (!list_only) {
-			out = open(entry.filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
-			if (out < 0) {
-				fprintf(stderr, "%s: open(%s): %s\n", progname, packfile, strerror(errno));
-				exit(1);
-			}
-
-			n = lseek(fd, le32toh(entry.offset) + pack_start, SEEK_SET);
-			if (n != le32toh(entry.offset) + pack_start) {
-				fprintf(stderr, "%s: seek(%zu): %zd\n", progname, le32toh(entry.offset) + pack_start, n);
-				exit(1);
-			}
-
-			total = 0;
-			while (total < le32toh(entry.length)) {
-				m = le32toh(entry.length) - total;
-				if (m > sizeof(buffer))
-					m = sizeof(buffer);
-				n = read(fd, buffer, m);
-				if (n != m) {
-					fprintf(stderr, "%s: read(%zu): %zd\n", progname, m, n);
-					exit(1);
-				}
-				n = write(out, buffer, m);
-				if (n != m) {
-					fprintf(stderr, "%s: write(%zu): %zd\n", progname, m, n);
-					exit(1);
-				}
-				total += n;
-			}
+	entries = malloc(le32toh(header.length));
+	if (entries == NULL) {
+		fprintf(stderr, "%s: malloc(%u): Out of memory\n", progname, le32toh(header.length));
+		exit(1);
+	}
+	n = pread(fd, entries, le32toh(header.length), offset + pack_start);
+	if (n != le32toh(header.length)) {
+		fprintf(stderr, "%s: read(%u): %zd\n", progname, le32toh(header.length), n);
+		exit(1);
+	}
 
-			close(out);
-		}
+	unpack_entries(fd, pack_start, entries, le32toh(header.length) / sizeof(pack_entry_t),
+		       offset, "", 0);
+	free(entries);
 
-		offset += sizeof(entry);
-	}
+	if (tar_fd >= 0)
+		tar_finish();
+	store_finish();
 
 	if (!signature_parsed) {
 		size_t pack_end = pack_start + le32toh(header.offset) + le32toh(header.length);
@@ -346,5 +1122,5 @@ retry:
 		}
 	}
 
-	return 0;
+	return verify_failed;
 }
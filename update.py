@@ -1,15 +1,13 @@
 import sys
+import os
 import asyncio
+import argparse
+import hashlib
+import json
+import time
 
-import bleak
 import zlib
 
-from pymoof.clients.sx3 import Sound
-from pymoof.clients.sx3 import SX3Client
-from pymoof.tools import discover_bike
-from pymoof.tools import retrieve_encryption_key
-from pymoof.util import bleak_utils
-
 import enum
 import math
 
@@ -26,17 +24,91 @@ class Firmware(enum.Enum):
     UNKNOWN_13 = '6acc5513-e631-4069-944d-b8ca7598ad50'
 
 
-async def firmware_update(client, key, name):
-    with open(name, 'rb') as f:
-        data = f.read()
+# The bike takes the encrypted image in writes of this size.
+CHUNK = 240
 
-    length = len(data)
-    crc = zlib.crc32(data) & 0xffffffff
 
-    print(f'file {name}: len {length} crc {hex(crc)}')
+class BikeTransport:
+    # The two writes of a firmware update, on a connected bike. METADATA
+    # goes through pymoof (it is encrypted with the UKEY), the BLOCK
+    # writes go straight to the GATT characteristic. mock_bike.py has the
+    # same interface without a bike.
+    def __init__(self, client):
+        self.client = client
 
-    cipher = Cipher(algorithms.AES(bytes.fromhex(key)), modes.ECB())
-    encryptor = cipher.encryptor()
+    @property
+    def mtu(self):
+        return self.client._gatt_client.mtu_size
+
+    @property
+    def connected(self):
+        return self.client._gatt_client.is_connected
+
+    async def position(self):
+        # How much of the image the bike holds. There is no known way to
+        # ask the bike, so a resume trusts the checkpoint.
+        return None
+
+    async def write_metadata(self, metadata):
+        await self.client._write(Firmware.METADATA, metadata)
+
+    async def write_block(self, chunk, response):
+        await self.client._gatt_client.write_gatt_char(Firmware.BLOCK.value, chunk, response=response)
+
+
+def window_size(mtu, interval):
+    # How many BLOCK writes to keep unacknowledged. A write without
+    # response has to fit the ATT MTU; below 243 only acknowledged (long)
+    # writes work, one at a time. Otherwise each 240-byte write is one
+    # 251-byte link layer packet with data length extension, about 2.5 ms
+    # on air at 1M PHY, and an acknowledged write takes about two
+    # connection intervals to come back: keep that much in flight.
+    if mtu < CHUNK + 3:
+        return 1
+    return max(2, min(64, int(2 * interval / 0.0025)))
+
+
+async def send_blocks(transport, enc, window, start=0, on_ack=None, retries=8, backoff=0.05):
+    # Send the encrypted image from offset `start` (a multiple of CHUNK)
+    # as BLOCK writes without response, with every `window`th write (and
+    # the last) acknowledged. The acknowledged write is the flow control:
+    # the bike has processed everything before it once it returns, which
+    # is reported through on_ack(offset). A write that fails locally was
+    # not sent, so it is retried in place (the bike appends blocks in
+    # order) after an exponential back-off; a lost connection is passed
+    # on to the caller.
+    offset = start
+    sent = 0
+    failures = 0
+    errors = 0
+    while offset < len(enc):
+        chunk = enc[offset:offset + CHUNK]
+        sent += 1
+        last = sent % window == 0 or offset + len(chunk) >= len(enc)
+        try:
+            await transport.write_block(chunk, window == 1 or last)
+        except Exception as e:
+            if not transport.connected:
+                raise
+            failures += 1
+            errors += 1
+            if failures > retries:
+                raise
+            delay = backoff * 2 ** (failures - 1)
+            print(f'\nchunk at {offset}: {e}, retrying in {delay:.2f}s')
+            sent -= 1
+            await asyncio.sleep(delay)
+            continue
+        failures = 0
+        offset += len(chunk)
+        if last and on_ack:
+            on_ack(offset)
+    return errors
+
+
+def make_metadata(data):
+    length = len(data)
+    crc = zlib.crc32(data) & 0xffffffff
 
     metadata = bytearray()
     metadata.append(0)
@@ -48,9 +120,12 @@ async def firmware_update(client, key, name):
     metadata.append((crc >> 16) & 0xff)
     metadata.append((crc >>  8) & 0xff)
     metadata.append((crc >>  0) & 0xff)
-    print(f'metadata: {metadata.hex()}')
+    return bytes(metadata)
 
-    await client._write(Firmware.METADATA, metadata)
+
+def encrypt(key, data):
+    cipher = Cipher(algorithms.AES(bytes.fromhex(key)), modes.ECB())
+    encryptor = cipher.encryptor()
 
     # Pad to the nearest cipher 16 byte block size
     pad = bytearray()
@@ -58,20 +133,156 @@ async def firmware_update(client, key, name):
             pad.append(0xff)
     data = data + pad
 
-    enc = bytes(encryptor.update(data) + encryptor.finalize())
+    return bytes(encryptor.update(data) + encryptor.finalize())
+
+
+def read_otaenc(name):
+    # Read a frame stream prepared by otaenc: b'VMOT', then per GATT
+    # write one type byte (M = metadata, B = block), a length byte and
+    # the payload. The encryption and chunking are already done.
+    if name == '-':
+        stream = sys.stdin.buffer
+    else:
+        stream = open(name, 'rb')
+
+    if stream.read(4) != b'VMOT':
+        print(f'{name}: not an otaenc stream')
+        exit(1)
+
+    metadata = None
+    enc = bytearray()
+    while True:
+        frame = stream.read(2)
+        if not frame:
+            break
+        payload = stream.read(frame[1]) if len(frame) == 2 else b''
+        if len(frame) < 2 or len(payload) < frame[1]:
+            print(f'{name}: otaenc stream ends in the middle of a frame')
+            exit(1)
+        if frame[0] == ord('M'):
+            metadata = payload
+        else:
+            enc += payload
+    if metadata is None:
+        print(f'{name}: otaenc stream without metadata')
+        exit(1)
+    return metadata, bytes(enc)
+
+
+def is_otaenc(name):
+    if name == '-':
+        return True
+    with open(name, 'rb') as f:
+        return f.read(4) == b'VMOT'
+
+
+def prepare(key, name):
+    # Metadata and encrypted image, from a plain image or an otaenc stream.
+    if is_otaenc(name):
+        return read_otaenc(name)
+
+    with open(name, 'rb') as f:
+        data = f.read()
+
+    metadata = make_metadata(data)
+    print(f'file {name}: len {len(data)} crc {metadata[5:9].hex()}')
+    return metadata, encrypt(key, data)
+
+
+class Checkpoint:
+    # The last acknowledged offset of a transfer, in a small JSON file
+    # shared by all transfers and keyed by bike and the SHA256 of the
+    # encrypted image (which covers both the image and the key). Written
+    # on every acknowledgement, removed when the transfer is complete.
+    def __init__(self, path, bike, enc):
+        self.path = path
+        self.key = f'{bike}/{hashlib.sha256(enc).hexdigest()}'
+
+    def _read(self):
+        try:
+            with open(self.path) as f:
+                return json.load(f)
+        except (OSError, ValueError):
+            return {}
+
+    def _write(self, entries):
+        tmp = f'{self.path}.tmp'
+        with open(tmp, 'w') as f:
+            json.dump(entries, f, indent=1)
+        os.replace(tmp, self.path)
+
+    def load(self):
+        return self._read().get(self.key, {}).get('offset', 0)
+
+    def save(self, offset):
+        entries = self._read()
+        entries[self.key] = {'offset': offset, 'time': int(time.time())}
+        self._write(entries)
+
+    def clear(self):
+        entries = self._read()
+        if entries.pop(self.key, None) is not None:
+            self._write(entries)
+
+
+async def resume_offset(transport, enc, checkpoint):
+    # Where to continue: the checkpoint, corrected by what the bike says
+    # it holds when the transport can tell. Writes after the last
+    # acknowledged one may or may not have reached the bike before the
+    # link dropped; a bike that forgot the transfer needs the METADATA
+    # again. Without the bike's position the checkpoint is trusted - if
+    # that was wrong, the bike's CRC check rejects the image.
+    offset = checkpoint.load() if checkpoint else 0
+    if offset == 0:
+        return 0
+
+    position = await transport.position()
+    if position is None or position == offset:
+        return offset
+    if 0 < position <= len(enc) and position % CHUNK == 0:
+        print(f'bike holds {position} bytes, checkpoint says {offset}')
+        return position
+    print(f'bike holds {position} bytes, starting over')
+    return 0
+
+
+async def firmware_update(transport, metadata, enc, window, checkpoint=None):
     length = len(enc)
+    offset = await resume_offset(transport, enc, checkpoint)
+
+    if offset:
+        print(f'resuming at {offset}/{length}')
+    else:
+        print(f'metadata: {metadata.hex()}')
+        await transport.write_metadata(metadata)
+        if checkpoint:
+            checkpoint.save(0)
+
+    started = time.monotonic()
 
-    offset = 0
-    while offset < length:
-        chunk = enc[offset:offset+240]
-        print(f'chunk {offset}/{length}: {len(chunk)} {chunk.hex()}')
+    def progress(acked):
+        if checkpoint:
+            checkpoint.save(acked)
+        print(f'\rchunk {acked}/{length}', end='', flush=True)
 
-        await bleak_utils.write_to_characteristic(client._gatt_client, Firmware.BLOCK, chunk)
+    errors = await send_blocks(transport, enc, window, start=offset, on_ack=progress)
+    if checkpoint:
+        checkpoint.clear()
 
-        offset += 240
+    elapsed = time.monotonic() - started
+    sent = length - offset
+    print(f'\n{sent} bytes in {elapsed:.1f}s, {sent / elapsed / 1024:.1f} KiB/s, '
+          f'window {window}, {errors} retried writes')
 
 
-async def update():
+async def update(args):
+    import bleak
+
+    from pymoof.clients.sx3 import Sound
+    from pymoof.clients.sx3 import SX3Client
+    from pymoof.tools import discover_bike
+    from pymoof.tools import retrieve_encryption_key
+
     # print('Getting key from vanmoof servers')
     # key, user_key_id = retrieve_encryption_key.query()
 
@@ -84,20 +295,55 @@ async def update():
     # Insert your manufacturer key here:
     mkey = '4638384135453030303030304d4f4f46'
 
+    metadata, enc = prepare(mkey, args.image)
+
     print('Discovering nearby vanmoof bikes')
     device = await discover_bike.query()
     if device is None:
         exit(1)
 
+    checkpoint = Checkpoint(args.checkpoint, device.address, enc)
+    if args.restart:
+        checkpoint.clear()
+
     print('Doing firmware update')
-    async with bleak.BleakClient(device) as bleak_client:
-        client = SX3Client(bleak_client, key, user_key_id)
+    for attempt in range(args.reconnects + 1):
+        try:
+            async with bleak.BleakClient(device) as bleak_client:
+                client = SX3Client(bleak_client, key, user_key_id)
+
+                await client.authenticate()
+
+                await client.play_sound(Sound.BEEP_POSITIVE)
+
+                transport = BikeTransport(client)
+                window = args.window or window_size(transport.mtu, args.interval / 1000)
+                print(f'mtu {transport.mtu}, window {window}')
 
-        await client.authenticate()
+                await firmware_update(transport, metadata, enc, window, checkpoint)
+            break
+        except (bleak.exc.BleakError, asyncio.TimeoutError, OSError) as e:
+            if attempt == args.reconnects:
+                raise
+            print(f'\nconnection lost ({e}), reconnecting')
+            await asyncio.sleep(2)
 
-        await client.play_sound(Sound.BEEP_POSITIVE)
 
-        await firmware_update(client, mkey, sys.argv[1])
+def parse_args(argv=None):
+    parser = argparse.ArgumentParser(description='Send a firmware image or otaenc stream to the bike.')
+    parser.add_argument('image', help='firmware image (e.g. a PACK), otaenc stream, or - for an otaenc stream on stdin')
+    parser.add_argument('--window', type=int, default=0,
+                        help='BLOCK writes in flight per acknowledged write (default: from MTU and interval)')
+    parser.add_argument('--interval', type=float, default=30,
+                        help='connection interval in ms, for sizing the window (default 30)')
+    parser.add_argument('--checkpoint', default=os.path.expanduser('~/.vanmoof-update.json'),
+                        help='file with the progress of interrupted transfers (default ~/.vanmoof-update.json)')
+    parser.add_argument('--restart', action='store_true',
+                        help='ignore a checkpoint and send the whole image')
+    parser.add_argument('--reconnects', type=int, default=5,
+                        help='times to reconnect and resume after the link drops (default 5)')
+    return parser.parse_args(argv)
 
 
-asyncio.run(update())
+if __name__ == '__main__':
+    asyncio.run(update(parse_args()))
@@ -0,0 +1,397 @@
+/*
+ * Image integrity checks shared by the host tools: the STM32 CRC used by
+ * S3/X3 wares and bootloaders, and an incremental version of crc32's
+ * per-image checks for tools that stream an image through a copy loop.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "endian_compat.h"
+#include <zlib.h>
+
+#include "pack.h"
+#include "ware_check.h"
+
+/* CRC-32/MPEG-2, poly 0x04c11db7, MSB first: one step per input byte. */
+static const uint32_t stm32_crc_table[256] = {
+	0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b,
+	0x1a864db2, 0x1e475005, 0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
+	0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd, 0x4c11db70, 0x48d0c6c7,
+	0x4593e01e, 0x4152fda9, 0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+	0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011, 0x791d4014, 0x7ddc5da3,
+	0x709f7b7a, 0x745e66cd, 0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
+	0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5, 0xbe2b5b58, 0xbaea46ef,
+	0xb7a96036, 0xb3687d81, 0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+	0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49, 0xc7361b4c, 0xc3f706fb,
+	0xceb42022, 0xca753d95, 0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
+	0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d, 0x34867077, 0x30476dc0,
+	0x3d044b19, 0x39c556ae, 0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+	0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16, 0x018aeb13, 0x054bf6a4,
+	0x0808d07d, 0x0cc9cdca, 0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
+	0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02, 0x5e9f46bf, 0x5a5e5b08,
+	0x571d7dd1, 0x53dc6066, 0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+	0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e, 0xbfa1b04b, 0xbb60adfc,
+	0xb6238b25, 0xb2e29692, 0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
+	0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a, 0xe0b41de7, 0xe4750050,
+	0xe9362689, 0xedf73b3e, 0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+	0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686, 0xd5b88683, 0xd1799b34,
+	0xdc3abded, 0xd8fba05a, 0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
+	0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb, 0x4f040d56, 0x4bc510e1,
+	0x46863638, 0x42472b8f, 0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+	0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47, 0x36194d42, 0x32d850f5,
+	0x3f9b762c, 0x3b5a6b9b, 0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
+	0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623, 0xf12f560e, 0xf5ee4bb9,
+	0xf8ad6d60, 0xfc6c70d7, 0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+	0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f, 0xc423cd6a, 0xc0e2d0dd,
+	0xcda1f604, 0xc960ebb3, 0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
+	0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b, 0x9b3660c6, 0x9ff77d71,
+	0x92b45ba8, 0x9675461f, 0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+	0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640, 0x4e8ee645, 0x4a4ffbf2,
+	0x470cdd2b, 0x43cdc09c, 0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
+	0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24, 0x119b4be9, 0x155a565e,
+	0x18197087, 0x1cd86d30, 0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+	0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088, 0x2497d08d, 0x2056cd3a,
+	0x2d15ebe3, 0x29d4f654, 0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
+	0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c, 0xe3a1cbc1, 0xe760d676,
+	0xea23f0af, 0xeee2ed18, 0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+	0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0, 0x9abc8bd5, 0x9e7d9662,
+	0x933eb0bb, 0x97ffad0c, 0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
+	0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4,
+};
+
+uint32_t crc32_calculate(uint32_t crc, const void *data, size_t length)
+{
+	const uint8_t *p = data;
+	uint32_t word;
+	size_t i;
+
+	for (i = 0; i < length; i += sizeof(uint32_t)) {
+		memcpy(&word, p + i, sizeof(word));
+		crc ^= word;
+		crc = (crc << 8) ^ stm32_crc_table[crc >> 24];
+		crc = (crc << 8) ^ stm32_crc_table[crc >> 24];
+		crc = (crc << 8) ^ stm32_crc_table[crc >> 24];
+		crc = (crc << 8) ^ stm32_crc_table[crc >> 24];
+	}
+
+	return crc;
+}
+
+uint32_t ware_crc(uint32_t crc, const vanmoof_ware_t *ware, const void *data, size_t length)
+{
+	vanmoof_ware_t tmp;
+
+	memcpy(&tmp, ware, sizeof(tmp));
+	tmp.crc = 0xffffffff;
+	tmp.length = 0xffffffff;
+
+	crc = crc32_calculate(crc, &tmp, sizeof(tmp));
+
+	crc = crc32_calculate(crc, (const uint8_t *)data + sizeof(tmp), length - sizeof(tmp));
+
+	return crc;
+}
+
+uint32_t ware_stamp(void *img, size_t size)
+{
+	vanmoof_ware_t ware;
+
+	if (size < sizeof(ware) || size % sizeof(uint32_t) != 0)
+		return 0;
+
+	memcpy(&ware, img, sizeof(ware));
+	ware.length = htole32((uint32_t)size);
+	ware.crc = htole32(ware_crc(STM32_CRC_INIT, &ware, img, size));
+	memcpy(img, &ware, sizeof(ware));
+
+	return le32toh(ware.crc);
+}
+
+int test_arm(const uint8_t *data, size_t len)
+{
+	if (data[3] != 0x20) // stack pointer must be inside RAM
+		return 0;
+
+	const uint8_t *p = data + 4;
+	uint32_t match = 0;
+	int vcount = 0;
+	int mcount = 0;
+
+	// Test for similar vectors
+	for (int i = 0; i < 15; i++) {
+		uint32_t offset;
+		memcpy(&offset, p + i * sizeof(offset), sizeof(offset));
+		offset = le32toh(offset);
+		if (offset) {
+			vcount++;
+			if (match && !((match ^ offset) & 0xffff0000)) {
+				mcount++;
+			} else {
+				match = offset;
+				mcount = 1;
+			}
+		}
+	}
+	if (vcount > 5 && (vcount - mcount) < 3)
+		return 1;
+
+	return 0;
+}
+
+/* The CRC'd area is [from, length); a header that rules out a match sets
+ * from past everything so nothing is fed. */
+#define CHECK_NOTHING	((size_t)-1)
+
+static const uint8_t ff8[8] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static size_t
+head_len(const ware_check_t *c)
+{
+	return c->size < sizeof(c->head) ? c->size : sizeof(c->head);
+}
+
+/* Decide what the image is once its first bytes are in. */
+static void
+detect(ware_check_t *c)
+{
+	const uint8_t *h = c->head;
+	size_t hl = head_len(c);
+	vanmoof_ware_t ware;
+	ble_ware_t ble;
+	vmfw_ware_t vmfw;
+
+	c->from = CHECK_NOTHING;
+	c->length = 0;
+
+	if (hl >= sizeof(ware))
+		memcpy(&ware, h, sizeof(ware));
+	if (hl >= sizeof(ble))
+		memcpy(&ble, h, sizeof(ble));
+
+	if (hl >= sizeof(ware) && le32toh(ware.magic) == WARE_MAGIC) {
+		c->kind = CHECK_WARE;
+		c->expected = le32toh(ware.crc);
+		c->length = le32toh(ware.length);
+		if (c->length > c->size || c->length < sizeof(ware)) {
+			c->bad = 1;
+			return;
+		}
+		c->crc = ware_crc(STM32_CRC_INIT, &ware, h, sizeof(ware));
+		c->from = sizeof(ware);
+	} else if (hl >= sizeof(ble) &&
+		   memcmp(ble.magic, BLE_WARE_MAGIC, sizeof(ble.magic)) == 0) {
+		c->kind = CHECK_OAD;
+		c->expected = le32toh(ble.crc);
+		c->length = le32toh(ble.len);
+		if (c->length > c->size || c->length < 12) {
+			c->bad = 1;
+			return;
+		}
+		c->crc = crc32(0, NULL, 0);
+		c->from = 12;
+	} else if (hl >= sizeof(vanmoof_head_t) && le32toh(ware.magic) == HEAD_MAGIC) {
+		c->kind = CHECK_HEAD;
+	} else if (hl >= sizeof(pack_header_t) && memcmp(h, PACK_MAGIC, 4) == 0) {
+		c->kind = CHECK_PACK;
+	} else if (c->size > VMFW_OFFSET + sizeof(vmfw) &&
+		   memcmp(h + VMFW_OFFSET, VMFW_MAGIC, sizeof(vmfw.magic)) == 0) {
+		size_t fields_off = VMFW_OFFSET + offsetof(vmfw_ware_t, crc);
+
+		memcpy(&vmfw, h + VMFW_OFFSET, sizeof(vmfw));
+		c->kind = CHECK_VMFW;
+		c->expected = le32toh(vmfw.crc);
+		c->length = le32toh(vmfw.length);
+		if (c->length > c->size || c->length < fields_off + sizeof(ff8)) {
+			c->bad = 1;
+			return;
+		}
+		c->crc = crc32(0, h, fields_off);
+		c->crc = crc32(c->crc, ff8, sizeof(ff8));
+		c->from = fields_off + sizeof(ff8);
+	} else {
+		/* Plain ARM image or something unknown: either may still end
+		 * in a bootloader version + CRC trailer over the rest. */
+		c->kind = (hl >= 64 && test_arm(h, hl)) ? CHECK_ARM : CHECK_UNKNOWN;
+		if (c->size >= sizeof(c->tail)) {
+			c->crc = STM32_CRC_INIT;
+			c->from = 0;
+			c->length = c->size - sizeof(uint32_t);
+		}
+	}
+}
+
+/* Run the bytes at image offset `at` through the CRC of the detected kind. */
+static void
+feed(ware_check_t *c, const uint8_t *p, size_t n, size_t at)
+{
+	size_t lo = at, hi = at + n;
+
+	if (c->from == CHECK_NOTHING)
+		return;
+	if (lo < c->from)
+		lo = c->from;
+	if (hi > c->length)
+		hi = c->length;
+	if (lo >= hi)
+		return;
+	p += lo - at;
+	n = hi - lo;
+
+	switch (c->kind) {
+		case CHECK_OAD:
+		case CHECK_VMFW:
+			c->crc = crc32(c->crc, p, n);
+			break;
+		default:
+			/* STM32 words: complete a pending partial word first. */
+			if (c->wlen) {
+				size_t m = sizeof(c->word) - c->wlen;
+				if (m > n)
+					m = n;
+				memcpy(c->word + c->wlen, p, m);
+				c->wlen += m;
+				p += m;
+				n -= m;
+				if (c->wlen < sizeof(c->word))
+					return;
+				c->crc = crc32_calculate(c->crc, c->word, sizeof(c->word));
+				c->wlen = 0;
+			}
+			c->crc = crc32_calculate(c->crc, p, n & ~(size_t)3);
+			memcpy(c->word, p + (n & ~(size_t)3), n & 3);
+			c->wlen = n & 3;
+			break;
+	}
+}
+
+void ware_check_init(ware_check_t *c, size_t size)
+{
+	memset(c, 0, sizeof(*c));
+	c->size = size;
+	c->kind = CHECK_UNKNOWN;
+}
+
+void ware_check_update(ware_check_t *c, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t hl = head_len(c);
+
+	if (c->pos + len > c->size)
+		len = c->size - c->pos;
+
+	/* Keep the last 8 bytes for the bootloader trailer. */
+	if (c->size >= sizeof(c->tail)) {
+		size_t start = c->size - sizeof(c->tail);
+		for (size_t q = c->pos < start ? start : c->pos; q < c->pos + len; q++)
+			c->tail[q - start] = p[q - c->pos];
+	}
+
+	if (c->pos < hl) {
+		size_t n = hl - c->pos < len ? hl - c->pos : len;
+		memcpy(c->head + c->pos, p, n);
+		c->pos += n;
+		p += n;
+		len -= n;
+		if (c->pos < hl)
+			return;
+		detect(c);
+		feed(c, c->head, hl, 0);
+	}
+
+	feed(c, p, len, c->pos);
+	c->pos += len;
+}
+
+int ware_check_final(ware_check_t *c, char *msg, size_t msgsize)
+{
+	const uint8_t *v = c->tail;
+	uint32_t trailer_crc;
+	int ok;
+
+	if (c->pos < c->size) {
+		snprintf(msg, msgsize, "short image, 0x%zx of 0x%zx bytes", c->pos, c->size);
+		return CHECK_FAIL;
+	}
+	if (c->size == 0) {
+		snprintf(msg, msgsize, "empty image, cannot verify");
+		return CHECK_UNVERIFIED;
+	}
+	if (c->wlen) {
+		memset(c->word + c->wlen, 0, sizeof(c->word) - c->wlen);
+		c->crc = crc32_calculate(c->crc, c->word, sizeof(c->word));
+		c->wlen = 0;
+	}
+	ok = c->crc == c->expected;
+
+	switch (c->kind) {
+		case CHECK_WARE: {
+			const vanmoof_ware_t *ware = (const vanmoof_ware_t *)c->head;
+			if (c->bad) {
+				snprintf(msg, msgsize, "vanmoof ware length 0x%08zx does not fit image size 0x%08zx",
+					c->length, c->size);
+				return CHECK_FAIL;
+			}
+			snprintf(msg, msgsize, "vanmoof ware %x.%x.%x (0x%02x == %s) CRC 0x%08x %s",
+				ware->version[3], ware->version[2], ware->version[1],
+				ware->version[0], ware_type_name(ware->version[0]),
+				c->crc, ok ? "OK" : "FAIL");
+			return ok ? CHECK_OK : CHECK_FAIL;
+		}
+		case CHECK_OAD: {
+			const ble_ware_t *ble = (const ble_ware_t *)c->head;
+			if (c->bad) {
+				snprintf(msg, msgsize, "BLE ware length 0x%08zx does not fit image size 0x%08zx",
+					c->length, c->size);
+				return CHECK_FAIL;
+			}
+			snprintf(msg, msgsize, "BLE ware version %08x CRC 0x%08x %s",
+				le32toh(ble->soft_ver), c->crc, ok ? "OK" : "FAIL");
+			return ok ? CHECK_OK : CHECK_FAIL;
+		}
+		case CHECK_VMFW:
+			if (c->bad) {
+				snprintf(msg, msgsize, "VMFW length 0x%08zx does not fit image size 0x%08zx",
+					c->length, c->size);
+				return CHECK_FAIL;
+			}
+			snprintf(msg, msgsize, "VMFW CRC 0x%08x %s", c->crc, ok ? "OK" : "FAIL");
+			return ok ? CHECK_OK : CHECK_FAIL;
+		case CHECK_HEAD:
+			snprintf(msg, msgsize, "HEAD wrapper, not verified (use crc32)");
+			return CHECK_UNVERIFIED;
+		case CHECK_PACK:
+			snprintf(msg, msgsize, "PACK file, not verified (use -r)");
+			return CHECK_UNVERIFIED;
+		default:
+			break;
+	}
+
+	/* ARM or unknown: only the bootloader trailer is left to check. */
+	if (c->size < sizeof(c->tail)) {
+		snprintf(msg, msgsize, "unrecognized image format, cannot verify");
+		return CHECK_UNVERIFIED;
+	}
+	memcpy(&trailer_crc, v + 4, sizeof(trailer_crc));
+	trailer_crc = le32toh(trailer_crc);
+	ok = c->crc == trailer_crc;
+
+	if (ok) {
+		snprintf(msg, msgsize, "bootloader version %c%c%c CRC 0x%08x OK", v[3], v[2], v[1], c->crc);
+		return CHECK_OK;
+	}
+	if (c->kind == CHECK_ARM) {
+		snprintf(msg, msgsize, "pure ARM binary, no bootloader CRC, cannot verify");
+		return CHECK_UNVERIFIED;
+	}
+	if (isprint(v[1]) && isprint(v[2]) && isprint(v[3])) {
+		snprintf(msg, msgsize, "bootloader version %c%c%c CRC 0x%08x FAIL (expected 0x%08x)",
+			v[3], v[2], v[1], c->crc, trailer_crc);
+		return CHECK_FAIL;
+	}
+	snprintf(msg, msgsize, "unrecognized image format, cannot verify");
+	return CHECK_UNVERIFIED;
+}
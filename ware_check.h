@@ -0,0 +1,77 @@
+#ifndef _WARE_CHECK_H
+#define _WARE_CHECK_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ware.h"
+
+/*
+ * The STM32 CRC unit: CRC-32/MPEG-2 (poly 0x04c11db7, not reflected, no
+ * final xor) fed with little endian 32-bit words. Used by the S3/X3 ware
+ * header and the bootloader trailer.
+ */
+#define STM32_CRC_INIT	0xffffffff
+
+/* `length` is rounded up to whole words, like the hardware reads them. */
+uint32_t crc32_calculate(uint32_t crc, const void *data, size_t length);
+
+/* CRC of a vanmoof_ware_t image with its crc and length fields blanked. */
+uint32_t ware_crc(uint32_t crc, const vanmoof_ware_t *ware, const void *data, size_t length);
+
+/*
+ * Finalise a vanmoof_ware_t image in place, as the boot loader will check
+ * it: length field = `size`, crc field = ware_crc over the whole image.
+ * Returns the new CRC, or 0 with nothing changed when `size` is not a
+ * word-aligned image of at least the header.
+ */
+uint32_t ware_stamp(void *img, size_t size);
+
+/* Does this look like a Cortex-M vector table (a plain ARM image)? */
+int test_arm(const uint8_t *data, size_t len);
+
+/*
+ * Incremental form of the integrity checks crc32 runs on a whole image,
+ * for tools that copy the image anyway (unpack --verify, pack --verify):
+ * the image is fed in pieces of any size as it passes through the copy
+ * loop, and the verdict is available once all `size` bytes are in. The
+ * image type is decided from the first bytes, in the same order as crc32's
+ * analyze(): ware, OAD, HEAD, PACK, VMFW, ARM bootloader, bare trailer.
+ */
+enum ware_check_kind {
+	CHECK_UNKNOWN,
+	CHECK_WARE,		/* vanmoof_ware_t, STM32 CRC */
+	CHECK_OAD,		/* BLE "OAD NVM1", zlib CRC from offset 12 */
+	CHECK_VMFW,		/* S5/A5/S6 VMFW at 0x134, zlib CRC */
+	CHECK_HEAD,		/* HEAD wrapper, checked by its SHA256 instead */
+	CHECK_PACK,		/* a nested PACK, nothing to check itself */
+	CHECK_ARM,		/* ARM image, bootloader trailer if present */
+};
+
+#define CHECK_OK	0
+#define CHECK_FAIL	1
+#define CHECK_UNVERIFIED 2
+
+#define WARE_CHECK_HEAD	(VMFW_OFFSET + sizeof(vmfw_ware_t))
+
+typedef struct {
+	size_t size;		/* image size, known up front */
+	size_t pos;		/* bytes fed so far */
+	int kind;
+	int bad;		/* header inconsistent, CRC can't match */
+	size_t from, length;	/* byte range covered by the running CRC */
+	uint32_t crc;
+	uint32_t expected;
+	uint8_t head[WARE_CHECK_HEAD];	/* detection window */
+	uint8_t word[4];	/* partial STM32 word */
+	size_t wlen;
+	uint8_t tail[8];	/* last 8 bytes: bootloader version + CRC */
+} ware_check_t;
+
+void ware_check_init(ware_check_t *c, size_t size);
+void ware_check_update(ware_check_t *c, const void *data, size_t len);
+
+/* Returns CHECK_OK, CHECK_FAIL or CHECK_UNVERIFIED and describes it. */
+int ware_check_final(ware_check_t *c, char *msg, size_t msgsize);
+
+#endif
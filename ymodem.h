@@ -0,0 +1,58 @@
+#ifndef _YMODEM_H
+#define _YMODEM_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * YMODEM, as spoken by the BLE console (pack-upload, audio-upload) and by
+ * muco-boot. The receiver starts every file by sending 'C' (CRC-16,
+ * acknowledged blocks) or 'G' (YMODEM-G: CRC-16, blocks streamed without
+ * acknowledgement, any error aborts the transfer). Block 0 carries the file
+ * name and size, an empty block 0 ends the batch. Blocks are
+ *
+ *   SOH|STX  seq  ~seq  128|1024 data bytes  CRC-16 (big endian)
+ *
+ * with the last one padded with CPMEOF. A receiver that answers NAK instead
+ * of 'C' wants the original one-byte checksum instead of the CRC.
+ */
+#define SOH	0x01		/* 128-byte block */
+#define STX	0x02		/* 1024-byte block */
+#define EOT	0x04
+#define ACK	0x06
+#define NAK	0x15
+#define CAN	0x18
+#define CPMEOF	0x1a
+
+#define YMODEM_CRC	'C'
+#define YMODEM_G	'G'
+
+#define BLOCK_SMALL	128
+#define BLOCK_LARGE	1024
+
+/* CRC-16/XMODEM: polynomial 0x1021, initial value 0, no reflection. */
+static uint16_t crc16_table[256];
+
+static void
+crc16_init(void)
+{
+	for (int i = 0; i < 256; i++) {
+		uint16_t crc = i << 8;
+
+		for (int bit = 0; bit < 8; bit++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		crc16_table[i] = crc;
+	}
+}
+
+static uint16_t
+crc16(const uint8_t *data, size_t len)
+{
+	uint16_t crc = 0;
+
+	while (len--)
+		crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *data++];
+	return crc;
+}
+
+#endif
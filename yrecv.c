@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+
+#include "ymodem.h"
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-g] [-b <baud>] [-l <ms>] [-e <rate>] [-s <seed>] [-d <dir>]\n", progname);
+	exit(1);
+}
+
+/*
+ * A YMODEM receiver on a pseudo terminal, standing in for the bike's
+ * console to try ysend (or any other sender) against: it prints the name
+ * of the pty to connect to and writes what it receives to <dir>. The
+ * line is slowed down to <baud> (10 bits per byte), each answer is
+ * delayed by the turnaround of a USB serial adapter (-l), and -e makes
+ * that fraction of the blocks fail their check.
+ */
+static long baud = 115200;
+static double latency = 0.002;
+static double error_rate;
+
+static double line_free;		/* when the simulated line is idle */
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sleep_until(double t)
+{
+	double d = t - now();
+	struct timespec ts;
+
+	if (d <= 0)
+		return;
+	ts.tv_sec = d;
+	ts.tv_nsec = (d - ts.tv_sec) * 1e9;
+	nanosleep(&ts, NULL);
+}
+
+/* `len` bytes, at line rate; 0 if the sender went quiet for `ms`. */
+static int
+get(int fd, uint8_t *buf, size_t len, int ms)
+{
+	struct pollfd p = { .fd = fd, .events = POLLIN };
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len) {
+		if (poll(&p, 1, ms) <= 0)
+			return 0;
+		n = read(fd, buf + got, len - got);
+		if (n <= 0)
+			return 0;
+		if (line_free < now())
+			line_free = now();
+		line_free += n * 10.0 / baud;
+		sleep_until(line_free);
+		got += n;
+	}
+	return 1;
+}
+
+static void
+answer(int fd, uint8_t c)
+{
+	sleep_until(now() + latency);
+	if (write(fd, &c, 1) != 1) {
+		fprintf(stderr, "%s: write: %s\n", progname, strerror(errno));
+		exit(1);
+	}
+}
+
+/* Drop what is still coming, until the line has been quiet for `ms`. */
+static void
+drain(int fd, int ms)
+{
+	uint8_t c;
+
+	while (get(fd, &c, 1, ms))
+		;
+}
+
+enum { BLOCK_OK, BLOCK_BAD, BLOCK_EOT, BLOCK_CAN, BLOCK_NONE };
+
+/* One block into data; sets *seq and *size. */
+static int
+get_block(int fd, uint8_t *data, uint8_t *seq, size_t *size, int ms)
+{
+	uint8_t c, hdr[2], crc[2];
+	uint16_t want;
+
+	if (!get(fd, &c, 1, ms))
+		return BLOCK_NONE;
+	if (c == EOT)
+		return BLOCK_EOT;
+	if (c == CAN)
+		return BLOCK_CAN;
+	if (c != SOH && c != STX)
+		return BLOCK_BAD;
+
+	*size = c == STX ? BLOCK_LARGE : BLOCK_SMALL;
+	if (!get(fd, hdr, 2, 1000) || !get(fd, data, *size, 1000) || !get(fd, crc, 2, 1000))
+		return BLOCK_BAD;
+	if ((hdr[0] ^ hdr[1]) != 0xff)
+		return BLOCK_BAD;
+
+	want = crc[0] << 8 | crc[1];
+	if (crc16(data, *size) != want || (double)rand() / RAND_MAX < error_rate)
+		return BLOCK_BAD;
+	*seq = hdr[0];
+	return BLOCK_OK;
+}
+
+/*
+ * One file. Returns 1 when a file was received, 0 at the end of the
+ * batch; -1 when the file has to be sent again.
+ */
+static int
+receive_file(int fd, const char *dir, int streaming)
+{
+	uint8_t data[BLOCK_LARGE], seq, expect = 1;
+	uint8_t start = streaming ? YMODEM_G : YMODEM_CRC;
+	char name[BLOCK_SMALL], path[4096];
+	size_t size, length, received = 0;
+	double started;
+	int r, tries;
+	FILE *out;
+
+	/* Ask for block 0 until the sender starts. */
+	for (tries = 0; tries < 60; tries++) {
+		answer(fd, start);
+		r = get_block(fd, data, &seq, &size, 1000);
+		if (r == BLOCK_OK && seq == 0)
+			break;
+		if (r == BLOCK_CAN)
+			return 0;
+		drain(fd, 50);
+	}
+	if (tries == 60) {
+		fprintf(stderr, "%s: no sender\n", progname);
+		exit(1);
+	}
+	answer(fd, ACK);
+	if (data[0] == '\0')
+		return 0;
+
+	snprintf(name, sizeof(name), "%.*s", (int)sizeof(name) - 1, (char *)data);
+	length = strtoul((char *)data + strlen(name) + 1, NULL, 10);
+	if (strchr(name, '/') || name[0] == '.') {
+		fprintf(stderr, "%s: refusing file name %s\n", progname, name);
+		exit(1);
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	out = fopen(path, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+
+	started = now();
+	answer(fd, start);
+	for (;;) {
+		r = get_block(fd, data, &seq, &size, 10000);
+		if (r == BLOCK_EOT) {
+			answer(fd, ACK);
+			break;
+		}
+		if (r == BLOCK_CAN || r == BLOCK_NONE) {
+			fprintf(stderr, "%s: %s: transfer aborted\n", progname, name);
+			exit(1);
+		}
+		if (r == BLOCK_BAD || (seq != expect && seq != (uint8_t)(expect - 1))) {
+			if (streaming) {
+				/* YMODEM-G has no retransmission: cancel, then offer 'C'. */
+				answer(fd, CAN);
+				answer(fd, CAN);
+				drain(fd, 200);
+				fclose(out);
+				fprintf(stderr, "%s: %s: bad block at %zu, cancelled\n", progname, name, received);
+				return -1;
+			}
+			drain(fd, 50);
+			answer(fd, NAK);
+			continue;
+		}
+
+		if (seq == expect) {
+			if (size > length - received)
+				size = length - received;
+			fwrite(data, 1, size, out);
+			received += size;
+			expect++;
+		}
+		if (!streaming)
+			answer(fd, ACK);
+	}
+
+	if (fclose(out) != 0 || received != length) {
+		fprintf(stderr, "%s: %s: %zu of %zu bytes\n", progname, path, received, length);
+		exit(1);
+	}
+	fprintf(stderr, "%s: %s: %zu bytes in %.2fs, %s\n", progname, path, length, now() - started,
+		streaming ? "streamed" : "acknowledged");
+	return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *dir = ".";
+	struct termios tio;
+	int master, slave, opt, g = 0, r, files = 0;
+	unsigned seed = 1;
+	char *name;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "gb:l:e:s:d:")) != -1) {
+		switch (opt) {
+			case 'g':
+				g = 1;
+				break;
+			case 'b':
+				baud = strtol(optarg, NULL, 0);
+				break;
+			case 'l':
+				latency = strtod(optarg, NULL) / 1000;
+				break;
+			case 'e':
+				error_rate = strtod(optarg, NULL);
+				break;
+			case 's':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc || baud <= 0)
+		usage();
+	srand(seed);
+	crc16_init();
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 || (name = ptsname(master)) == NULL) {
+		fprintf(stderr, "%s: posix_openpt: %s\n", progname, strerror(errno));
+		exit(1);
+	}
+
+	/* Raw, and held open so the pty stays up between senders. */
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0 || tcgetattr(slave, &tio) < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, name, strerror(errno));
+		exit(1);
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	printf("%s\n", name);
+	fflush(stdout);
+
+	while ((r = receive_file(master, dir, g)) != 0) {
+		if (r < 0)
+			g = 0;
+		else
+			files++;
+	}
+	fprintf(stderr, "%s: %d files\n", progname, files);
+
+	/* Closing the master hangs up the pty and drops the last ACK unread. */
+	sleep_until(now() + 0.5);
+	close(slave);
+	close(master);
+	return 0;
+}
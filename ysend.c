@@ -0,0 +1,415 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "ymodem.h"
+
+static char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-b <baud>] [-c <command>] [-s] <tty> <file>...\n", progname);
+	exit(1);
+}
+
+#define RETRIES		10
+#define START_TIMEOUT	60000		/* ms, the receiver polls every few seconds */
+#define ACK_TIMEOUT	10000
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Next byte from the receiver, or -1 after `ms` milliseconds. */
+static int
+get_byte(int fd, int ms)
+{
+	struct pollfd p = { .fd = fd, .events = POLLIN };
+	uint8_t c;
+
+	if (poll(&p, 1, ms) <= 0)
+		return -1;
+	if (read(fd, &c, 1) != 1)
+		return -1;
+	return c;
+}
+
+static void
+put(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: write: %s\n", progname, strerror(errno));
+			exit(1);
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+/*
+ * Wait for the receiver to ask for a file: 'C', 'G' or NAK. Whatever else
+ * comes first (the console echoing the upload command) is passed on to
+ * stderr; a start character only counts when the line is quiet after it,
+ * so a 'C' in that text is not taken for one. An ACK of block 0 before
+ * it is skipped. Returns -1 on CAN or time out.
+ */
+static int
+wait_start(int fd, int ms)
+{
+	double deadline = now() + ms / 1000.0;
+	int c, next;
+
+	while (now() < deadline) {
+		c = get_byte(fd, 100);
+		if (c < 0)
+			continue;
+		if (c == YMODEM_CRC || c == YMODEM_G || c == NAK) {
+			next = get_byte(fd, 20);
+			if (next < 0 || next == c)
+				return c;
+			fputc(c, stderr);
+			c = next;
+		}
+		if (c == CAN && get_byte(fd, 1000) == CAN)
+			return -1;
+		if (c != ACK)
+			fputc(c, stderr);
+	}
+	return -1;
+}
+
+/* Read and drop whatever the receiver still sends. */
+static void
+drain(int fd, int ms)
+{
+	while (get_byte(fd, ms) >= 0)
+		;
+}
+
+/* One block: 128 or 1024 bytes of `data` (padded with `pad`). */
+static size_t
+make_block(uint8_t *block, uint8_t seq, const uint8_t *data, size_t len, size_t size, uint8_t pad, int checksum)
+{
+	uint16_t crc;
+	uint8_t sum = 0;
+
+	block[0] = size == BLOCK_LARGE ? STX : SOH;
+	block[1] = seq;
+	block[2] = ~seq;
+	memcpy(block + 3, data, len);
+	memset(block + 3 + len, pad, size - len);
+
+	if (checksum) {
+		for (size_t i = 0; i < size; i++)
+			sum += block[3 + i];
+		block[3 + size] = sum;
+		return 3 + size + 1;
+	}
+	crc = crc16(block + 3, size);
+	block[3 + size] = crc >> 8;
+	block[4 + size] = crc;
+	return 3 + size + 2;
+}
+
+/* Send a block and wait for its ACK; 0 if it never came, -1 on CAN. */
+static int
+send_acked(int fd, const uint8_t *block, size_t len)
+{
+	int c;
+
+	for (int tries = 0; tries < RETRIES; tries++) {
+		put(fd, block, len);
+		c = get_byte(fd, ACK_TIMEOUT);
+		if (c == ACK)
+			return 1;
+		if (c == CAN && get_byte(fd, 1000) == CAN)
+			return -1;
+		drain(fd, 50);
+	}
+	return 0;
+}
+
+static const char *
+base_name(const char *path)
+{
+	const char *base = strrchr(path, '/');
+
+	return base ? base + 1 : path;
+}
+
+typedef struct {
+	const char *name;
+	const uint8_t *data;
+	size_t size;
+} file_t;
+
+enum { SENT, RESTART, FAILED };
+
+/*
+ * One file, in the mode the receiver asked for: streamed if 'G',
+ * otherwise each block acknowledged. `small` sends 128-byte blocks only.
+ */
+static int
+send_file(int fd, const file_t *f, int start, int small)
+{
+	uint8_t block[3 + BLOCK_LARGE + 2], header[BLOCK_SMALL];
+	int streaming = start == YMODEM_G, checksum = start == NAK, c;
+	size_t offset, len, size, n;
+	uint8_t seq = 1;
+	int name_len;
+
+	/* Block 0: name and size; main() checked that they fit. */
+	memset(header, 0, sizeof(header));
+	name_len = snprintf((char *)header, sizeof(header) - 1, "%s", base_name(f->name));
+	snprintf((char *)header + name_len + 1, sizeof(header) - name_len - 1, "%zu", f->size);
+	n = make_block(block, 0, header, sizeof(header), BLOCK_SMALL, 0, checksum);
+
+	if (streaming) {
+		put(fd, block, n);
+	} else if (send_acked(fd, block, n) <= 0) {
+		return FAILED;
+	}
+
+	/* The receiver asks again for the data. */
+	c = wait_start(fd, ACK_TIMEOUT);
+	if (c < 0)
+		return FAILED;
+	streaming = c == YMODEM_G;
+	checksum = c == NAK;
+
+	for (offset = 0; offset < f->size; offset += len) {
+		size = small || checksum || f->size - offset <= BLOCK_SMALL ? BLOCK_SMALL : BLOCK_LARGE;
+		len = f->size - offset < size ? f->size - offset : size;
+		n = make_block(block, seq++, f->data + offset, len, size, CPMEOF, checksum);
+
+		if (streaming) {
+			put(fd, block, n);
+			/* A YMODEM-G receiver only ever talks to cancel. */
+			c = get_byte(fd, 0);
+			if (c == CAN) {
+				fprintf(stderr, "\n%s: %s: cancelled by the receiver at %zu, restarting in the mode it asks for\n",
+					progname, f->name, offset);
+				drain(fd, 200);
+				return RESTART;
+			}
+		} else {
+			c = send_acked(fd, block, n);
+			if (c <= 0)
+				return FAILED;
+		}
+
+		if (seq % 64 == 0)
+			fprintf(stderr, "\r%s: %zu/%zu", f->name, offset + len, f->size);
+	}
+
+	for (int tries = 0; tries < RETRIES; tries++) {
+		put(fd, (uint8_t []){ EOT }, 1);
+		c = get_byte(fd, ACK_TIMEOUT);
+		if (c == ACK)
+			return SENT;
+		if (c == CAN)
+			return streaming ? RESTART : FAILED;
+	}
+	return FAILED;
+}
+
+static uint8_t *
+read_file(const char *path, size_t *lenp)
+{
+	struct stat st;
+	uint8_t *buf;
+	size_t total;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: fstat(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+
+	buf = malloc(st.st_size ? st.st_size : 1);
+	if (buf == NULL) {
+		fprintf(stderr, "%s: malloc(%zu): Out of memory\n", progname,
+			(size_t)st.st_size);
+		exit(1);
+	}
+
+	total = 0;
+	while (total < (size_t)st.st_size) {
+		n = read(fd, buf + total, st.st_size - total);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read(%s): %s\n", progname, path,
+				n < 0 ? strerror(errno) : "short read");
+			exit(1);
+		}
+		total += n;
+	}
+	close(fd);
+
+	*lenp = total;
+	return buf;
+}
+
+static speed_t
+baud_rate(long baud)
+{
+	static const struct { long baud; speed_t speed; } rates[] = {
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+		{ 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 }, { 921600, B921600 },
+	};
+
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+		if (rates[i].baud == baud)
+			return rates[i].speed;
+	fprintf(stderr, "%s: unsupported baud rate %ld\n", progname, baud);
+	exit(1);
+}
+
+static int
+open_tty(const char *path, long baud)
+{
+	struct termios tio;
+	int fd;
+
+	fd = open(path, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	if (tcgetattr(fd, &tio) < 0) {
+		fprintf(stderr, "%s: tcgetattr(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, baud_rate(baud));
+	cfsetospeed(&tio, baud_rate(baud));
+	if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+		fprintf(stderr, "%s: tcsetattr(%s): %s\n", progname, path, strerror(errno));
+		exit(1);
+	}
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *command = NULL;
+	uint8_t block[3 + BLOCK_SMALL + 2], empty[BLOCK_SMALL];
+	long baud = 115200;
+	int fd, opt, small = 0, start, result, nfiles;
+	double started, elapsed;
+	file_t *files;
+	size_t total = 0, n;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "b:c:s")) != -1) {
+		switch (opt) {
+			case 'b':
+				baud = strtol(optarg, NULL, 0);
+				break;
+			case 'c':
+				command = optarg;
+				break;
+			case 's':
+				small = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind < 2)
+		usage();
+
+	crc16_init();
+	nfiles = argc - optind - 1;
+	files = calloc(nfiles, sizeof(*files));
+	for (int i = 0; i < nfiles; i++) {
+		files[i].name = argv[optind + 1 + i];
+		files[i].data = read_file(files[i].name, &files[i].size);
+		/* Block 0 holds the name, a NUL, the size in decimal and a NUL. */
+		if (strlen(base_name(files[i].name)) + snprintf(NULL, 0, "%zu", files[i].size) + 2 > BLOCK_SMALL) {
+			fprintf(stderr, "%s: %s: name too long for block 0\n", progname, files[i].name);
+			exit(1);
+		}
+	}
+
+	fd = open_tty(argv[optind], baud);
+	if (command) {
+		put(fd, command, strlen(command));
+		put(fd, "\r", 1);
+	}
+
+	for (int i = 0; i < nfiles; i++) {
+		started = now();
+		result = RESTART;
+		for (int tries = 0; result == RESTART && tries < 3; tries++) {
+			start = wait_start(fd, START_TIMEOUT);
+			if (start < 0) {
+				fprintf(stderr, "%s: %s: receiver not ready\n", progname, files[i].name);
+				exit(1);
+			}
+			/* YMODEM-G failed once; streaming it again would fail the same way. */
+			if (tries > 0 && start == YMODEM_G) {
+				fprintf(stderr, "%s: %s: receiver asks for YMODEM-G again\n", progname, files[i].name);
+				break;
+			}
+			result = send_file(fd, &files[i], start, small);
+		}
+		if (result != SENT) {
+			put(fd, (uint8_t []){ CAN, CAN, CAN }, 3);
+			fprintf(stderr, "\n%s: %s: transfer failed\n", progname, files[i].name);
+			exit(1);
+		}
+
+		elapsed = now() - started;
+		total += files[i].size;
+		fprintf(stderr, "\r%s: %zu bytes in %.2fs, %.1f KiB/s (%.0f%% of %ld baud)\n",
+			files[i].name, files[i].size, elapsed, files[i].size / elapsed / 1024,
+			100.0 * files[i].size * 10 / baud / elapsed, baud);
+	}
+
+	/* An empty block 0 ends the batch. */
+	memset(empty, 0, sizeof(empty));
+	start = wait_start(fd, ACK_TIMEOUT);
+	n = make_block(block, 0, empty, sizeof(empty), BLOCK_SMALL, 0, start == NAK);
+	if (start < 0 || send_acked(fd, block, n) <= 0)
+		fprintf(stderr, "%s: no acknowledgement for the end of the batch\n", progname);
+
+	fprintf(stderr, "%s: %d files, %zu bytes\n", progname, nfiles, total);
+	close(fd);
+	return 0;
+}